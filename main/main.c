@@ -8,27 +8,64 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <inttypes.h>
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/md.h"
+#include "mbedtls/platform_util.h"
+
+#include "freertos/timers.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_heap_caps.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <fcntl.h>
+#include <pty.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+/* linux target has no Bluetooth, sessions are still keyed by 6 byte peer address */
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+#else
 #include "esp_bt.h"
 #include "esp_bt_main.h"
 #include "esp_gap_bt_api.h"
 #include "esp_bt_device.h"
 #include "esp_spp_api.h"
-#include "freertos/queue.h"
-
 #include "driver/gpio.h"
 #include "driver/touch_pad.h"
-#include "freertos/timers.h"
+#include "driver/uart.h"
+#include "esp_pm.h"
+#include "esp_freertos_hooks.h"
+#endif
 #define BLUE_LED GPIO_NUM_2
 #define TOUCH_THRESH_NO_USE   (0)
 #define TOUCH_PAD_IO (0)
-#define TOUCH_THRESH_PERCENT  (80)
+#define TOUCH_THRESH_PERCENT  (80) /* pad is touched below this part of baseline */
+#define TOUCH_RELEASE_PERCENT (90) /* pad is released above this part of baseline */
+#define TOUCH_BASELINE_TAU_MS (60*1000) /* time constant of baseline following drift */
+#define TOUCH_BASELINE_MS (10*1000) /* baseline refresh period when interrupt waits for touch */
+#define TOUCH_TRACE 0 /* 1: log every sample as "trace:<ms>,<value>,<baseline>,<event>" for replay */
+#define TOUCH_REPLAY_REPORT 10 /* differing samples logged by host trace replay */
 #define TOUCHPAD_FILTER_TOUCH_PERIOD (10)
+#define TOUCHPAD_FILTER_IDLE_PERIOD (TOUCH_BASELINE_MS/4) /* filter period while interrupt waits, it only feeds baseline refresh */
+#define TOUCH_FILTER_SETTLE_MS (5*TOUCHPAD_FILTER_TOUCH_PERIOD) /* filter follows pad after switch to touch period */
+#define TOUCH_INTERRUPT 1 /* 1: threshold interrupt wakes touch task, 0: task polls pad every TOUCH_SAMPLE_MS */
+#define TOUCH_SAMPLE_MS 10 /* pad sampling period while touch is evaluated */
+#define TOUCH_DEBOUNCE_MS 300 /* pad state has to be stable that long to count */
+#define TOUCH_REPORT_MS (60*60*1000) /* period of wakeups per hour report */
 #define TCH_PAD "TOUCH_PAD"
 #define RNW_TIM "RENEW_TIMER"
 #define TIM_CB "TIMER_CALLBACK"
@@ -45,6 +82,20 @@
 #define REM_NVS "REMOVE_NVS"
 #define LOGPASS "LOG_PASS"
 #define EXTRUI "EXTRACT_ELEMENT"
+#define VLT_KEY "VAULT_KEY"
+#define CHN_TAG "SECURE_CHANNEL"
+#define SES_TAG "SESSION"
+#define CON_TAG "CONNECTION"
+#define PWR_TAG "POWER"
+#define TSK_TAG "TASK_TOPOLOGY"
+#define BOOT_TAG "BOOT"
+#define TRC_TAG "TRACE"
+#define STO_TAG "STORE_VERSION"
+#define SNP_TAG "STORE_SNAPSHOT"
+#define MEM_TAG "MEMORY"
+#define BKP_TAG "BACKUP"
+#define TRN_TAG "TRANSPORT"
+#define BNC_TAG "BENCHMARK"
 #define SPP_SERVER_NAME "SPP_SERVER"
 
 #define EXAMPLE_DEVICE_NAME "LOG3spe2"
@@ -52,22 +103,400 @@
 #define SPP_SHOW_DATA 0
 #define SPP_SHOW_SPEED 1
 #define SPP_SHOW_MODE SPP_SHOW_DATA    /*Choose show mode: show data or speed*/
-#define MAX_TELEGRAM 100
+#define MAX_TELEGRAM 512 /* longest reply which can be assembled */
+#define MAX_SPP_PACKET 128 /* biggest chunk of data passed to SPP at once */
 #define EXT ',' /* separator in telegram*/
+#define SEQ '#' /* optional mutation sequence number follows telegram mode, e.g. 5#17,domain,login,password */
+
+#define VAULT_NAMESPACE "vault" /* namespace with device secret, never erased with credentials */
+#define VAULT_SECRET "secret"
+#define VAULT_SECRET_LEN 32
+#define VAULT_KEY_BITS 256
+#define VAULT_KDF_INFO "log3spe2 vault v1"
+#define VAULT_MAC_LEN 16
+#define VAULT_NONCE_LEN 12
+#define VAULT_FORMAT 1 /* layout of sealed record: ciphertext | mac | nonce | format */
+#define VAULT_OVERHEAD (VAULT_MAC_LEN+VAULT_NONCE_LEN+1)
+#define VAULT_LOCK_WAIT (10 / portTICK_PERIOD_MS) /* how long close/timer event waits for busy vault */
+
+#define CHANNEL_FRAME 0x17 /* first byte of AEAD frame, plaintext telegram starts with digit */
+#define CHANNEL_HEADER 3 /* CHANNEL_FRAME | big endian length of ciphertext and mac */
+#define CHANNEL_REQUIRED 0 /* 1: only handshake telegrams are accepted in plaintext, 0 lets stripped handshake downgrade new client */
+#define CHANNEL_IDENTITY "identity" /* static X25519 key of device in vault namespace */
+#define CHANNEL_KEY_LEN 32
+#define CHANNEL_MAC_LEN 16
+#define CHANNEL_NONCE_LEN 16 /* client/server nonce mixed into resumed keys */
+#define CHANNEL_TICKET_LEN 16
+#define CHANNEL_TICKETS 4 /* resumption tickets kept in RAM */
+#define CHANNEL_TICKET_LIFETIME (10*60*1000 / portTICK_PERIOD_MS) /* ticket accepted up to 10 minutes after issue */
+#define CHANNEL_HELLO_INFO "log3spe2 channel v1"
+#define CHANNEL_RESUME_INFO "log3spe2 resume v1"
+
+#define SESSION_SLOTS 4 /* remembered peers (remote BDA) */
+#define SESSION_PENDING 2 /* unacknowledged credential replies kept per peer */
+#define SESSION_GRACE (2*60*1000 / portTICK_PERIOD_MS) /* state of disconnected peer is kept 2 minutes */
+#define SESSION_PLAIN 1 /* protocol version spoken by peer */
+#define SESSION_SECURE 2 /* peer uses secure channel, plaintext is refused after reconnection */
+#define SESSION_MUTATIONS 4 /* results of last sequenced mutations remembered per peer */
+
+#define STORE_SYNC "sync" /* namespace with store version and oldest complete version */
+#define STORE_INDEX "index" /* namespace with version of every stored domain */
+#define STORE_TOMBS "tombstone" /* namespace with version of every erased domain */
+#define STORE_TOMBSTONES 16 /* erased domains remembered, older clients get full listing */
+#define STORE_SYNC_BATCH 24 /* changes collected for one UI_SYNC reply */
+#define STORE_SYNC_MORE 1 /* UI_SYNC flag: ask again from returned version */
+#define STORE_SYNC_RESET 2 /* UI_SYNC flag: drop known domains, listing starts from scratch */
+#define STORE_LIST_PAGE 8 /* domains in one UI_LIST reply */
+
+#define BACKUP_NAMESPACE "restore" /* namespace with archive staged by UI_IMPORT, applied once it is verified */
+#define BACKUP_MAGIC "L3B1"
+#define BACKUP_KEY_LEN 32 /* key chosen by LOGPC, archive is restored on any device which gets it */
+#define BACKUP_KDF_INFO "log3spe2 backup v1"
+#define BACKUP_CHECK_LEN 8 /* staged archive keeps HMAC of this length to recognize its key */
+#define BACKUP_SALT_LEN 16
+#define BACKUP_HEADER (4+4+4+BACKUP_SALT_LEN) /* magic | store version | domains | salt, big endian */
+#define BACKUP_TAG_LEN 32 /* HMAC-SHA256 of archive, follows terminating zero */
+#define BACKUP_RECORD_MAX (3+NVS_KEY_NAME_MAX_SIZE+MAX_TELEGRAM+VAULT_MAC_LEN) /* domain length | domain | length | ciphertext | mac */
+#define BACKUP_CHUNK 224 /* archive bytes in one telegram, hex encoded with offset and crc they fit MAX_TELEGRAM */
+#define BACKUP_COMMIT 8 /* records staged between NVS commits */
+#define BACKUP_RESTORE_RESERVE 126 /* NVS entries (one page) which restore leaves free for garbage collection */
+
+#define TRANSPORT_SPP 1 /* Bluetooth SPP in callback mode */
+#define TRANSPORT_UART 2 /* USB-serial/UART, pty on linux target */
+#if CONFIG_IDF_TARGET_LINUX
+#define TRANSPORTS TRANSPORT_UART
+#else
+#define TRANSPORTS TRANSPORT_SPP /* backends started at boot, e.g. (TRANSPORT_SPP|TRANSPORT_UART) */
+#endif
+#define TRANSPORT_BACKENDS 2
+#define TRANSPORT_UART_PORT 1 /* UART0 carries console log */
+#define TRANSPORT_UART_TX 17
+#define TRANSPORT_UART_RX 16
+#define TRANSPORT_UART_BAUD 921600
+#define TRANSPORT_UART_BUF 1024 /* receive ring of UART driver, send waits until bytes leave the line */
+#define TRANSPORT_UART_IDLE_MS 10 /* read returns after line is that long idle */
+#define TRANSPORT_UART_HANDLE 0x55415254 /* serial client has no SPP handle, "UART" keeps it apart from them */
+
+#define CONN_SLOTS 3 /* concurrent clients of all transports */
+#define CONN_RX_DEPTH 10 /* received packets waiting for worker per connection */
+#define CONN_TX_BUF 1024 /* bytes waiting for uncongested link per connection */
+#define CONN_IN_FLIGHT 8 /* sends of connection timed until transport confirms their delivery */
+#define CONN_FRAME_BUF (CHANNEL_HEADER+MAX_TELEGRAM+CHANNEL_MAC_LEN+1) /* AEAD frame collected from packets */
+
+#define TOUCH_ROUTE_LAST_ACTIVE 0 /* UI_DOMAIN goes to connection which sent last telegram */
+#define TOUCH_ROUTE_ALL 1 /* UI_DOMAIN goes to every connection */
+#define TOUCH_ROUTE_PRIMARY 2 /* UI_DOMAIN goes to connection opened first */
+#define TOUCH_ROUTE TOUCH_ROUTE_LAST_ACTIVE
+#define HINT_LIFETIME pdMS_TO_TICKS(2*60*1000) /* prepared reply older than that is not sent on touch */
+
+#define POWER_IDLE_MS (30*1000) /* without touch or telegram CPU may slow down */
+#define POWER_SLEEP_MS (5*60*1000) /* without touch or telegram CPU may enter light sleep */
+#define POWER_MIN_FREQ_MHZ 40 /* XTAL frequency, used in idle and light sleep */
+
+/* Bluedroid and controller are pinned to core 0, application tasks go to the other one */
+#if CONFIG_FREERTOS_UNICORE
+#define TASK_APP_CORE 0
+#else
+#define TASK_APP_CORE 1
+#endif
+#define TASK_WORKER_CORE TASK_APP_CORE /* core of process_telegram, tskNO_AFFINITY lets scheduler choose */
+#define TASK_WORKER_PRIO 2
+#define TASK_WORKER_STACK 6144
+#define TASK_TOUCH_CORE TASK_APP_CORE
+#define TASK_TOUCH_PRIO 5 /* short bursts, has to sample pad on time */
+#define TASK_TOUCH_STACK 5120 /* opens hinted record on touch */
+#define TASK_UART_CORE TASK_APP_CORE
+#define TASK_UART_PRIO 4 /* reader stands in for BT callback, above worker */
+#define TASK_UART_STACK 2560
+#define TASK_WRITER 1 /* 1: storage writer stores and erases records, 0: worker does it between telegrams */
+#define TASK_WRITER_CORE TASK_APP_CORE
+#define TASK_WRITER_PRIO 1 /* below worker, lookups of other clients go first while flash is written */
+#define TASK_WRITER_STACK 4096 /* seals record and sends reply */
+#define TASK_LOGGER 0 /* 1: log lines are queued and printed by logger, 0: every task prints its own lines */
+#define TASK_LOGGER_CORE TASK_APP_CORE
+#define TASK_LOGGER_PRIO 1
+#define TASK_LOGGER_STACK 2560
+#define LOGGER_DEPTH 8 /* lines waiting for logger, further ones are dropped and counted */
+#define LOGGER_LINE 160 /* longer log line is cut */
+#define TASK_LATENCY_REPORT 50 /* packets between latency reports of worker */
+
+#define TRACE_RECORDER 0 /* 1: record link traffic into RAM ring, downloaded with UI_TRACE */
+#define TRACE_RECORDS 64 /* records kept in ring, oldest one is overwritten */
+#define TRACE_PAYLOAD 32 /* redacted payload bytes kept per record */
+#define TRACE_PER_TELEGRAM 4 /* records in one UI_TRACE reply, hex encoded they fit MAX_TELEGRAM */
+#define TRACE_REPLAY_RECORDS BENCH_SAMPLES /* records read from trace file by host replay */
+#define TRACE_REPLAY_REPORT 10 /* missing replies logged by host trace replay */
+
+#ifndef STATIC_MEMORY /* main/CMakeLists.txt compiles STATIC_MEMORY 1 variant with every build */
+#define STATIC_MEMORY 0 /* 1: buffers come from static pools, application does not touch heap after boot */
+#endif
+#define MEM_ALIGN(n) (((n)+7)&~(size_t)7)
+#define MEM_SMALL_SIZE 32 /* block of small pool, fits packet descriptor or short telegram element after 8 byte header */
+#define MEM_SMALL_BLOCKS 32
+#define MEM_LARGE_SIZE 584 /* block of large pool, fits AEAD frame, sealed record or UI_SYNC batch after 8 byte header */
+#define MEM_LARGE_BLOCKS 24
+#define STORE_SNAPSHOT_MAX 128 /* domains indexed with STATIC_MEMORY, bigger storage is looked up in NVS */
+#define STORE_SNAPSHOT_BUFFERS 3 /* current snapshot, one being built and one still held by reader */
+#define STORE_STRESS_READERS 3 /* reader tasks of host snapshot stress check */
+#define STORE_STRESS_STACK 4096
+#define STORE_STRESS_DOMAINS 48 /* domains updated by host snapshot stress check */
+#define BENCH_SAMPLES 1024 /* most samples of one series kept by host benchmarks */
+#define VAULT_BENCH_MIN 16 /* smallest plaintext sealed by host vault benchmark, size doubles up to max */
+#define VAULT_BENCH_MAX 512 /* largest one, its record still fits large block */
+#define VAULT_BENCH_KEY "bench" /* domain authenticated with benchmark records, nothing is stored */
+#define CHANNEL_BENCH_PAYLOAD 64 /* echoed by host channel benchmark in plaintext and sealed */
+#define TRANSPORT_BENCH_PAYLOAD 256 /* echoed through every backend by host transport benchmark, reply spans several chunks */
+#define LOAD_DOMAINS 8 /* domains cycled by host load generator */
+#define LOAD_WARMUP 4 /* requests before host load generator takes memory baseline */
+#define LOAD_TIMEOUT_MS 5000 /* host load generator waits that long for request to be answered */
+#define LOAD_HANDLE 0x4c4f4144 /* "LOAD", first client of host load generator */
+#define LOAD_CLIENTS 2 /* clients of host load generator, third slot stays free for UART */
+#define LOAD_RX_BUF 512 /* bytes kept for every client of host load generator */
+
+/* static RAM per subsystem in bytes, build fails when subsystem outgrows its limit */
+#define RAM_LIMIT_TASKS (26*1024)
+#define RAM_LIMIT_CONNECTIONS (12*1024)
+#define RAM_LIMIT_SESSIONS (4*1024)
+#define RAM_LIMIT_POOLS (16*1024)
+#define RAM_LIMIT_STORE (12*1024)
+#define RAM_LIMIT_TRACE (8*1024)
+#define RAM_LIMIT_BACKUP (4*1024)
+#define RAM_LIMIT_TOTAL (64*1024)
+/* heap watermarks, mbedTLS contexts are the only heap buffers left with STATIC_MEMORY */
+#define HEAP_LIMIT_CRYPTO (8*1024) /* most bytes mbedTLS may hold at once */
+#define HEAP_FLOOR (24*1024) /* least free heap since boot, Bluedroid allocates on every connection */
+#if TRANSPORTS & TRANSPORT_SPP
 static const esp_spp_mode_t esp_spp_mode = ESP_SPP_MODE_CB;
 static const bool esp_spp_enable_l2cap_ertm = true;
+#endif
 
 // static SemaphoreHandle_t mtx_timer_expired = NULL;
 TimerHandle_t xTimer_inactivity;
+static StaticTimer_t xTimer_inactivity_buffer;
 
-static bool connection_established=false; //TODO:MUTEX!!!
-static uint32_t serial_handle=0;
+#if TRANSPORTS & TRANSPORT_SPP
 static struct timeval time_old;
 
 static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHENTICATE;
 static const esp_spp_role_t role_slave = ESP_SPP_ROLE_SLAVE;
+#endif
 
+#if !CONFIG_IDF_TARGET_LINUX
 static uint32_t pad_init_val;
+#endif
+
+/* untouched pad value following temperature and humidity drift */
+typedef struct
+{
+    int32_t             value_q8;       /*!< Baseline, 8 fractional bits */
+    int64_t             remainder;      /*!< Part of tracking step below 1/256 count, carried to next sample */
+    uint32_t            updated_ms;     /*!< Time of last tracked sample */
+    bool                touched;        /*!< Sample state with hysteresis */
+}touch_baseline;
+
+/* debounce of touch pad samples, independent of FreeRTOS so it can be fed with recorded traces */
+typedef struct
+{
+    bool                sample;         /*!< Last sample */
+    bool                steady;         /*!< Debounced state */
+    uint32_t            changed_ms;     /*!< Time of last sample change */
+}touch_debounce;
+
+typedef enum
+{
+    TOUCH_NONE = 0,
+    TOUCH_PRESSED,
+    TOUCH_RELEASED,
+}touch_event;
+
+/* pad classification of one sample stream, fed by touch task on device and by trace replay on host */
+typedef struct
+{
+    touch_baseline      tb;
+    touch_debounce      db;
+    bool                candidate;      /*!< Touched sample seen since pad was idle */
+    bool                pressed;        /*!< Candidate ended as activation */
+    uint32_t            accepted;       /*!< Debounced touches which woke LOGPC */
+    uint32_t            rejected;       /*!< Touched samples which did not last */
+}touch_detector;
+
+static TaskHandle_t touch_task = NULL;
+
+/* power states, every next one saves more energy and answers slower */
+typedef enum
+{
+    PWR_ACTIVE = 0,     /*!< CPU at full frequency, no light sleep */
+    PWR_IDLE,           /*!< CPU frequency may drop, no light sleep */
+    PWR_SLEEP,          /*!< automatic light sleep between events */
+    PWR_COUNT,
+}power_state;
+
+typedef enum
+{
+    PWR_EV_TOUCH = 0,   /*!< debounced touch, LOGPC is asked for domain */
+    PWR_EV_TRAFFIC,     /*!< telegram received from LOGPC */
+    PWR_EV_INACTIVE,    /*!< xTimer_inactivity expired */
+    PWR_EV_TICK,        /*!< periodic evaluation */
+}power_event;
+
+/* policy engine of power manager, independent of FreeRTOS so it can be fed with simulated timelines */
+typedef struct
+{
+    power_state         state;
+    uint32_t            activity_ms;    /*!< Time of last touch or telegram */
+    uint32_t            accounted_ms;   /*!< Time until which time_ms is summed */
+    uint32_t            time_ms[PWR_COUNT]; /*!< Time spent in every state */
+    bool                waiting;        /*!< Touch waits for reply of LOGPC */
+    uint32_t            request_ms;     /*!< Time of touch which waits for reply */
+    power_state         request_state;  /*!< State in which touch was handled */
+    uint32_t            requests[PWR_COUNT]; /*!< Answered touches per state */
+    uint32_t            latency_ms[PWR_COUNT]; /*!< Sum of touch to reply latency per state */
+}power_policy;
+
+static power_policy power;
+static SemaphoreHandle_t power_mutex = NULL;
+static StaticSemaphore_t power_mutex_buffer;
+static uint32_t power_sniff = 0; /* link changes into sniff mode reported by controller */
+/* returns of every core from wait for interrupt, timers and ticks of all tasks included */
+static volatile uint32_t power_cpu_wakeups[portNUM_PROCESSORS];
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t power_cpu_lock, power_sleep_lock;
+#endif
+/* touch task wakeups since boot, reported per hour */
+static uint32_t touch_wakeups = 0;
+/* detector of touch task, its counters are reported per hour */
+static touch_detector touch_det;
+
+/* session key of credential vault, cached between unlock and lock */
+static mbedtls_gcm_context vault_gcm;
+static bool vault_unlocked=false;
+static volatile bool vault_lock_pending=false;
+static SemaphoreHandle_t vault_mutex = NULL;
+static StaticSemaphore_t vault_mutex_buffer;
+
+/* authenticated channel with LOGPC, keys are derived by handshake in process_telegram */
+typedef struct
+{
+    bool                secured;        /*!< Keys are established */
+    mbedtls_gcm_context rx;             /*!< Key of frames from LOGPC */
+    mbedtls_gcm_context tx;             /*!< Key of frames to LOGPC */
+    uint64_t            rx_seq;         /*!< Sequence number (implicit nonce) of next received frame */
+    uint64_t            tx_seq;         /*!< Sequence number (implicit nonce) of next sent frame */
+    uint8_t             resumption[CHANNEL_KEY_LEN]; /*!< Secret handed over to resumption ticket */
+}channel_ctx;
+
+/* resumption ticket, lets reconnected LOGPC skip public key operations */
+typedef struct
+{
+    bool                valid;
+    uint8_t             id[CHANNEL_TICKET_LEN];
+    uint8_t             secret[CHANNEL_KEY_LEN];
+    TickType_t          issued;
+}channel_ticket;
+
+static channel_ticket channel_tickets[CHANNEL_TICKETS];
+
+/* bytes, send and delivery time of one transport since last report, guarded by transport_lock */
+typedef struct
+{
+    uint32_t            rx_bytes;
+    uint32_t            tx_bytes;
+    uint32_t            sends;
+    uint32_t            errors;
+    int64_t             send_us;        /*!< Time spent in send */
+    int64_t             send_max_us;
+    uint32_t            delivered;      /*!< Sends with known delivery time */
+    int64_t             deliver_us;     /*!< Time from send until link confirmed delivery */
+    int64_t             deliver_max_us;
+    int64_t             since_us;       /*!< Start of reported period */
+}transport_stats;
+
+/*
+  Link to LOGPC. Backend reports its events with transport_opened, transport_received,
+  transport_delivered, conn_congestion and transport_closed, engine above it does not know the link.
+ */
+typedef struct
+{
+    const char          *name;
+    bool                (*start)(void);  /*!< Bring link up, clients may connect afterwards */
+    esp_err_t           (*send)(uint32_t handle, const uint8_t* data, size_t len); /*!< At most MAX_SPP_PACKET bytes */
+    void                (*disconnect)(uint32_t handle);
+    bool                packets;        /*!< Packet ends plaintext telegram (SPP), otherwise only new line does */
+    bool                persistent;     /*!< Link never closes (UART), its client does not keep vault unlocked */
+    bool                acked;          /*!< Every send is confirmed with transport_delivered, otherwise send returns once data left */
+    transport_stats     *stats;
+}transport_ops;
+
+static portMUX_TYPE transport_lock = portMUX_INITIALIZER_UNLOCKED;
+/* backends started by app_main */
+static const transport_ops *transport_active[TRANSPORT_BACKENDS];
+
+/* state of one client, table and everything inside is guarded by conn_mutex */
+typedef struct
+{
+    bool                used;
+    uint32_t            handle;         /*!< Connection handle given by transport */
+    const transport_ops *transport;     /*!< Backend which owns handle */
+    TickType_t          opened;         /*!< Tick of connection, oldest connection is primary */
+    TickType_t          active;         /*!< Tick of last received packet */
+    QueueHandle_t       rx;             /*!< Received packets (rcv_tele*) waiting for worker */
+    uint8_t             tx[CONN_TX_BUF]; /*!< Ring of bytes waiting for uncongested link */
+    size_t              tx_head;
+    size_t              tx_len;
+    bool                congested;      /*!< Transport asked to hold data */
+    bool                flushing;       /*!< Some task is passing tx to transport */
+    int64_t             tx_sent_us[CONN_IN_FLIGHT]; /*!< Start of sends waiting for delivery, indexed by tx_sent */
+    uint32_t            tx_sent;        /*!< Sends passed to acked transport */
+    uint32_t            tx_delivered;   /*!< Sends transport confirmed */
+    channel_ctx         channel;
+    /* reply prepared for domain pushed by UI_HINT, sent directly on touch */
+    uint8_t             hint[MAX_TELEGRAM];
+    size_t              hint_len;       /*!< 0 when reply is not prepared or was wiped by vault lock */
+    uint8_t             hint_domain[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t             hint_domain_len; /*!< 0 when there is no hint */
+    uint32_t            hint_version;   /*!< Store version at preparation, any change makes reply stale */
+    TickType_t          hint_at;
+    uint8_t             writes;         /*!< Mutations in storage writer, kept when slot is reused */
+    /* framer, used only by worker */
+    uint32_t            frame_handle;   /*!< Connection which owns collected bytes */
+    uint8_t             frame[CONN_FRAME_BUF]; /*!< Incomplete AEAD frame */
+    size_t              frame_len;
+}conn_ctx;
+
+static conn_ctx connections[CONN_SLOTS];
+/* receive queues live here, nothing is created on heap */
+static StaticQueue_t conn_rx_queue[CONN_SLOTS];
+static uint8_t conn_rx_storage[CONN_SLOTS][CONN_RX_DEPTH*sizeof(void*)];
+static SemaphoreHandle_t conn_mutex = NULL;
+static StaticSemaphore_t conn_mutex_buffer;
+static TaskHandle_t worker_task = NULL;
+
+/* mutation parsed by worker, executed by storage writer (or by worker when there is none) */
+typedef struct
+{
+    uint32_t            handle;
+    size_t              slot;           /*!< Connection slot, its telegrams wait until mutation is done */
+    int                 mode;           /*!< UI_NEW_CREDENTIAL or UI_ERASE */
+    bool                sequenced;
+    uint32_t            seq;
+    int                 count;          /*!< Number of elements */
+    uint8_t             *content[3];    /*!< Elements of telegram, owned by job */
+    size_t              content_len[3];
+}store_job;
+
+/* worker skips connection with pending mutation, so every slot has at most one queued */
+static QueueHandle_t store_jobs = NULL;
+static StaticQueue_t store_jobs_queue;
+static uint8_t store_jobs_storage[CONN_SLOTS*sizeof(store_job)];
+static TaskHandle_t writer_task = NULL;
+/* TASK_WRITER at boot, host benchmark switches it */
+static volatile bool writer_enabled = TASK_WRITER;
+
+/* static key of device, LOGPC pins its public part on first handshake */
+static mbedtls_ecp_group channel_grp;
+static mbedtls_mpi channel_identity;
+static uint8_t channel_identity_pub[CHANNEL_KEY_LEN];
+static bool channel_identity_loaded=false;
 
 /*Telegram enumeration*/
 typedef enum UI_ENUM
@@ -83,21 +512,52 @@ typedef enum UI_ENUM
     UI_MISSED = 7,
     UI_FAIL = 8,
     UI_STATS = 9,   
+    UI_HELLO = 10,
+    UI_RESUME = 11,
+    UI_TRACE = 12,
+    UI_SYNC = 13,
+    UI_LIST = 14,
+    UI_HINT = 15,
+    UI_EXPORT = 16,
+    UI_IMPORT = 17,
+    UI_ECHO = 18,
+    UI_COUNT, /* number of telegram modes, keep last */
 }UI_ENUM;
 
-/* Queue for received telegrams */
-QueueHandle_t ReceivedQueue;
-
+#if TRANSPORTS & TRANSPORT_SPP
 static uint8_t* mode_to_str(esp_bt_pm_mode_t mode) 
 {
    return (uint8_t *)(mode==ESP_BT_PM_MD_ACTIVE ? "active" : (mode==ESP_BT_PM_MD_HOLD ? "hold" : (mode==ESP_BT_PM_MD_SNIFF ? "sniff": (mode==ESP_BT_PM_MD_PARK ? "park" : "undefined") ) ));   
 }
+#endif
 
-/*0-9 character convert to int*/
-static UI_ENUM telegram_mode(uint8_t ch)
+/*decimal mode at beginning of telegram ("0".."99"), *sep gets position of first character after it*/
+static UI_ENUM telegram_mode(const uint8_t* data, size_t len, size_t* sep)
 {   
-    uint8_t mode=ch-(uint8_t)'0';
-    return (mode>UI_UNKNOWN && mode<=UI_FAIL) ? mode : UI_UNKNOWN;
+    int mode=0;
+    size_t i=0;
+    while (i<len && i<2 && data[i]>='0' && data[i]<='9')
+        mode=mode*10+(data[i++]-'0');
+    *sep=i;
+    return (i>0 && mode<UI_COUNT) ? mode : UI_UNKNOWN;
+}
+
+/* optional mutation sequence number after mode, sep is moved behind it */
+static bool telegram_sequence(const uint8_t* data, size_t len, size_t* sep, uint32_t* seq)
+{
+    size_t i=*sep;
+    if (i>=len || data[i]!=SEQ)
+        return false;
+
+    uint64_t value=0;
+    size_t start=++i;
+    while (i<len && i-start<10 && data[i]>='0' && data[i]<='9')
+        value=value*10+(data[i++]-'0');
+    if (i==start || value>UINT32_MAX)
+        return false;
+    *seq=value;
+    *sep=i;
+    return true;
 }
 
 static char *bda2str(uint8_t * bda, char *str, size_t size)
@@ -112,589 +572,4883 @@ static char *bda2str(uint8_t * bda, char *str, size_t size)
     return str;
 }
 
+/* binary to lowercase hex, out has to hold 2*len characters */
+static void hex_encode(const uint8_t* in, size_t len, uint8_t* out)
+{
+    static const char digits[]="0123456789abcdef";
+    for (size_t i = 0; i < len; i++)
+    {
+        *out++=digits[in[i]>>4];
+        *out++=digits[in[i]&0x0f];
+    }
+}
+
+/* hex field to binary, field has to contain exactly 2*len hex characters */
+static bool hex_decode(const uint8_t* in, size_t in_len, uint8_t* out, size_t len)
+{
+    if (!in || in_len!=2*len)
+        return false;
+
+    for (size_t i = 0; i < in_len; i++)
+    {
+        uint8_t ch=in[i];
+        uint8_t nibble;
+        if (ch>='0' && ch<='9')
+            nibble=ch-'0';
+        else if (ch>='a' && ch<='f')
+            nibble=ch-'a'+10;
+        else if (ch>='A' && ch<='F')
+            nibble=ch-'A'+10;
+        else
+            return false;
+        out[i/2]=(i%2) ? (out[i/2]|nibble) : (nibble<<4);
+    }
+    return true;
+}
+
 typedef struct 
 {
     uint32_t          handle;         /*!< The connection handle */
     uint16_t          len;            /*!< The length of data */
-    uint8_t           *data;          /*!< The data received */       
+    uint8_t           *data;          /*!< The data received, NULL when connection has been opened */       
+    int64_t           received;       /*!< esp_timer time of reception */
 }rcv_tele;
 
-static bool create_message(UI_ENUM element,const uint8_t* domain, const uint8_t* log, const uint8_t* pass, int32_t handle)
+/* placement of application task, set by TASK_* configuration */
+typedef struct
 {
+    const char          *name;
+    TaskFunction_t      function;
+    BaseType_t          core;
+    UBaseType_t         priority;
+    uint32_t            stack_size;
+    StackType_t         *stack;         /*!< Statically allocated stack of stack_size bytes */
+    StaticTask_t        *tcb;
+    TaskHandle_t        *handle;
+}task_spec;
+
+/* boot phases in order they usually complete, reported by UI_STATS */
+typedef enum
+{
+    BOOT_NVS = 0,       /*!< NVS ready */
+    BOOT_CONTROLLER,    /*!< BT controller enabled */
+    BOOT_BLUEDROID,     /*!< Bluedroid enabled */
+    BOOT_SPP,           /*!< SPP and GAP configured */
+    BOOT_DISCOVERABLE,  /*!< SPP server started, device is connectable */
+    BOOT_TOUCH,         /*!< touch pad calibrated */
+    BOOT_IDENTITY,      /*!< channel identity loaded for first handshake */
+    BOOT_FIRST_REPLY,   /*!< first credential sent to LOGPC */
+    BOOT_PHASES,
+}boot_phase;
+
+/* esp_timer time at which phase completed, 0 while pending */
+static int64_t boot_done_us[BOOT_PHASES];
+/* set by SPP start, worker loads channel identity before first handshake needs it */
+static volatile bool boot_warm_pending = false;
+
+static void boot_mark(boot_phase phase)
+{
+    if (boot_done_us[phase])
+        return;
+    boot_done_us[phase] = esp_timer_get_time();
+    ESP_LOGI(BOOT_TAG, "phase %d done at %"PRId64" us", phase, boot_done_us[phase]);
+}
 
-    if (element==UI_UNKNOWN || element>=10)
+/* completion times in ms separated by '/', '-' for pending phase */
+static size_t boot_format(char *buf, size_t size)
+{
+    size_t len = 0;
+    for (int i = 0; i < BOOT_PHASES && len < size; i++)
     {
-        ESP_LOGE(CRE_MSG, "Message mode invalid: %d ",element); 
-        return false;
-    }      
-
-        /* telegram pointer with maximal bytes in buffer */
-        uint8_t message[MAX_TELEGRAM];
-
-        /*pointer for message to copy all elements*/
-        uint8_t *tmp=(uint8_t*)&message;
-
-        /* insert feedback mode into first character of massage*/
-        *tmp++= element+'0';
-
+        const char *sep = i ? "/" : "";
+        int n = boot_done_us[i] ? snprintf(buf+len, size-len, "%s%"PRId64"", sep, boot_done_us[i]/1000)
+                                : snprintf(buf+len, size-len, "%s-", sep);
+        if (n < 0)
+            break;
+        len += n;
+    }
+    return (len < size) ? len : size-1;
+}
 
-        /* null terminatior in case there is no other elements on the way*/
-        *tmp++='\0';
+/* time from reception of packet until worker is done with it */
+typedef struct
+{
+    uint32_t            count;
+    int64_t             sum;
+    int64_t             max;
+}task_latency;
 
-        
+static void task_start(const task_spec *spec)
+{
+    *spec->handle = xTaskCreateStaticPinnedToCore(spec->function, spec->name, spec->stack_size, NULL,
+                                                  spec->priority, spec->stack, spec->tcb, spec->core);
+    ESP_LOGI(TSK_TAG, "%s: core %d, priority %d, stack %"PRIu32" bytes", spec->name,
+             (int)spec->core, (int)spec->priority, spec->stack_size);
+}
 
-    if (domain)
+static void task_latency_add(task_latency *lat, int64_t us)
+{
+    lat->count++;
+    lat->sum += us;
+    if (us > lat->max)
+        lat->max = us;
+    if (lat->count == TASK_LATENCY_REPORT)
     {
-        /* move back pointer for null terminator position*/
-        tmp--;
-        
-        /* separator character*/
-        *tmp++=EXT;
-
-        /*go through each character of domain*/
-        while ((*tmp++=*domain++)!='\0');
+        ESP_LOGI(TSK_TAG, "worker core %d priority %d: average %"PRId64" us, max %"PRId64" us over %"PRIu32" packets",
+                 TASK_WORKER_CORE, TASK_WORKER_PRIO, lat->sum / lat->count, lat->max, lat->count);
+        memset(lat, 0, sizeof(*lat));
+    }
+}
 
-        /* login pointer valid */
-        if(log)
-        {   
-            /* move back pointer for null terminator position*/
-            tmp--;
+#if CONFIG_IDF_TARGET_LINUX
+/* samples of host benchmarks, two series are compared at once */
+static int64_t bench_samples[3][BENCH_SAMPLES];
 
-            /*put comma separator insted '\0'*/
-            *tmp++ =EXT;
+static int bench_compare(const void *a, const void *b)
+{
+    int64_t x=*(const int64_t*)a, y=*(const int64_t*)b;
+    return (x>y)-(x<y);
+}
 
-            /*go through each character of login/password*/
-            while ((*tmp++=*log++)!='\0');
-        }
+/* log distribution of series, samples are sorted in place. Returns median. */
+static int64_t bench_report(const char *name, int64_t *us, size_t count)
+{
+    if (count==0)
+    {
+        ESP_LOGW(BNC_TAG, "%s: no samples", name);
+        return 0;
+    }
+    qsort(us, count, sizeof(us[0]), bench_compare);
+    int64_t sum=0;
+    for (size_t i = 0; i < count; i++)
+        sum+=us[i];
+    ESP_LOGI(BNC_TAG, "%s: %zu samples, average %"PRId64" us, p50 %"PRId64" us, p90 %"PRId64" us, p99 %"PRId64" us, max %"PRId64" us",
+             name, count, sum/(int64_t)count, us[count/2], us[count*9/10], us[count*99/100], us[count-1]);
+    return us[count/2];
+}
 
-        /* password pointer valid */
-        if(pass)
-        {   
-            /* move back pointer for null terminator position*/
-            tmp--;
+/* console output of every operation would be measured too, only warnings and results are logged */
+static void bench_quiet(bool quiet)
+{
+    esp_log_level_set("*", quiet ? ESP_LOG_WARN : ESP_LOG_INFO);
+    esp_log_level_set(BNC_TAG, ESP_LOG_INFO);
+}
+#endif
 
-            /*put comma separator insted '\0'*/
-            *tmp++ =EXT;
+/* call sites accounted by allocation tracking */
+typedef enum
+{
+    MEM_SITE_BT = 0,    /*!< packet copied in BT callback */
+    MEM_SITE_PARSER,    /*!< element of telegram */
+    MEM_SITE_NVS_READ,  /*!< sealed record read from storage */
+    MEM_SITE_CONCAT,    /*!< login and password joined for sealing */
+    MEM_SITE_SEAL,      /*!< record sealed before it is written */
+    MEM_SITE_SESSION,   /*!< reply kept until UI_DONE */
+    MEM_SITE_STORE,     /*!< UI_SYNC batch and index snapshot */
+    MEM_SITE_CRYPTO,    /*!< mbedTLS context, always on heap */
+    MEM_SITES,
+}mem_site;
+
+static const char *const mem_site_name[MEM_SITES] = {"bt", "parser", "nvs", "concat", "seal", "session", "store", "crypto"};
+
+typedef struct
+{
+    uint32_t            live;           /*!< Bytes allocated and not freed yet */
+    uint32_t            blocks;         /*!< Allocations not freed yet */
+    uint32_t            count;          /*!< Allocations since boot */
+    uint32_t            peak;           /*!< Most live bytes at once */
+}mem_usage;
+
+/* precedes every block, free knows call site and size without searching */
+typedef struct
+{
+    uint32_t            size;
+    uint8_t             site;
+    uint8_t             magic;
+    uint16_t            reserved;
+}mem_header;
+
+#define MEM_MAGIC 0xA5
+_Static_assert(sizeof(mem_header)==8, "header keeps blocks 8 byte aligned");
+
+/* guarded by mem_lock, BT callback allocates too */
+static mem_usage mem_usages[MEM_SITES];
+static portMUX_TYPE mem_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if STATIC_MEMORY
+/* blocks of one size, bitmap of used ones is guarded by mem_lock */
+typedef struct
+{
+    const char          *name;
+    uint8_t             *base;
+    size_t              size;           /*!< Bytes in one block, multiple of 8 */
+    uint32_t            blocks;
+    uint32_t            used;           /*!< Bit per block */
+    uint32_t            peak;           /*!< Most blocks used at once */
+    uint32_t            failed;         /*!< Requests which found pool empty */
+}mem_pool;
+
+_Static_assert(MEM_SMALL_BLOCKS<=32 && MEM_LARGE_BLOCKS<=32, "pool bitmap holds 32 blocks");
+
+static uint8_t mem_small_area[MEM_SMALL_BLOCKS][MEM_ALIGN(MEM_SMALL_SIZE)] __attribute__((aligned(8)));
+static uint8_t mem_large_area[MEM_LARGE_BLOCKS][MEM_ALIGN(MEM_LARGE_SIZE)] __attribute__((aligned(8)));
+static mem_pool mem_pools[] = {
+    {"small", &mem_small_area[0][0], MEM_ALIGN(MEM_SMALL_SIZE), MEM_SMALL_BLOCKS, 0, 0, 0},
+    {"large", &mem_large_area[0][0], MEM_ALIGN(MEM_LARGE_SIZE), MEM_LARGE_BLOCKS, 0, 0, 0},
+};
+
+static void* mem_pool_get(mem_pool *pool)
+{
+    void *block=NULL;
+    portENTER_CRITICAL(&mem_lock);
+    uint32_t all=(pool->blocks==32) ? UINT32_MAX : (1u<<pool->blocks)-1;
+    if (pool->used!=all)
+    {
+        uint32_t i=__builtin_ctz(~pool->used);
+        pool->used|=1u<<i;
+        block=pool->base+i*pool->size;
+        uint32_t inuse=__builtin_popcount(pool->used);
+        if (inuse>pool->peak)
+            pool->peak=inuse;
+    }
+    else
+        pool->failed++;
+    portEXIT_CRITICAL(&mem_lock);
+    return block;
+}
 
-            /*go through each character of login/password*/
-            while ((*tmp++=*pass++)!='\0');
+/* smallest block which fits, NULL when every fitting pool is empty */
+static void* mem_block_get(size_t size)
+{
+    for (size_t i = 0; i < sizeof(mem_pools)/sizeof(mem_pools[0]); i++)
+    {
+        if (size>mem_pools[i].size)
+            continue;
+        void *block=mem_pool_get(&mem_pools[i]);
+        if (block)
+            return block;
+    }
+    return NULL;
+}
 
-        }
+static void mem_block_put(void *ptr)
+{
+    for (size_t i = 0; i < sizeof(mem_pools)/sizeof(mem_pools[0]); i++)
+    {
+        mem_pool *pool=&mem_pools[i];
+        uint8_t *p=(uint8_t*)ptr;
+        if (p<pool->base || p>=pool->base+pool->blocks*pool->size)
+            continue;
+        portENTER_CRITICAL(&mem_lock);
+        pool->used&=~(1u<<((p-pool->base)/pool->size));
+        portEXIT_CRITICAL(&mem_lock);
+        return;
     }
+    ESP_LOGE(MEM_TAG, "%p is not pool block",ptr);
+}
 
-        /* move back pointer for correct message length calculation (tmp-(uint8_t*)&message) */
-        tmp--;
+static void mem_pool_report(void)
+{
+    for (size_t i = 0; i < sizeof(mem_pools)/sizeof(mem_pools[0]); i++)
+        ESP_LOGI(MEM_TAG, "%s pool: %"PRIu32" of %"PRIu32" blocks used, peak %"PRIu32", empty %"PRIu32" times",
+                 mem_pools[i].name, (uint32_t)__builtin_popcount(mem_pools[i].used), mem_pools[i].blocks,
+                 mem_pools[i].peak, mem_pools[i].failed);
+}
 
-        ESP_LOGI(CRE_MSG, "stored msg :%s with size %d",message,(tmp-(uint8_t*)&message));
-        esp_err_t res=esp_spp_write(handle, (tmp-(uint8_t*)&message), (uint8_t*)&message);
-        ESP_LOGI(CRE_MSG, "invoked esp_spp_write status :%s",esp_err_to_name(res));
-        return (res==0) ? true : false; 
+/* from here on heap functions do not compile, every buffer comes from pools above */
+#pragma GCC poison malloc calloc realloc free
+#else
+static void* mem_block_get(size_t size)
+{
+    return malloc(size);
 }
 
+static void mem_block_put(void *ptr)
+{
+    free(ptr);
+}
 
-static uint8_t* logpass_concat(uint8_t* login, uint8_t* password)
+static void mem_pool_report(void)
 {
+}
+#endif
 
-    ESP_LOGI(LOGPASS, " login:%s\t password:%s passed to function ",login,password);
+/* size bytes accounted to call site, released with mem_free() */
+static void* mem_alloc(size_t size, mem_site site)
+{
+    /* mbedTLS sizes vary with key and bignum lengths, they do not fit fixed blocks */
+    mem_header *h=(mem_header*)((site==MEM_SITE_CRYPTO) ? heap_caps_malloc(sizeof(mem_header)+size, MALLOC_CAP_8BIT)
+                                                          : mem_block_get(sizeof(mem_header)+size));
+    if (!h)
+    {
+        ESP_LOGE(MEM_TAG, "no memory for %zu bytes of %s",size,mem_site_name[site]);
+        return NULL;
+    }
+    h->size=size;
+    h->site=site;
+    h->magic=MEM_MAGIC;
+    portENTER_CRITICAL(&mem_lock);
+    mem_usage *u=&mem_usages[site];
+    u->live+=size;
+    u->blocks++;
+    u->count++;
+    if (u->live>u->peak)
+        u->peak=u->live;
+    portEXIT_CRITICAL(&mem_lock);
+    return h+1;
+}
 
-    /* pointer to track other objects*/
-    uint8_t *tmp;
+static void mem_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    mem_header *h=(mem_header*)ptr-1;
+    if (h->magic!=MEM_MAGIC || h->site>=MEM_SITES)
+    {
+        ESP_LOGE(MEM_TAG, "%p was not allocated by mem_alloc() or is freed twice",ptr);
+        return;
+    }
+    h->magic=0;
+    portENTER_CRITICAL(&mem_lock);
+    mem_usages[h->site].live-=h->size;
+    mem_usages[h->site].blocks--;
+    portEXIT_CRITICAL(&mem_lock);
+    /* telegram elements, opened records, joined credentials and key schedules hold secrets */
+    mbedtls_platform_zeroize(ptr, h->size);
+    if (h->site==MEM_SITE_CRYPTO)
+        heap_caps_free(h);
+    else
+        mem_block_put(h);
+}
 
-    /* length of string*/
-    int len;
+#if CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+/* mbedTLS allocator selected in sdkconfig, its buffers are accounted and zeroed like application ones */
+void *esp_mbedtls_mem_calloc(size_t n, size_t size)
+{
+    if (size && n>SIZE_MAX/size)
+        return NULL;
+    void *ptr=mem_alloc(n*size, MEM_SITE_CRYPTO);
+    if (ptr)
+        memset(ptr, 0, n*size);
+    return ptr;
+}
 
-    /* keep address of login to count len*/
-    tmp=login;
+void esp_mbedtls_mem_free(void *ptr)
+{
+    mem_free(ptr);
+}
+#endif
 
-    /* stop when null comes up*/
-    while (*tmp)
-        tmp++;
+/* usage snapshot of every call site, consistent across sites */
+static void mem_usage_get(mem_usage usage[MEM_SITES])
+{
+    portENTER_CRITICAL(&mem_lock);
+    memcpy(usage, mem_usages, sizeof(mem_usages));
+    portEXIT_CRITICAL(&mem_lock);
+}
 
-    /* length of login + separetor */
-    len=(tmp-login)+1;
+/* "site:live/blocks/allocations/peak" separated by ';', reported by UI_STATS */
+static size_t mem_format(char *buf, size_t size)
+{
+    mem_usage usage[MEM_SITES];
+    mem_usage_get(usage);
+    size_t len = 0;
+    for (int i = 0; i < MEM_SITES && len < size; i++)
+    {
+        int n = snprintf(buf+len, size-len, "%s%s:%"PRIu32"/%"PRIu32"/%"PRIu32"/%"PRIu32, i ? ";" : "",
+                         mem_site_name[i], usage[i].live, usage[i].blocks, usage[i].count, usage[i].peak);
+        if (n < 0)
+            break;
+        len += n;
+    }
+    return (len < size) ? len : size-1;
+}
 
-    /* keep address of password to count len*/
-    tmp=password;
+/* buffers of parser, NVS read and concat live only while one telegram is processed */
+static void mem_check_transient(void)
+{
+    static const mem_site transient[] = {MEM_SITE_PARSER, MEM_SITE_NVS_READ, MEM_SITE_CONCAT, MEM_SITE_SEAL};
+    mem_usage usage[MEM_SITES];
+    mem_usage_get(usage);
+    for (size_t i = 0; i < sizeof(transient)/sizeof(transient[0]); i++)
+    {
+        if (usage[transient[i]].blocks)
+            ESP_LOGE(MEM_TAG, "%s leaks %"PRIu32" bytes in %"PRIu32" blocks after telegram",
+                     mem_site_name[transient[i]], usage[transient[i]].live, usage[transient[i]].blocks);
+    }
+}
 
-     /* stop when null comes up*/
-    while (*tmp)
-        tmp++;
+static void mem_report(void)
+{
+    char sites[MEM_SITES*48];
+    mem_format(sites, sizeof(sites));
+    ESP_LOGI(MEM_TAG, "live/blocks/allocations/peak per site: %s", sites);
+    mem_pool_report();
+
+    mem_usage usage[MEM_SITES];
+    mem_usage_get(usage);
+    size_t least=heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    ESP_LOGI(MEM_TAG, "heap: crypto peak %"PRIu32"/%d bytes, least free %zu/%d bytes",
+             usage[MEM_SITE_CRYPTO].peak, HEAP_LIMIT_CRYPTO, least, HEAP_FLOOR);
+    if (usage[MEM_SITE_CRYPTO].peak>HEAP_LIMIT_CRYPTO)
+        ESP_LOGE(MEM_TAG, "mbedTLS held %"PRIu32" bytes, over HEAP_LIMIT_CRYPTO",usage[MEM_SITE_CRYPTO].peak);
+    if (least<HEAP_FLOOR)
+        ESP_LOGE(MEM_TAG, "free heap fell to %zu bytes, under HEAP_FLOOR",least);
+}
 
-    /* combined length login + separator + password*/
-    len+=(tmp-password);
+/* credential reply waiting for UI_DONE of LOGPC */
+typedef struct
+{
+    uint8_t           *frame;         /*!< Telegram placed at frame+CHANNEL_HEADER with room for channel mac */
+    uint16_t          len;            /*!< Length of telegram */
+    uint8_t           domain[NVS_KEY_NAME_MAX_SIZE]; /*!< Domain acknowledged by UI_DONE */
+}session_reply;
+
+/* result of mutation, replayed when LOGPC retries the same sequence number */
+typedef struct
+{
+    bool              used;
+    uint32_t          seq;
+    UI_ENUM           result;         /*!< UI_DONE or UI_FAIL */
+    uint8_t           domain[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t           domain_len;
+    uint8_t           fields;         /*!< 0 when erase of all keys was answered */
+}session_mutation;
+
+/* state of peer which survives disconnection for SESSION_GRACE */
+typedef struct
+{
+    bool              used;
+    bool              connected;
+    bool              replay;         /*!< Pending replies have to be sent after reconnection */
+    esp_bd_addr_t     bda;            /*!< Remote address, key of session */
+    uint32_t          handle;         /*!< Connection handle while connected */
+    TickType_t        closed;         /*!< Tick of disconnection, start of grace period */
+    uint8_t           version;        /*!< SESSION_PLAIN or SESSION_SECURE */
+    session_reply     pending[SESSION_PENDING];
+    uint32_t          requests;       /*!< Telegrams received during whole session */
+    uint32_t          replays;        /*!< Replies sent again after reconnection */
+    uint32_t          reconnects;     /*!< Reconnections within grace period */
+    session_mutation  mutations[SESSION_MUTATIONS];
+    uint8_t           mutation_next;  /*!< Oldest entry of mutations, overwritten next */
+    uint32_t          deduplicated;   /*!< Retries answered without touching storage */
+}session_ctx;
+
+static session_ctx sessions[SESSION_SLOTS];
+static SemaphoreHandle_t session_mutex = NULL;
+static StaticSemaphore_t session_mutex_buffer;
+
+static int channel_rng(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
 
-    /* allocate sufficcient area for concatenated string*/
-    uint8_t *logpass= (uint8_t*)malloc(sizeof(uint8_t)*len);
-    ESP_LOGI(LOGPASS, "Allocated %d bytes for:%p logpass ",sizeof(uint8_t)*len,logpass);
+/* kind of traced link event */
+typedef enum
+{
+    TRACE_RX = 0,       /*!< ESP_SPP_DATA_IND_EVT payload, depth is receive queue */
+    TRACE_TX,           /*!< telegram before sealing, depth is transmit ring */
+    TRACE_WRITE,        /*!< chunk passed to transport, depth is transmit ring left, no payload */
+    TRACE_CONG,         /*!< link congested */
+    TRACE_UNCONG,       /*!< link congestion cleared */
+}trace_kind;
+
+typedef struct
+{
+    uint32_t            seq;            /*!< Number of record since boot */
+    int64_t             us;             /*!< esp_timer time of event */
+    uint32_t            handle;
+    uint8_t             kind;
+    uint16_t            depth;
+    uint16_t            len;            /*!< Length of original payload */
+    uint8_t             payload_len;
+    uint8_t             payload[TRACE_PAYLOAD];
+}trace_record;
+
+#if TRACE_RECORDER
+static trace_record trace_ring[TRACE_RECORDS];
+static uint32_t trace_next = 0;
+static SemaphoreHandle_t trace_mutex = NULL;
+static StaticSemaphore_t trace_mutex_buffer;
+#endif
 
-    /* keep address of logpass to combine strings*/    
-    tmp=logpass;
+/*
+  Copy payload without secrets. AEAD frame keeps only its header, plaintext telegram
+  keeps mode and domain (only mode for UI_RESUME ticket) and the rest is masked.
+ */
+static size_t trace_redact(uint8_t *out, const uint8_t *data, size_t len)
+{
+    if (len>0 && data[0]==CHANNEL_FRAME)
+    {
+        size_t n=(len<CHANNEL_HEADER) ? len : CHANNEL_HEADER;
+        memcpy(out, data, n);
+        return n;
+    }
 
-    /* copy all login characters to new string*/
-    while ((*tmp++=*login++)!='\0');
-    
+    size_t n=(len<TRACE_PAYLOAD) ? len : TRACE_PAYLOAD;
+    size_t sep;
+    UI_ENUM mode=telegram_mode(data, len, &sep);
+    /* packet which does not start telegram is masked whole */
+    int visible=(mode==UI_UNKNOWN) ? 0 : ((mode==UI_RESUME) ? 1 : 2);
+    int separators=0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (data[i]==EXT)
+            separators++;
+        out[i]=(separators<visible || data[i]==EXT) ? data[i] : '*';
+    }
+    return n;
+}
 
-    /* move pointer backward to replace termination with separator character
-       then move back */
-    tmp--;
-    *tmp++=EXT;
+static void trace_record_event(trace_kind kind, uint32_t handle, uint16_t depth, const uint8_t *data, size_t len)
+{
+#if TRACE_RECORDER
+    int64_t now=esp_timer_get_time();
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    trace_record *rec=&trace_ring[trace_next%TRACE_RECORDS];
+    rec->seq=trace_next++;
+    rec->us=now;
+    rec->handle=handle;
+    rec->kind=kind;
+    rec->depth=depth;
+    rec->len=len;
+    rec->payload_len=data ? trace_redact(rec->payload, data, len) : 0;
+    xSemaphoreGive(trace_mutex);
+#endif
+}
 
-    ESP_LOGI(LOGPASS, " previous char:%c and null termination char:%c ",*(tmp-2),*(tmp-1));
+/*
+  Encode records from seq on as hex (little endian us(8) | handle(4) | kind(1) |
+  depth(2) | len(2) | payload_len(1) | payload), returns sequence number to ask
+  for next time. Records already overwritten are skipped.
+ */
+static uint32_t trace_export(uint32_t seq, uint8_t *hex, size_t size, size_t *hex_len)
+{
+    *hex_len=0;
+#if TRACE_RECORDER
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    if (trace_next>TRACE_RECORDS && seq<trace_next-TRACE_RECORDS)
+        seq=trace_next-TRACE_RECORDS;
+    for (int n = 0; n < TRACE_PER_TELEGRAM && seq<trace_next; n++, seq++)
+    {
+        const trace_record *rec=&trace_ring[seq%TRACE_RECORDS];
+        uint8_t raw[18+TRACE_PAYLOAD];
+        for (int i = 0; i < 8; i++)
+            raw[i]=(uint64_t)rec->us>>(8*i);
+        for (int i = 0; i < 4; i++)
+            raw[8+i]=rec->handle>>(8*i);
+        raw[12]=rec->kind;
+        raw[13]=rec->depth&0xff;
+        raw[14]=rec->depth>>8;
+        raw[15]=rec->len&0xff;
+        raw[16]=rec->len>>8;
+        raw[17]=rec->payload_len;
+        memcpy(raw+18, rec->payload, rec->payload_len);
+        size_t raw_len=18+rec->payload_len;
+        if (*hex_len+2*raw_len>size)
+            break;
+        hex_encode(raw, raw_len, hex+*hex_len);
+        *hex_len+=2*raw_len;
+    }
+    xSemaphoreGive(trace_mutex);
+#endif
+    return seq;
+}
 
-    /* copy all password characters to new string*/
-    while ((*tmp++=*password++)!='\0');
-    
+/* connection using handle, conn_mutex has to be taken */
+static conn_ctx* conn_find(uint32_t handle)
+{
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+    {
+        if (connections[i].used && connections[i].handle==handle)
+            return &connections[i];
+    }
+    return NULL;
+}
 
-    ESP_LOGI(LOGPASS, " login%cpassword has been concatenated :%s",EXT,logpass);                                                                       
+/* forget keys of channel, conn_mutex has to be taken */
+static void channel_wipe(channel_ctx* channel)
+{
+    if (channel->secured)
+    {
+        mbedtls_gcm_free(&channel->rx);
+        mbedtls_gcm_free(&channel->tx);
+        mbedtls_platform_zeroize(channel->resumption, sizeof(channel->resumption));
+        channel->secured=false;
+    }
+}
 
-    return logpass;
+static bool channel_secured(uint32_t handle)
+{
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    bool secured=conn && conn->channel.secured;
+    xSemaphoreGive(conn_mutex);
+    return secured;
 }
 
-static bool add_to_nvs(uint8_t* credential[3])
+/* keys: LOGPC->device | device->LOGPC | resumption secret */
+static bool channel_install(uint32_t handle, const uint8_t keys[3*CHANNEL_KEY_LEN])
 {
-    esp_err_t err;
-    nvs_handle_t my_handle;
-    err = nvs_open("storage", NVS_READWRITE, &my_handle);
-    if (err != ESP_OK)
+    int ret=-1;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
     {
-        ESP_LOGE(ADD_NVS, "Error (%s) opening NVS handle to write!\n",esp_err_to_name(err));
-        /* Close the storage handle and free any allocated resources.*/
-        nvs_close(my_handle);
-        return false;
-    }        
-    else
-    {   
-        /* concatenate login and password */
-        uint8_t* new_value=logpass_concat(credential[1], credential[2]);
-        if(!new_value)
+        channel_ctx *channel=&conn->channel;
+        channel_wipe(channel);
+        mbedtls_gcm_init(&channel->rx);
+        mbedtls_gcm_init(&channel->tx);
+        ret=mbedtls_gcm_setkey(&channel->rx, MBEDTLS_CIPHER_ID_AES, keys, CHANNEL_KEY_LEN*8);
+        if (ret==0)
+            ret=mbedtls_gcm_setkey(&channel->tx, MBEDTLS_CIPHER_ID_AES, keys+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN*8);
+        if (ret==0)
         {
-            return false;
-            /* Close the storage handle and free any allocated resources.*/
-            nvs_close(my_handle);
+            memcpy(channel->resumption, keys+2*CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+            channel->rx_seq=0;
+            channel->tx_seq=0;
+            channel->secured=true;
         }
-        ESP_LOGI(ADD_NVS, "before call nvs_set_str() key:%s, len:%d, value:%s, len:%d",(char*)credential[0],strlen((char*)credential[0]),(char*)new_value,strlen((char*)new_value));
-        /* populate key(domain) with new login*/
-        err = nvs_set_str(my_handle, (char*)credential[0], (char*)new_value);
-        ESP_LOGI(ADD_NVS, "invoked nvs_set_str() with status :%s\t key:%s, value:%s",esp_err_to_name(err),credential[0],new_value);
+        else
+        {
+            mbedtls_gcm_free(&channel->rx);
+            mbedtls_gcm_free(&channel->tx);
+        }
+    }
+    xSemaphoreGive(conn_mutex);
 
-        /* commit set values*/
-        err = nvs_commit(my_handle);
-        ESP_LOGI(ADD_NVS, "invoked commit() with status :%s",esp_err_to_name(err));
+    if (ret!=0)
+        ESP_LOGE(CHN_TAG, "installing channel keys for handle:%"PRIu32" failed: -0x%04x",handle,-ret);
+    return (ret==0);
+}
 
+/* every direction has own key so sequence number alone makes nonce unique */
+static void channel_nonce(uint64_t seq, uint8_t nonce[VAULT_NONCE_LEN])
+{
+    memset(nonce, 0, VAULT_NONCE_LEN);
+    for (int i = VAULT_NONCE_LEN-1; i >= VAULT_NONCE_LEN-8; i--, seq>>=8)
+        nonce[i]=seq&0xff;
+}
 
-        ESP_LOGI(ADD_NVS, "Release memory for:%p new_value ",new_value);
-        /* release memory for concatenated value*/
-        free(new_value);
+/*
+  Open received AEAD frame (CHANNEL_FRAME | length | ciphertext | mac) in place.
+  Plaintext telegram is moved to data[0] and null terminated.
+  Returns length of plaintext or -1 when frame is rejected.
+ */
+static int32_t channel_open(uint32_t handle, uint8_t* data, size_t len)
+{
+    if (len<CHANNEL_HEADER+CHANNEL_MAC_LEN)
+        return -1;
 
-        /* Close the storage handle and free any allocated resources.*/
-        nvs_close(my_handle);
+    size_t plain=len-CHANNEL_HEADER-CHANNEL_MAC_LEN;
+    int ret=-1;
+    int64_t start=esp_timer_get_time();
 
-        return true;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn && conn->channel.secured)
+    {
+        uint8_t nonce[VAULT_NONCE_LEN];
+        channel_nonce(conn->channel.rx_seq, nonce);
+        ret=mbedtls_gcm_auth_decrypt(&conn->channel.rx, plain, nonce, sizeof(nonce), data, CHANNEL_HEADER,
+                                     data+CHANNEL_HEADER+plain, CHANNEL_MAC_LEN, data+CHANNEL_HEADER, data+CHANNEL_HEADER);
+        if (ret==0)
+            conn->channel.rx_seq++;
     }
+    xSemaphoreGive(conn_mutex);
+
+    if (ret!=0)
+    {
+        ESP_LOGE(CHN_TAG, "frame of %zu bytes from handle:%"PRIu32" rejected: -0x%04x",len,handle,-ret);
+        return -1;
+    }
+    ESP_LOGI(CHN_TAG, "opened frame of %zu bytes in %"PRId64" us",len,esp_timer_get_time()-start);
+
+    memmove(data, data+CHANNEL_HEADER, plain);
+    data[plain]='\0';
+    return plain;
 }
 
-static uint8_t* extract_credential(UI_ENUM element,uint8_t* logpass)
+/* view on one telegram field, length is known upfront so no null terminator is required */
+typedef struct
 {
-    //TODO: redifine function, logpass should be const to not move pointer 
-    /* copy original addres for credential */
-    uint8_t *org=logpass;
+    const uint8_t     *data;          /*!< First character of field */
+    size_t            len;            /*!< Number of characters in field */
+}msg_field;
 
-    /* iterate till separator character*/
-    while (*(org++)!=EXT);
+/* create field view from null terminated string */
+static msg_field str_field(const uint8_t* str)
+{
+    msg_field field={str, (str) ? strlen((const char*)str) : 0};
+    return field;
+}
 
-    /* UI_LOGIN has been requested */
-    if (element==UI_LOGIN)
+/*
+  Assemble telegram "mode,field,field..." into caller buffer.
+  Every field is copied with single memcpy, nothing is written past buf[size-1].
+  Returns ESP_ERR_INVALID_SIZE when fields do not fit in buffer, *len then holds
+  number of bytes which would be required.
+ */
+static esp_err_t build_message(UI_ENUM element, const msg_field* fields, size_t count, uint8_t* buf, size_t size, size_t* len)
+{
+    /* feedback mode is first element of message */
+    int written=snprintf((char*)buf, size, "%d", element);
+    if (written<0)
     {
-        /* move back to separator position*/
-        org--;
+        *len=0;
+        return ESP_FAIL;
+    }
 
-        /* replace control character with null terminator to limit text*/
-        *org='\0';
+    /* required length of whole message */
+    size_t required=written;
+    for (size_t i = 0; i < count; i++)
+        required+=1+fields[i].len;
 
-        /* move pointer back to first character*/
-        org=logpass;
-        ESP_LOGI(EXTRUI, "extracted UI_LOGIN :%s",org);
-    }
-    /* UI_PASSWORD has been requested */
-    else if (element==UI_PASSWORD)
-    {   /* save orginal addres of logpass*/
-        // uint8_t *tmp=org;
-        // while ((*tmp++=*logpass++)!='\0');
-        
-        ESP_LOGI(EXTRUI, "extracted UI_PASSWORD :%s",org);       
-    }
-    else
+    *len=required;
+    if (required>size)
+        return ESP_ERR_INVALID_SIZE;
+
+    /* position for next separator */
+    uint8_t *tmp=buf+written;
+    for (size_t i = 0; i < count; i++)
     {
-        ESP_LOGE(EXTRUI, "wrong UI_ENUM : %d , cannot extract credential",element);  
-        return NULL;
+        /* separator character*/
+        *tmp++=EXT;
+
+        /* copy whole field at once */
+        memcpy(tmp,fields[i].data,fields[i].len);
+        tmp+=fields[i].len;
     }
-    
-    return org;
+    return ESP_OK;
 }
 
-static uint8_t* find_in_nvs(uint8_t *key)
+/* append bytes to transmit ring of connection, conn_mutex has to be taken */
+static bool conn_enqueue(conn_ctx* conn, const uint8_t* buf, size_t len)
 {
-    esp_err_t err;
-    nvs_handle_t my_handle;
-    err = nvs_open("storage", NVS_READONLY , &my_handle);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
+    if (len>CONN_TX_BUF-conn->tx_len)
         return false;
-    }        
+
+    size_t tail=(conn->tx_head+conn->tx_len)%CONN_TX_BUF;
+    size_t first=(len > CONN_TX_BUF-tail) ? CONN_TX_BUF-tail : len;
+    memcpy(conn->tx+tail, buf, first);
+    memcpy(conn->tx, buf+first, len-first);
+    conn->tx_len+=len;
+    return true;
+}
+
+/* pass chunk to backend, time of the call is its share of link latency */
+static esp_err_t transport_send(const transport_ops *transport, uint32_t handle, const uint8_t* data, size_t len)
+{
+    int64_t start=esp_timer_get_time();
+    esp_err_t res=transport->send(handle, data, len);
+    int64_t us=esp_timer_get_time()-start;
+
+    transport_stats *stats=transport->stats;
+    portENTER_CRITICAL(&transport_lock);
+    stats->sends++;
+    stats->send_us+=us;
+    if (us>stats->send_max_us)
+        stats->send_max_us=us;
+    if (res==ESP_OK)
+        stats->tx_bytes+=len;
     else
-    {   
-        /* variable to recognize length of value from nvs*/
-        size_t required_size;
+        stats->errors++;
+    portEXIT_CRITICAL(&transport_lock);
+    return res;
+}
 
-        /* get require size w/o any pointer */
-        err=nvs_get_str(my_handle, (char*)key, NULL, &required_size);
-        if (err != ESP_OK)
+/* time from send until link confirmed data, it covers queuing inside transport as well */
+static void transport_delivery(const transport_ops *transport, int64_t us)
+{
+    transport_stats *stats=transport->stats;
+    portENTER_CRITICAL(&transport_lock);
+    stats->delivered++;
+    stats->deliver_us+=us;
+    if (us>stats->deliver_max_us)
+        stats->deliver_max_us=us;
+    portEXIT_CRITICAL(&transport_lock);
+}
+
+/*
+  Pass transmit ring of connection to transport in chunks not bigger than MAX_SPP_PACKET
+  until it is empty or link gets congested. Only one task flushes connection at
+  a time, transport is called without lock so BT callback is never blocked by it.
+ */
+static void conn_flush(uint32_t handle)
+{
+    uint8_t chunk[MAX_SPP_PACKET];
+    bool owner=false;
+    while (1)
+    {
+        xSemaphoreTake(conn_mutex, portMAX_DELAY);
+        conn_ctx *conn=conn_find(handle);
+        if (!conn || (conn->flushing && !owner))
         {
-            ESP_LOGE(FIN_NVS, "Error %s during call nvs_get_str() for key:%s!",esp_err_to_name(err),(char*)key);
-            /* Close the storage handle and free any allocated resources.*/
-            nvs_close(my_handle);
-            return NULL;
+            xSemaphoreGive(conn_mutex);
+            return;
         }
-        ESP_LOGI(FIN_NVS, "Required %d bytes of memory for key:%s allocation ",required_size,key);
-
-        /* allocate required space for credential */
-        uint8_t *logpass= (uint8_t*)malloc(required_size);
-
-        ESP_LOGI(FIN_NVS, "Allocated %d bytes for:%p logpass ",required_size,logpass);
+        if (conn->congested || conn->tx_len==0)
+        {
+            conn->flushing=false;
+            xSemaphoreGive(conn_mutex);
+            return;
+        }
+        conn->flushing=true;
+        owner=true;
+
+        size_t len=(conn->tx_len > MAX_SPP_PACKET) ? MAX_SPP_PACKET : conn->tx_len;
+        size_t first=(len > CONN_TX_BUF-conn->tx_head) ? CONN_TX_BUF-conn->tx_head : len;
+        memcpy(chunk, conn->tx+conn->tx_head, first);
+        memcpy(chunk+first, conn->tx, len-first);
+        /* ring may hold credentials */
+        memset(conn->tx+conn->tx_head, 0, first);
+        memset(conn->tx, 0, len-first);
+        conn->tx_head=(conn->tx_head+len)%CONN_TX_BUF;
+        conn->tx_len-=len;
+        uint16_t left=conn->tx_len;
+        const transport_ops *transport=conn->transport;
+        int64_t start=esp_timer_get_time();
+        /* confirmation may come before send returns, so its start is noted first */
+        if (transport->acked)
+            conn->tx_sent_us[conn->tx_sent++%CONN_IN_FLIGHT]=start;
+        xSemaphoreGive(conn_mutex);
+        trace_record_event(TRACE_WRITE, handle, left, NULL, len);
+
+        esp_err_t res=transport_send(transport, handle, chunk, len);
+        mbedtls_platform_zeroize(chunk, len);
+        if (res==ESP_OK && !transport->acked)
+            transport_delivery(transport, esp_timer_get_time()-start);
+        else if (res!=ESP_OK && transport->acked)
+        {
+            /* failed send is never confirmed, only flushing task adds sends so it is the last one */
+            xSemaphoreTake(conn_mutex, portMAX_DELAY);
+            conn=conn_find(handle);
+            if (conn && conn->tx_sent!=conn->tx_delivered)
+                conn->tx_sent--;
+            xSemaphoreGive(conn_mutex);
+        }
+        if (res!=ESP_OK)
+            ESP_LOGE(CON_TAG, "invoked %s send status :%s, %zu bytes lost for handle:%"PRIu32,transport->name,esp_err_to_name(res),len,handle);
+    }
+}
 
-        /* invoke get function once again w/ pointer*/ 
-        err=nvs_get_str(my_handle, (char*)key, (char*)logpass, &required_size);
-        if (err != ESP_OK)
+/*
+  Send assembled telegram placed at frame+CHANNEL_HEADER, it is sealed into AEAD
+  frame when channel with peer is secured. Frame has to provide CHANNEL_MAC_LEN
+  bytes after telegram. Sealing and queuing are done under one lock so frames
+  leave in order of their sequence numbers.
+ */
+static bool channel_send(uint32_t handle, uint8_t* frame, size_t len)
+{
+    bool queued=false;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
+        trace_record_event(TRACE_TX, handle, conn->tx_len, frame+CHANNEL_HEADER, len);
+    if (conn && conn->channel.secured)
+    {
+        int64_t start=esp_timer_get_time();
+        uint8_t nonce[VAULT_NONCE_LEN];
+        channel_nonce(conn->channel.tx_seq++, nonce);
+        frame[0]=CHANNEL_FRAME;
+        frame[1]=(len+CHANNEL_MAC_LEN)>>8;
+        frame[2]=(len+CHANNEL_MAC_LEN)&0xff;
+        int ret=mbedtls_gcm_crypt_and_tag(&conn->channel.tx, MBEDTLS_GCM_ENCRYPT, len, nonce, sizeof(nonce), frame, CHANNEL_HEADER,
+                                          frame+CHANNEL_HEADER, frame+CHANNEL_HEADER, CHANNEL_MAC_LEN, frame+CHANNEL_HEADER+len);
+        if (ret==0)
         {
-            free(logpass);
-            ESP_LOGE(FIN_NVS, "Error %s during call invoked nvs_get_str()!",esp_err_to_name(err));
-            /* Close the storage handle and free any allocated resources.*/
-            nvs_close(my_handle);
-            return NULL;
+            ESP_LOGI(CHN_TAG, "sealed frame of %zu bytes in %"PRId64" us",len,esp_timer_get_time()-start);
+            queued=conn_enqueue(conn, frame, CHANNEL_HEADER+len+CHANNEL_MAC_LEN);
         }
-        ESP_LOGI(FIN_NVS, "Aquired %s value for key:%s allocation ",logpass,key);
+        else
+            ESP_LOGE(CHN_TAG, "sealing frame failed: -0x%04x",-ret);
+    }
+    else if (conn)
+        queued=conn_enqueue(conn, frame+CHANNEL_HEADER, len);
+    xSemaphoreGive(conn_mutex);
+
+    if (!queued)
+        ESP_LOGE(CON_TAG, "telegram of %zu bytes for handle:%"PRIu32" not queued",len,handle);
+    conn_flush(handle);
+    return queued;
+}
 
-        /* return found whole credential stored in nvs */
-        return logpass;
+static void session_drop_reply(session_reply* reply)
+{
+    if (reply->frame)
+    {
+        /* reply may carry credentials */
+        mbedtls_platform_zeroize(reply->frame, CHANNEL_HEADER+reply->len);
+        mem_free(reply->frame);
+    }
+    memset(reply, 0, sizeof(*reply));
+}
+
+static bool session_same_domain(const session_reply* reply, const msg_field* domain)
+{
+    return reply->frame && memcmp(reply->domain, domain->data, domain->len)==0 && reply->domain[domain->len]=='\0';
+}
+
+/* connected session using handle, session_mutex has to be taken */
+static session_ctx* session_find(uint32_t handle)
+{
+    for (size_t i = 0; i < SESSION_SLOTS; i++)
+    {
+        if (sessions[i].used && sessions[i].connected && sessions[i].handle==handle)
+            return &sessions[i];
     }
     return NULL;
 }
 
-static bool erase_from_nvs(uint8_t *key)
+static bool session_expired(const session_ctx* session, TickType_t now)
 {
-    bool result=true;
+    return session->used && !session->connected && now-session->closed >= SESSION_GRACE;
+}
 
-    esp_err_t err;
+/* peer connected, state of known BDA is taken over when grace period did not pass */
+static void session_open(const uint8_t* bda, uint32_t handle)
+{
+    char bda_str[18] = {0};
+    TickType_t now=xTaskGetTickCount();
+    session_ctx *session=NULL;
 
-    /* key argument is empty erase all keys*/
-    if (key[0]=='\0')
-    {   
-        nvs_handle_t my_handle;
-        err = nvs_open("storage", NVS_READWRITE , &my_handle);
-        if (err != ESP_OK)
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < SESSION_SLOTS; i++)
+    {
+        if (session_expired(&sessions[i], now))
         {
-            ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
-            return false;
-        } 
+            for (size_t k = 0; k < SESSION_PENDING; k++)
+                session_drop_reply(&sessions[i].pending[k]);
+            sessions[i].used=false;
+        }
+        if (sessions[i].used && memcmp(sessions[i].bda, bda, ESP_BD_ADDR_LEN)==0)
+            session=&sessions[i];
+    }
 
-        err = nvs_erase_all(my_handle);
-        if (err != ESP_OK)
+    if (session)
+    {
+        session->reconnects++;
+        session->replay=false;
+        for (size_t k = 0; k < SESSION_PENDING; k++)
+            session->replay|=(session->pending[k].frame!=NULL);
+        ESP_LOGI(SES_TAG, "peer [%s] resumed session after %"PRIu32" ms, version:%d, replay:%d, requests:%"PRIu32", reconnects:%"PRIu32,
+                 bda2str((uint8_t*)bda, bda_str, sizeof(bda_str)),(uint32_t)((now-session->closed)*portTICK_PERIOD_MS),
+                 session->version,session->replay,session->requests,session->reconnects);
+    }
+    else
+    {
+        /* take free slot or forget peer disconnected for the longest time */
+        for (size_t i = 0; i < SESSION_SLOTS; i++)
         {
-            ESP_LOGE(ERA_NVS, "Error %s during call nvs_erase_all() !",esp_err_to_name(err));
-            /* Close the storage handle and free any allocated resources.*/
-            nvs_close(my_handle);
-            return false;
+            if (sessions[i].connected)
+                continue;
+            if (!sessions[i].used)
+            {
+                session=&sessions[i];
+                break;
+            }
+            if (!session || now-sessions[i].closed > now-session->closed)
+                session=&sessions[i];
         }
-        /* Close the storage handle and free any allocated resources.*/
-        nvs_close(my_handle);
+        if (session)
+        {
+            for (size_t k = 0; k < SESSION_PENDING; k++)
+                session_drop_reply(&session->pending[k]);
+            memset(session, 0, sizeof(*session));
+            session->used=true;
+            session->version=SESSION_PLAIN;
+            memcpy(session->bda, bda, ESP_BD_ADDR_LEN);
+            ESP_LOGI(SES_TAG, "new session for peer [%s]",bda2str((uint8_t*)bda, bda_str, sizeof(bda_str)));
+        }
+        else
+            ESP_LOGE(SES_TAG, "no session slot for peer [%s]",bda2str((uint8_t*)bda, bda_str, sizeof(bda_str)));
     }
-    /* erase one pair <key,value> */
-    else
+
+    if (session)
     {
-      /* check if requested key exist*/
-      uint8_t* found_key=find_in_nvs(key);
+        session->connected=true;
+        session->handle=handle;
+    }
+    xSemaphoreGive(session_mutex);
+}
 
-      /* key found in namespace storage*/
-      if (found_key)
-      {
-        
-        nvs_handle_t my_handle;
-        err = nvs_open("storage", NVS_READWRITE , &my_handle);
-        if (err != ESP_OK)
-        {
-            ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
-            return false;
-        } 
+/* peer disconnected, grace period starts */
+static void session_close(uint32_t handle)
+{
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    if (session)
+    {
+        session->connected=false;
+        session->closed=xTaskGetTickCount();
+    }
+    xSemaphoreGive(session_mutex);
+}
 
-        err = nvs_erase_key(my_handle, (char*)key);
+/* count telegram of peer, returns false when session requires secure channel */
+static bool session_request(uint32_t handle, bool secured)
+{
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    bool allowed=true;
+    if (session)
+    {
+        session->requests++;
+        /* peer which negotiated secure channel must not be downgraded by reconnection */
+        allowed=secured || session->version<SESSION_SECURE;
+    }
+    xSemaphoreGive(session_mutex);
+    return allowed;
+}
 
-        if (err != ESP_OK)
+/* channel keys established with peer */
+static void session_upgrade(uint32_t handle)
+{
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    if (session)
+        session->version=SESSION_SECURE;
+    xSemaphoreGive(session_mutex);
+}
+
+/* keep copy of credential reply until LOGPC acknowledges it with UI_DONE */
+static void session_remember(uint32_t handle, const msg_field* domain, const uint8_t* message, size_t len)
+{
+    if (domain->len>=NVS_KEY_NAME_MAX_SIZE)
+        return;
+
+    uint8_t *frame=(uint8_t*)mem_alloc(CHANNEL_HEADER+len+CHANNEL_MAC_LEN, MEM_SITE_SESSION);
+    if (!frame)
+        return;
+    memcpy(frame+CHANNEL_HEADER, message, len);
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    if (session)
+    {
+        /* reply for the same domain replaces previous one */
+        size_t slot=SESSION_PENDING;
+        for (size_t k = 0; k < SESSION_PENDING && slot==SESSION_PENDING; k++)
         {
-            ESP_LOGE(ERA_NVS, "Error %s during call nvs_erase_key() for key:%s!",esp_err_to_name(err),(char*)key);
-            /* Close the storage handle and free any allocated resources.*/
-            nvs_close(my_handle);
-            return false;
-        }       
-        free(found_key);
-        /* Close the storage handle and free any allocated resources.*/
-        nvs_close(my_handle);
-      }
-      else
-      {
-        /* delete not possible, missing key*/
-        return false;
-      }
-      
+            if (session_same_domain(&session->pending[k], domain))
+                slot=k;
+        }
+        for (size_t k = 0; k < SESSION_PENDING && slot==SESSION_PENDING; k++)
+        {
+            if (!session->pending[k].frame)
+                slot=k;
+        }
+        /* all slots taken, oldest reply is dropped */
+        if (slot==SESSION_PENDING)
+        {
+            session_drop_reply(&session->pending[0]);
+            memmove(&session->pending[0], &session->pending[1], (SESSION_PENDING-1)*sizeof(session_reply));
+            slot=SESSION_PENDING-1;
+            memset(&session->pending[slot], 0, sizeof(session_reply));
+        }
+        session_drop_reply(&session->pending[slot]);
+        session->pending[slot].frame=frame;
+        session->pending[slot].len=len;
+        memcpy(session->pending[slot].domain, domain->data, domain->len);
+        session->pending[slot].domain[domain->len]='\0';
+        frame=NULL;
     }
-    
-    return result;
+    xSemaphoreGive(session_mutex);
+    mem_free(frame);
 }
 
-static uint32_t usage_stats()
+/* result of mutation already performed for peer with this sequence number */
+static bool session_mutation_find(uint32_t handle, uint32_t seq, session_mutation* found)
 {
-    //get overview of actual statistics of data entries :
-    nvs_stats_t nvs_stats;
-    nvs_get_stats(NULL, &nvs_stats);
-    ESP_LOGI(SPP_TAG,"Count: UsedEntries = (%u), FreeEntries = (%u), Usage = (%u%%) AllEntries = (%u)\n",
-    nvs_stats.used_entries, nvs_stats.free_entries, (nvs_stats.used_entries*100/nvs_stats.total_entries), nvs_stats.total_entries);
-    return (nvs_stats.used_entries*100/nvs_stats.total_entries);
+    bool hit=false;
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    for (size_t k = 0; session && k < SESSION_MUTATIONS && !hit; k++)
+    {
+        if (session->mutations[k].used && session->mutations[k].seq==seq)
+        {
+            *found=session->mutations[k];
+            session->deduplicated++;
+            hit=true;
+        }
+    }
+    if (hit)
+        ESP_LOGI(SES_TAG, "mutation %"PRIu32" retried, result %d replayed, %"PRIu32" retries so far",seq,found->result,session->deduplicated);
+    xSemaphoreGive(session_mutex);
+    return hit;
 }
 
-/*Process incomming messages from SPP client*/
-static void process_telegram(void *arg)
+static void session_mutation_record(uint32_t handle, uint32_t seq, UI_ENUM result, const msg_field* domain, uint8_t fields)
 {
+    if (fields && domain->len>=NVS_KEY_NAME_MAX_SIZE)
+        return;
 
-    /*struct pointer for buffer from queue*/
-    rcv_tele *tel;
-    while(1)
-    {       /*wait for next telegram*/
-        if(xQueueReceive(ReceivedQueue, &tel, portMAX_DELAY) == pdTRUE)
-        {
-            /*messages in queue*/
-            //UBaseType_t len= uxQueueMessagesWaiting( ReceivedQueue );
-            printf("%s\t%d\n",tel->data,tel->len);
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    if (session)
+    {
+        session_mutation *mutation=&session->mutations[session->mutation_next];
+        session->mutation_next=(session->mutation_next+1)%SESSION_MUTATIONS;
+        mutation->used=true;
+        mutation->seq=seq;
+        mutation->result=result;
+        mutation->fields=fields;
+        mutation->domain_len=fields ? domain->len : 0;
+        memcpy(mutation->domain, domain->data, mutation->domain_len);
+    }
+    xSemaphoreGive(session_mutex);
+}
+
+/* UI_DONE for domain, reply does not need to be replayed anymore */
+static void session_acknowledge(uint32_t handle, const msg_field* domain)
+{
+    if (domain->len>=NVS_KEY_NAME_MAX_SIZE)
+        return;
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    session_ctx *session=session_find(handle);
+    for (size_t k = 0; session && k < SESSION_PENDING; k++)
+    {
+        if (session_same_domain(&session->pending[k], domain))
+            session_drop_reply(&session->pending[k]);
+    }
+    xSemaphoreGive(session_mutex);
+}
 
-            /*first byte consist of telegram mode*/
-             UI_ENUM mode=telegram_mode(tel->data[0]); //TODO:prio!!!correct functionality to not catch other letters
+/*
+  Send replies which were not acknowledged before disconnection.
+  Peer speaking secure channel gets them only after handshake.
+ */
+static void session_replay(uint32_t handle)
+{
+    uint8_t frame[CHANNEL_HEADER+MAX_TELEGRAM+CHANNEL_MAC_LEN];
+    for (size_t k = 0; k < SESSION_PENDING; k++)
+    {
+        size_t len=0;
 
-            /*valid mode in telegram*/
-            if(mode>UI_UNKNOWN)
+        /* copy under lock, sending must not block BT callback */
+        xSemaphoreTake(session_mutex, portMAX_DELAY);
+        session_ctx *session=session_find(handle);
+        if (session && session->replay && (session->version<SESSION_SECURE || channel_secured(handle)))
+        {
+            if (k==SESSION_PENDING-1)
+                session->replay=false;
+            if (session->pending[k].frame)
             {
-                /*telegram should contains at most 3 additional text places mode,domain,login,password*/
-                uint8_t* content[3];
+                len=session->pending[k].len;
+                memcpy(frame+CHANNEL_HEADER, session->pending[k].frame+CHANNEL_HEADER, len);
+                session->replays++;
+            }
+        }
+        xSemaphoreGive(session_mutex);
 
-                /*entry number from telegram*/
-                int j=0;
+        if (len)
+        {
+            ESP_LOGI(SES_TAG, "replay %zu bytes of unacknowledged reply to handle:%"PRIu32,len,handle);
+            channel_send(handle, frame, len);
+            mbedtls_platform_zeroize(frame, sizeof(frame));
+        }
+    }
+}
 
-                /*first and last character of element in telegram*/
-                int start_char,end_char=1;
+/* send telegram assembled at frame+CHANNEL_HEADER, credential replies are kept until UI_DONE */
+static bool send_prepared(UI_ENUM element, const msg_field* domain, uint8_t* frame, size_t len, uint32_t handle)
+{
+    /* credential has to reach LOGPC even when link drops before UI_DONE */
+    if (element>=UI_LOGIN && element<=UI_LOGPASS && domain)
+        session_remember(handle, domain, frame+CHANNEL_HEADER, len);
+    bool sent=channel_send(handle, frame, len);
+    ESP_LOGI(CRE_MSG, "invoked channel_send status :%d",sent);
+    if (sent && element>=UI_LOGIN && element<=UI_LOGPASS)
+        boot_mark(BOOT_FIRST_REPLY);
+    return sent;
+}
 
-                //TODO: can happen that telegram will not contain comma (delete all or get statws)
-                /* correct separator after mode bytefield*/
-                if(tel->data[1]==',')
-                {
-                    /*loop through whole telegram w/o mode bit */
-                    for (size_t i = 2 ; i <= tel->len; i++)
-                    {   
-                        /*comma separator ',' or last character is read*/
-                        if(tel->data[i]==EXT || i==tel->len)
-                        {
-                            /*last end_char is ',' so next start_char should be end_char+1*/
-                            start_char=end_char+1;
-                            /*save found position*/
-                            end_char=i;
-                            
-                            /*allocate memory for found element (+1 for null terminator)*/
-                            content[j]=(uint8_t *)malloc(sizeof(uint8_t)*(end_char-start_char+1));
-
-                            ESP_LOGI(TEL_TAG, "Allocated %d bytes for:%p content[%d] ",sizeof(uint8_t)*(end_char-start_char+1),content[j],j);
-
-                            memcpy(content[j],&tel->data[start_char],(end_char-start_char+1));
-
-                            /* replace seperator character with null terminator*/
-                            content[j][end_char-start_char]='\0';
-                            ESP_LOGI(TEL_TAG, "%d element found in telegram %s\t start_char:%d, end_char:%d ",j,content[j],start_char,end_char);
-                            /*search for next element in telegram*/
-                            j++;
-                        }
-                    }
-                    /*which mode has telegram*/
-                    switch (mode)
-                    {
-                    case UI_DOMAIN:
-                        ESP_LOGI(TEL_TAG, "UI_DOMAIN telegram:%s",tel->data);
-                        //TODO: domain telegram
-                        break;
-                    case UI_LOGIN...UI_PASSWORD:
-                        /*TELEGRAM:UI_ENUM,domain*/
-                        ESP_LOGI(TEL_TAG, "%s telegram:%s",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",tel->data);
-
-                        /*telegram should contains only one element*/
-                        if (j==1)
-                        {   
-                            /*search credential in non-volatile storage memory*/
-                            uint8_t* credential=find_in_nvs((uint8_t*)content[0]);
-
-                            /* credential found; create message with found item*/
-                            if(credential)
-                            {   
-                                uint8_t* element_cred=extract_credential(mode,credential);
-                                create_message(mode,content[0],element_cred,NULL, tel->handle);
-
-                                ESP_LOGI(TEL_TAG, "Release memory for:%p credential ",credential);
-                                /* clean up after msg has been created*/
-                                free(credential);
-                            }
-                            else
-                            {       
-                                // ESP_LOGE(TEL_TAG, "%s for domain:%s missed in NVS",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",content[0]); //redundant message
-                                /* create message w/o credential*/
-                                create_message(UI_MISSED,content[0],NULL,NULL,tel->handle);
-                            }
-                        }
-                        else
-                            ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);                        
-                        break;
-                    case UI_LOGPASS:
-                        ESP_LOGI(TEL_TAG, "UI_LOGPASS telegram:%s",tel->data);
-
-                        /*telegram should contains only one element*/
-                        if (j==1)
-                        {   
-                            /*search credential in non-volatile storage memory*/
-                            uint8_t* credential=find_in_nvs((uint8_t*)content[0]);
-
-                            /* credential found; create message with found item*/
-                            if(credential)
-                            { 
-                                uint8_t* pass_cred=extract_credential(UI_PASSWORD,credential);
-                                uint8_t* log_cred=extract_credential(UI_LOGIN,credential);
-                                create_message(mode,content[0],log_cred,pass_cred, tel->handle);   
-
-                                ESP_LOGI(TEL_TAG, "Release memory for:%p credential ",credential);
-                                /* clean up after msg has been created*/
-                                free(credential);        
-                            }
-                                
-                            else
-                            {       
-                                // ESP_LOGE(TEL_TAG, "%s for domain:%s missed in NVS",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",content[0]); //redundant message
-                                /* create message w/o credential*/
-                                create_message(UI_MISSED,content[0],NULL,NULL,tel->handle);
-                            }
+static bool create_message(UI_ENUM element, const msg_field* fields, size_t count, uint32_t handle)
+{
 
-                        }
+    if (element<=UI_UNKNOWN || element>=UI_COUNT)
+    {
+        ESP_LOGE(CRE_MSG, "Message mode invalid: %d ",element); 
+        return false;
+    }      
 
-                        break;
-                    case UI_DONE:
-                        ESP_LOGI(TEL_TAG, "UI_DONE telegram:%s",tel->data);
+    /* frame buffer with maximal bytes of reply, telegram is placed after frame header */
+    uint8_t frame[CHANNEL_HEADER+MAX_TELEGRAM+CHANNEL_MAC_LEN];
+    uint8_t *message=frame+CHANNEL_HEADER;
+    size_t len;
 
-                        break;
-                    case UI_NEW_CREDENTIAL:
-                        /*TELEGRAM:UI_ENUM,domain,login,password*/
-                        ESP_LOGI(TEL_TAG, "UI_NEW_CREDENTIAL telegram:%s",tel->data);
-                        /*telegram should contains three elements*/
-                        if (j==3)
-                        {  /* add new credential*/
-
-                            if (add_to_nvs(content))
-                            {
-                                ESP_LOGI(TEL_TAG, "Succesfully added to nvs domain: %s ",(char*)content[0]);
-                                /* create message w/o credential*/
-                                create_message(UI_DONE,content[0],NULL,NULL,tel->handle);
-                            }
-                            else
-                            {
-                                ESP_LOGI(TEL_TAG, "Fail to add to nvs domain:  %s ",(char*)content[0]);
-                                /* create message w/o credential*/
-                                create_message(UI_FAIL,content[0],NULL,NULL,tel->handle);
-                            }
-                        }
-                        else
-                            ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);  
+    esp_err_t res=build_message(element, fields, count, message, MAX_TELEGRAM, &len);
+    if (res==ESP_ERR_INVALID_SIZE)
+    {
+        ESP_LOGE(CRE_MSG, "message mode %d truncated, required %zu bytes but only %d available",element,len,MAX_TELEGRAM);
 
-                        break;
-                    case UI_ERASE:
-                        ESP_LOGI(TEL_TAG, "UI_ERASE telegram:%s",tel->data);
-                        /* erase exactly one pair <key,value>*/
-                        bool res=true;
-                        if (j==1)
-                        {
-                            res=erase_from_nvs(content[0]); 
-                        }
-                        /* erase all stored pairs <key,value>*/
-                        else if(j==0)
-                        {
-                            /* create pointer to empty string */
-                            uint8_t *temp = (uint8_t *)"";
-                            res=erase_from_nvs(temp);
-                        }
+        /* let peer know that request failed instead of sending cut credential, domain always fits */
+        if (element==UI_FAIL || count==0 || build_message(UI_FAIL, fields, 1, message, MAX_TELEGRAM, &len)!=ESP_OK)
+            return false;
+    }
+    else if (res!=ESP_OK)
+    {
+        ESP_LOGE(CRE_MSG, "message mode %d could not be assembled",element);
+        return false;
+    }
 
-                        if (res)
-                        {
-                            ESP_LOGI(TEL_TAG, "Succesfully erased from nvs %s ",((j==0) ? "all keys" : (char*)content[0]));
-                            /* create message w/o credential*/
-                            create_message(UI_DONE,content[0],NULL,NULL,tel->handle);
-                        }
-                        else
-                        {
-                            ESP_LOGE(TEL_TAG, "Failed to erase from nvs %s ",((j==0) ? "all keys" : (char*)content[0]));
-                            /* create message w/o credential*/
-                            create_message(UI_FAIL,content[0],NULL,NULL,tel->handle);
-                        }
-                        break;
-                    case UI_MISSED:
-                        ESP_LOGI(TEL_TAG, "UI_MISSED telegram:%s",tel->data);
-                        //TODO: missed telegram
-                        break;    
-                    case UI_FAIL:
-                        ESP_LOGI(TEL_TAG, "UI_FAIL telegram:%s",tel->data);
-                        //TODO: missed telegram
-                        break;    
-                    case UI_STATS:
-                        ESP_LOGI(TEL_TAG, "UI_STATS telegram:%s",tel->data);
-                        /* max 3 characters "0"<->"100"*/
-                        char prc[3];
-                        /* int to char**/
-                        sprintf(prc,"%d",usage_stats());
-                        create_message(UI_STATS,prc,NULL,NULL,tel->handle);
-                        break;                                                                                 
-                    default:
-                        ESP_LOGE(TEL_TAG, "Undifined mode telegram:%s",tel->data);
-                        break;
-                    }
-        
-                    /*release memory for extracted elements from telegram*/
-                    while(--j>=0)
-                    {
-                        ESP_LOGI(TEL_TAG, "Release memory for:%p content[%d] ",content[j],j);
-                        free(content[j]); 
-                    }
-                        
+    ESP_LOGI(CRE_MSG, "message mode %d assembled with size %zu",element,len);
 
-                }
-                else
-                    ESP_LOGE(TEL_TAG, "first separator field has not been recognized telegram:%s",tel->data);
+    bool sent=send_prepared((res==ESP_OK) ? element : UI_FAIL, (count>0) ? &fields[0] : NULL, frame, len, handle);
+    return (sent && res==ESP_OK);
+}
 
-                
-            }
-            else
-                ESP_LOGE(TEL_TAG, "UI_UNKNOWN structure telegram:%s",tel->data);
 
-            
+/* load static key of device or create it on first start */
+static bool channel_load_identity(void)
+{
+    if (channel_identity_loaded)
+        return true;
 
+    mbedtls_ecp_group_init(&channel_grp);
+    mbedtls_mpi_init(&channel_identity);
+    int ret=mbedtls_ecp_group_load(&channel_grp, MBEDTLS_ECP_DP_CURVE25519);
+    if (ret!=0)
+    {
+        ESP_LOGE(CHN_TAG, "loading curve failed: -0x%04x",-ret);
+        return false;
+    }
+
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(VAULT_NAMESPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(CHN_TAG, "Error (%s) opening NVS handle of vault!",esp_err_to_name(err));
+        return false;
+    }
+
+    /* private scalar (little endian) | public key */
+    uint8_t identity[2*CHANNEL_KEY_LEN];
+    size_t len=sizeof(identity);
+    err=nvs_get_blob(my_handle, CHANNEL_IDENTITY, identity, &len);
+    if (err==ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGI(CHN_TAG, "device identity missing, generate new one");
+        mbedtls_ecp_point pub;
+        mbedtls_ecp_point_init(&pub);
+        size_t olen;
+        ret=mbedtls_ecdh_gen_public(&channel_grp, &channel_identity, &pub, channel_rng, NULL);
+        if (ret==0)
+            ret=mbedtls_mpi_write_binary_le(&channel_identity, identity, CHANNEL_KEY_LEN);
+        if (ret==0)
+            ret=mbedtls_ecp_point_write_binary(&channel_grp, &pub, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, identity+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+        mbedtls_ecp_point_free(&pub);
+
+        err=(ret==0) ? nvs_set_blob(my_handle, CHANNEL_IDENTITY, identity, sizeof(identity)) : ESP_FAIL;
+        if (err==ESP_OK)
+            err=nvs_commit(my_handle);
+        len=sizeof(identity);
+    }
+    else if (err==ESP_OK && len==sizeof(identity))
+        ret=mbedtls_mpi_read_binary_le(&channel_identity, identity, CHANNEL_KEY_LEN);
+    /* Close the storage handle and free any allocated resources.*/
+    nvs_close(my_handle);
+
+    if (err!=ESP_OK || ret!=0 || len!=sizeof(identity))
+    {
+        ESP_LOGE(CHN_TAG, "Error (%s, -0x%04x) loading device identity",esp_err_to_name(err),-ret);
+        mbedtls_platform_zeroize(identity, sizeof(identity));
+        return false;
+    }
+
+    memcpy(channel_identity_pub, identity+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+    mbedtls_platform_zeroize(identity, sizeof(identity));
+    channel_identity_loaded=true;
+    return true;
+}
+
+/* hand secret of current channel over to new ticket and send its id through secured channel */
+static void channel_issue_ticket(uint32_t handle)
+{
+    /* take unused slot or replace oldest ticket */
+    channel_ticket *ticket=&channel_tickets[0];
+    TickType_t now=xTaskGetTickCount();
+    for (size_t i = 0; i < CHANNEL_TICKETS; i++)
+    {
+        if (!channel_tickets[i].valid)
+        {
+            ticket=&channel_tickets[i];
+            break;
+        }
+        if (now-channel_tickets[i].issued > now-ticket->issued)
+            ticket=&channel_tickets[i];
+    }
+
+    esp_fill_random(ticket->id, sizeof(ticket->id));
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
+        memcpy(ticket->secret, conn->channel.resumption, sizeof(ticket->secret));
+    xSemaphoreGive(conn_mutex);
+    if (!conn)
+        return;
+    ticket->issued=now;
+    ticket->valid=true;
+
+    uint8_t id_hex[2*CHANNEL_TICKET_LEN];
+    hex_encode(ticket->id, sizeof(ticket->id), id_hex);
+    msg_field field={id_hex,sizeof(id_hex)};
+    create_message(UI_RESUME, &field, 1, handle);
+}
+
+/*
+  Full handshake, TELEGRAM:UI_HELLO,<ephemeral public key of LOGPC>
+  Reply UI_HELLO,<ephemeral public key>,<static public key> is sent in plaintext,
+  keys come from both ephemeral-ephemeral and static-ephemeral X25519 so only
+  device holding pinned identity is able to open following frames.
+ */
+static void channel_hello(uint32_t handle, const msg_field* peer_field)
+{
+    int64_t start=esp_timer_get_time();
+
+    uint8_t peer[CHANNEL_KEY_LEN];
+    if (!hex_decode(peer_field->data, peer_field->len, peer, sizeof(peer)) || !channel_load_identity())
+    {
+        ESP_LOGE(CHN_TAG, "handshake of handle:%"PRIu32" rejected",handle);
+        create_message(UI_FAIL, NULL, 0, handle);
+        return;
+    }
+
+    mbedtls_mpi eph, shared;
+    mbedtls_ecp_point eph_pub, peer_pub;
+    mbedtls_mpi_init(&eph);
+    mbedtls_mpi_init(&shared);
+    mbedtls_ecp_point_init(&eph_pub);
+    mbedtls_ecp_point_init(&peer_pub);
+
+    /* transcript: label | peer ephemeral | own ephemeral | own static */
+    uint8_t info[sizeof(CHANNEL_HELLO_INFO)-1+3*CHANNEL_KEY_LEN];
+    uint8_t *transcript=info+sizeof(CHANNEL_HELLO_INFO)-1;
+    memcpy(info, CHANNEL_HELLO_INFO, sizeof(CHANNEL_HELLO_INFO)-1);
+    memcpy(transcript, peer, CHANNEL_KEY_LEN);
+    memcpy(transcript+2*CHANNEL_KEY_LEN, channel_identity_pub, CHANNEL_KEY_LEN);
+
+    uint8_t ikm[2*CHANNEL_KEY_LEN];
+    size_t olen;
+    int ret=mbedtls_ecdh_gen_public(&channel_grp, &eph, &eph_pub, channel_rng, NULL);
+    if (ret==0)
+        ret=mbedtls_ecp_point_write_binary(&channel_grp, &eph_pub, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, transcript+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+    if (ret==0)
+        ret=mbedtls_ecp_point_read_binary(&channel_grp, &peer_pub, peer, sizeof(peer));
+    if (ret==0)
+        ret=mbedtls_ecdh_compute_shared(&channel_grp, &shared, &peer_pub, &eph, channel_rng, NULL);
+    if (ret==0)
+        ret=mbedtls_mpi_write_binary_le(&shared, ikm, CHANNEL_KEY_LEN);
+    if (ret==0)
+        ret=mbedtls_ecdh_compute_shared(&channel_grp, &shared, &peer_pub, &channel_identity, channel_rng, NULL);
+    if (ret==0)
+        ret=mbedtls_mpi_write_binary_le(&shared, ikm+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+
+    mbedtls_mpi_free(&eph);
+    mbedtls_mpi_free(&shared);
+    mbedtls_ecp_point_free(&eph_pub);
+    mbedtls_ecp_point_free(&peer_pub);
+
+    uint8_t keys[3*CHANNEL_KEY_LEN];
+    if (ret==0)
+        ret=mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, ikm, sizeof(ikm), info, sizeof(info), keys, sizeof(keys));
+    mbedtls_platform_zeroize(ikm, sizeof(ikm));
+    int64_t elapsed=esp_timer_get_time()-start;
+
+    if (ret!=0)
+    {
+        ESP_LOGE(CHN_TAG, "handshake of handle:%"PRIu32" failed: -0x%04x",handle,-ret);
+        mbedtls_platform_zeroize(keys, sizeof(keys));
+        create_message(UI_FAIL, NULL, 0, handle);
+        return;
+    }
+
+    /* own keys leave in plaintext, LOGPC derives the same channel keys from them */
+    uint8_t eph_hex[2*CHANNEL_KEY_LEN], id_hex[2*CHANNEL_KEY_LEN];
+    hex_encode(transcript+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN, eph_hex);
+    hex_encode(channel_identity_pub, CHANNEL_KEY_LEN, id_hex);
+    msg_field fields[2]={{eph_hex,sizeof(eph_hex)},{id_hex,sizeof(id_hex)}};
+    create_message(UI_HELLO, fields, 2, handle);
+
+    bool installed=channel_install(handle, keys);
+    mbedtls_platform_zeroize(keys, sizeof(keys));
+    ESP_LOGI(CHN_TAG, "full handshake of handle:%"PRIu32" took %"PRId64" us",handle,elapsed);
+
+    /* first secured frame confirms keys to LOGPC */
+    if (installed)
+    {
+        channel_issue_ticket(handle);
+        session_upgrade(handle);
+        session_replay(handle);
+    }
+}
+
+/*
+  Resumption, TELEGRAM:UI_RESUME,<ticket>,<nonce of LOGPC>
+  Keys are derived from secret of ticket and fresh nonces of both sides,
+  no public key operation is needed. Ticket is used only once.
+ */
+static void channel_resume(uint32_t handle, const msg_field* ticket_field, const msg_field* nonce_field)
+{
+    int64_t start=esp_timer_get_time();
+
+    uint8_t id[CHANNEL_TICKET_LEN];
+    /* client nonce | server nonce */
+    uint8_t salt[2*CHANNEL_NONCE_LEN];
+    channel_ticket *ticket=NULL;
+    if (hex_decode(ticket_field->data, ticket_field->len, id, sizeof(id)) &&
+        hex_decode(nonce_field->data, nonce_field->len, salt, CHANNEL_NONCE_LEN))
+    {
+        TickType_t now=xTaskGetTickCount();
+        for (size_t i = 0; i < CHANNEL_TICKETS; i++)
+        {
+            /* compare whole id, time does not depend on matching prefix */
+            uint8_t diff=0;
+            for (size_t k = 0; k < CHANNEL_TICKET_LEN; k++)
+                diff|=channel_tickets[i].id[k]^id[k];
+
+            if (channel_tickets[i].valid && diff==0 && now-channel_tickets[i].issued < CHANNEL_TICKET_LIFETIME)
+                ticket=&channel_tickets[i];
+        }
+    }
+
+    if (!ticket)
+    {
+        /* LOGPC falls back to full handshake */
+        ESP_LOGI(CHN_TAG, "resumption of handle:%"PRIu32" refused, unknown or expired ticket",handle);
+        create_message(UI_FAIL, NULL, 0, handle);
+        return;
+    }
+
+    esp_fill_random(salt+CHANNEL_NONCE_LEN, CHANNEL_NONCE_LEN);
+    uint8_t keys[3*CHANNEL_KEY_LEN];
+    int ret=mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), salt, sizeof(salt), ticket->secret, sizeof(ticket->secret),
+                         (const unsigned char*)CHANNEL_RESUME_INFO, sizeof(CHANNEL_RESUME_INFO)-1, keys, sizeof(keys));
+    mbedtls_platform_zeroize(ticket, sizeof(*ticket));
+    int64_t elapsed=esp_timer_get_time()-start;
+
+    if (ret!=0)
+    {
+        ESP_LOGE(CHN_TAG, "resumption of handle:%"PRIu32" failed: -0x%04x",handle,-ret);
+        mbedtls_platform_zeroize(keys, sizeof(keys));
+        create_message(UI_FAIL, NULL, 0, handle);
+        return;
+    }
+
+    uint8_t nonce_hex[2*CHANNEL_NONCE_LEN];
+    hex_encode(salt+CHANNEL_NONCE_LEN, CHANNEL_NONCE_LEN, nonce_hex);
+    msg_field field={nonce_hex,sizeof(nonce_hex)};
+    create_message(UI_RESUME, &field, 1, handle);
+
+    bool installed=channel_install(handle, keys);
+    mbedtls_platform_zeroize(keys, sizeof(keys));
+    ESP_LOGI(CHN_TAG, "resumption of handle:%"PRIu32" took %"PRId64" us",handle,elapsed);
+
+    if (installed)
+    {
+        channel_issue_ticket(handle);
+        session_upgrade(handle);
+        session_replay(handle);
+    }
+}
+
+static uint8_t* logpass_concat(uint8_t* login, uint8_t* password)
+{
+
+    /* pointer to track other objects*/
+    uint8_t *tmp;
+
+    /* length of string*/
+    int len;
+
+    /* keep address of login to count len*/
+    tmp=login;
+
+    /* stop when null comes up*/
+    while (*tmp)
+        tmp++;
+
+    /* length of login + separetor */
+    len=(tmp-login)+1;
+
+    /* keep address of password to count len*/
+    tmp=password;
+
+     /* stop when null comes up*/
+    while (*tmp)
+        tmp++;
+
+    /* combined length login + separator + password*/
+    len+=(tmp-password);
+
+    /* allocate sufficcient area for concatenated string and null terminator*/
+    uint8_t *logpass= (uint8_t*)mem_alloc(sizeof(uint8_t)*(len+1), MEM_SITE_CONCAT);
+    ESP_LOGI(LOGPASS, "Allocated %zu bytes for:%p logpass ",sizeof(uint8_t)*(len+1),logpass);
+    if (!logpass)
+        return NULL;
+
+    /* keep address of logpass to combine strings*/    
+    tmp=logpass;
+
+    /* copy all login characters to new string*/
+    while ((*tmp++=*login++)!='\0');
+    
+
+    /* move pointer backward to replace termination with separator character
+       then move back */
+    tmp--;
+    *tmp++=EXT;
+
+    /* copy all password characters to new string*/
+    while ((*tmp++=*password++)!='\0');
+    
+
+    ESP_LOGI(LOGPASS, " login%cpassword has been concatenated, %d characters",EXT,len);
+
+    return logpass;
+}
+
+/* drop cached session key, vault_mutex has to be taken */
+static void vault_wipe(void)
+{
+    if (vault_unlocked)
+    {
+        /* zeroize key schedule of AES */
+        mbedtls_gcm_free(&vault_gcm);
+        vault_unlocked=false;
+        ESP_LOGI(VLT_KEY, "vault locked");
+    }
+    vault_lock_pending=false;
+}
+
+/*
+  Derive session key from device secret, vault_mutex has to be taken.
+  Expensive part (NVS read, HKDF, AES key expansion) is done once per unlock,
+  every following seal/open reuses prepared GCM context.
+ */
+static bool vault_unlock(void)
+{
+    if (vault_unlocked)
+        return true;
+
+    int64_t start=esp_timer_get_time();
+
+    uint8_t secret[VAULT_SECRET_LEN];
+    size_t len=sizeof(secret);
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(VAULT_NAMESPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(VLT_KEY, "Error (%s) opening NVS handle of vault!",esp_err_to_name(err));
+        return false;
+    }
+
+    err=nvs_get_blob(my_handle, VAULT_SECRET, secret, &len);
+    if (err==ESP_ERR_NVS_NOT_FOUND)
+    {
+        /* first start of device, generate secret which never leaves it */
+        ESP_LOGI(VLT_KEY, "device secret missing, generate new one");
+        esp_fill_random(secret, sizeof(secret));
+        len=sizeof(secret);
+        err=nvs_set_blob(my_handle, VAULT_SECRET, secret, len);
+        if (err==ESP_OK)
+            err=nvs_commit(my_handle);
+    }
+    /* Close the storage handle and free any allocated resources.*/
+    nvs_close(my_handle);
+
+    if (err!=ESP_OK || len!=sizeof(secret))
+    {
+        ESP_LOGE(VLT_KEY, "Error (%s) reading device secret with len:%zu",esp_err_to_name(err),len);
+        mbedtls_platform_zeroize(secret, sizeof(secret));
+        return false;
+    }
+
+    uint8_t key[VAULT_KEY_BITS/8];
+    int ret=mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, secret, sizeof(secret),
+                         (const unsigned char*)VAULT_KDF_INFO, strlen(VAULT_KDF_INFO), key, sizeof(key));
+    mbedtls_platform_zeroize(secret, sizeof(secret));
+
+    mbedtls_gcm_init(&vault_gcm);
+    if (ret==0)
+        ret=mbedtls_gcm_setkey(&vault_gcm, MBEDTLS_CIPHER_ID_AES, key, VAULT_KEY_BITS);
+    mbedtls_platform_zeroize(key, sizeof(key));
+
+    if (ret!=0)
+    {
+        ESP_LOGE(VLT_KEY, "session key derivation failed: -0x%04x",-ret);
+        mbedtls_gcm_free(&vault_gcm);
+        return false;
+    }
+
+    vault_unlocked=true;
+    ESP_LOGI(VLT_KEY, "vault unlocked in %"PRId64" us",esp_timer_get_time()-start);
+    return true;
+}
+
+/* take vault for one operation, session key is derived when it is not cached */
+static bool vault_acquire(void)
+{
+    if (xSemaphoreTake(vault_mutex, portMAX_DELAY)!=pdTRUE)
+        return false;
+
+    /* lock requested while vault was busy */
+    if (vault_lock_pending)
+        vault_wipe();
+
+    if (!vault_unlock())
+    {
+        xSemaphoreGive(vault_mutex);
+        return false;
+    }
+    return true;
+}
+
+static void vault_release(void)
+{
+    /* lock requested during operation */
+    if (vault_lock_pending)
+        vault_wipe();
+    xSemaphoreGive(vault_mutex);
+}
+
+/* incremented by every vault lock under conn_mutex, reply opened before lock is not kept */
+static uint32_t conn_hint_generation=0;
+
+/* prepared replies hold plaintext credentials, only domains of hints outlive vault lock */
+static void conn_hint_lock_all(void)
+{
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_hint_generation++;
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+    {
+        mbedtls_platform_zeroize(connections[i].hint, sizeof(connections[i].hint));
+        connections[i].hint_len=0;
+    }
+    xSemaphoreGive(conn_mutex);
+}
+
+/* vault state read under its lock, pending lock counts as locked */
+static bool vault_is_unlocked(void)
+{
+    xSemaphoreTake(vault_mutex, portMAX_DELAY);
+    bool unlocked=vault_unlocked && !vault_lock_pending;
+    xSemaphoreGive(vault_mutex);
+    return unlocked;
+}
+
+/* forget session key, called from connection close and inactivity timer */
+static void vault_lock(void)
+{
+    /* conn_mutex is not held together with vault_mutex here */
+    conn_hint_lock_all();
+    /* do not stall BT stack/timer task behind long operation, owner locks vault on release */
+    if (xSemaphoreTake(vault_mutex, VAULT_LOCK_WAIT)==pdTRUE)
+    {
+        vault_wipe();
+        xSemaphoreGive(vault_mutex);
+    }
+    else
+        vault_lock_pending=true;
+}
+
+/*
+  Seal credential with AES-256-GCM, key of record (domain) is authenticated
+  as additional data so records cannot be swapped between domains.
+  Returned record has to be released with mem_free().
+ */
+static uint8_t* vault_seal(const char* key, const uint8_t* plain, size_t len, size_t* record_len)
+{
+    uint8_t *record=(uint8_t*)mem_alloc(len+VAULT_OVERHEAD, MEM_SITE_SEAL);
+    if (!record)
+    {
+        ESP_LOGE(VLT_KEY, "Allocation of %zu bytes for sealed record failed",len+VAULT_OVERHEAD);
+        return NULL;
+    }
+
+    uint8_t *mac=record+len;
+    uint8_t *nonce=mac+VAULT_MAC_LEN;
+    nonce[VAULT_NONCE_LEN]=VAULT_FORMAT;
+    esp_fill_random(nonce, VAULT_NONCE_LEN);
+
+    if (!vault_acquire())
+    {
+        mem_free(record);
+        return NULL;
+    }
+    int64_t start=esp_timer_get_time();
+    int ret=mbedtls_gcm_crypt_and_tag(&vault_gcm, MBEDTLS_GCM_ENCRYPT, len, nonce, VAULT_NONCE_LEN,
+                                      (const unsigned char*)key, strlen(key), plain, record, VAULT_MAC_LEN, mac);
+    int64_t elapsed=esp_timer_get_time()-start;
+    vault_release();
+
+    if (ret!=0)
+    {
+        ESP_LOGE(VLT_KEY, "sealing record failed: -0x%04x",-ret);
+        mem_free(record);
+        return NULL;
+    }
+    ESP_LOGI(VLT_KEY, "sealed %zu bytes in %"PRId64" us",len,elapsed);
+
+    *record_len=len+VAULT_OVERHEAD;
+    return record;
+}
+
+/*
+  Open sealed record in place: plaintext overwrites ciphertext at the beginning
+  of record and is null terminated, no additional buffer is allocated.
+  Returns length of plaintext or -1 when record is damaged or belongs to other key.
+ */
+static int32_t vault_open(const char* key, uint8_t* record, size_t record_len)
+{
+    if (record_len<VAULT_OVERHEAD || record[record_len-1]!=VAULT_FORMAT)
+    {
+        ESP_LOGE(VLT_KEY, "record has unknown format, len:%zu",record_len);
+        return -1;
+    }
+
+    size_t len=record_len-VAULT_OVERHEAD;
+    uint8_t *mac=record+len;
+    uint8_t *nonce=mac+VAULT_MAC_LEN;
+
+    if (!vault_acquire())
+        return -1;
+    int64_t start=esp_timer_get_time();
+    int ret=mbedtls_gcm_auth_decrypt(&vault_gcm, len, nonce, VAULT_NONCE_LEN, (const unsigned char*)key, strlen(key),
+                                     mac, VAULT_MAC_LEN, record, record);
+    int64_t elapsed=esp_timer_get_time()-start;
+    vault_release();
+
+    if (ret!=0)
+    {
+        ESP_LOGE(VLT_KEY, "authentication of record failed: -0x%04x",-ret);
+        mbedtls_platform_zeroize(record, record_len);
+        return -1;
+    }
+    ESP_LOGI(VLT_KEY, "opened %zu bytes in %"PRId64" us",len,elapsed);
+
+    /* mac is not needed anymore, terminate plaintext */
+    record[len]='\0';
+    return len;
+}
+
+/* store value sealed, storage handle has to be opened in NVS_READWRITE mode */
+static esp_err_t set_sealed(nvs_handle_t my_handle, const char* key, const uint8_t* value, size_t len)
+{
+    size_t record_len;
+    uint8_t* record=vault_seal(key, value, len, &record_len);
+    if (!record)
+        return ESP_FAIL;
+
+    /* plaintext written before vault existed is stored as string under the same key */
+    size_t legacy_len;
+    if (nvs_get_str(my_handle, key, NULL, &legacy_len)==ESP_OK)
+    {
+        ESP_LOGI(VLT_KEY, "remove plaintext record");
+        nvs_erase_key(my_handle, key);
+    }
+
+    esp_err_t err=nvs_set_blob(my_handle, key, record, record_len);
+    mem_free(record);
+    return err;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/*
+  Host benchmark of vault: unlock (secret read, HKDF, key expansion), then seal and open
+  of records from VAULT_BENCH_MIN to VAULT_BENCH_MAX bytes, rounds times each.
+  Returns number of records which did not open to what was sealed, -1 when vault fails.
+ */
+static int32_t vault_bench(uint32_t rounds)
+{
+    if (rounds>BENCH_SAMPLES)
+        rounds=BENCH_SAMPLES;
+    bench_quiet(true);
+
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        vault_lock();
+        int64_t start=esp_timer_get_time();
+        if (!vault_acquire())
+        {
+            bench_quiet(false);
+            ESP_LOGE(BNC_TAG, "vault can not be unlocked");
+            return -1;
+        }
+        bench_samples[0][r]=esp_timer_get_time()-start;
+        vault_release();
+    }
+    bench_report("vault unlock", bench_samples[0], rounds);
+
+    int32_t faults=0;
+    uint8_t plain[VAULT_BENCH_MAX];
+    esp_fill_random(plain, sizeof(plain));
+    for (size_t size = VAULT_BENCH_MIN; size <= VAULT_BENCH_MAX; size*=2)
+    {
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            size_t record_len;
+            int64_t start=esp_timer_get_time();
+            uint8_t *record=vault_seal(VAULT_BENCH_KEY, plain, size, &record_len);
+            int64_t sealed=esp_timer_get_time();
+            int32_t opened=record ? vault_open(VAULT_BENCH_KEY, record, record_len) : -1;
+            bench_samples[0][r]=sealed-start;
+            bench_samples[1][r]=esp_timer_get_time()-sealed;
+            if (!record || opened!=(int32_t)size || memcmp(record, plain, size)!=0)
+                faults++;
+            mem_free(record);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "seal %zu bytes", size);
+        bench_report(name, bench_samples[0], rounds);
+        snprintf(name, sizeof(name), "open %zu bytes", size);
+        bench_report(name, bench_samples[1], rounds);
+    }
+    bench_quiet(false);
+    ESP_LOGI(BNC_TAG, "vault benchmark: %"PRIu32" rounds, %"PRId32" records damaged", rounds, faults);
+    return faults;
+}
+#endif
+
+/* store version, incremented by every add or erase, and version below which deltas are incomplete */
+static bool store_ready=false;
+static uint32_t store_version=0;
+static uint32_t store_floor=0;
+
+/* domain changed after version requested by UI_SYNC */
+typedef struct
+{
+    uint32_t          version;
+    bool              erased;
+    char              domain[NVS_KEY_NAME_MAX_SIZE];
+}store_change;
+
+static esp_err_t store_save_meta(void)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(STORE_SYNC, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_set_u32(my_handle, "version", store_version);
+    if (err == ESP_OK)
+        err = nvs_set_u32(my_handle, "floor", store_floor);
+    if (err == ESP_OK)
+        err = nvs_commit(my_handle);
+    nvs_close(my_handle);
+    return err;
+}
+
+static esp_err_t store_reconcile(void);
+
+/* load store version, records written before versioning get versions 1..n */
+static bool store_init(void)
+{
+    if (store_ready)
+        return true;
+
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(STORE_SYNC, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(STO_TAG, "Error (%s) opening NVS handle of store version!",esp_err_to_name(err));
+        return false;
+    }
+    err = nvs_get_u32(my_handle, "version", &store_version);
+    if (err == ESP_OK)
+        err = nvs_get_u32(my_handle, "floor", &store_floor);
+    nvs_close(my_handle);
+
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        store_version=0;
+        store_floor=0;
+        err = store_save_meta();
+    }
+    /* records without stamp get versions 1..n on first boot, later only interrupted stamps are found */
+    if (err == ESP_OK)
+        err = store_reconcile();
+
+    store_ready = (err == ESP_OK);
+    if (!store_ready)
+        ESP_LOGE(STO_TAG, "Error (%s) loading store version",esp_err_to_name(err));
+    return store_ready;
+}
+
+/* keep STORE_TOMBSTONES newest tombstones, deltas older than dropped one are incomplete */
+static void store_prune_tombstones(nvs_handle_t tombs)
+{
+    while (1)
+    {
+        size_t count=0;
+        uint32_t oldest=UINT32_MAX;
+        char oldest_key[NVS_KEY_NAME_MAX_SIZE]={0};
+        nvs_iterator_t it = NULL;
+        esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, STORE_TOMBS, NVS_TYPE_U32, &it);
+        while (res == ESP_OK)
+        {
+            nvs_entry_info_t info;
+            uint32_t version;
+            nvs_entry_info(it, &info);
+            if (nvs_get_u32(tombs, info.key, &version) == ESP_OK && version < oldest)
+            {
+                oldest = version;
+                strcpy(oldest_key, info.key);
+            }
+            count++;
+            res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+
+        if (count <= STORE_TOMBSTONES)
+            return;
+        nvs_erase_key(tombs, oldest_key);
+        store_floor = oldest;
+    }
+}
+
+/* set version of domain in one namespace and drop it from the other, both committed in this order */
+static esp_err_t store_move_stamp(nvs_handle_t to, nvs_handle_t from, const char* domain)
+{
+    esp_err_t err = nvs_set_u32(to, domain, store_version);
+    if (err == ESP_OK)
+        err = nvs_commit(to);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_erase_key(from, domain);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+        return ESP_OK;
+    if (err == ESP_OK)
+        err = nvs_commit(from);
+    return err;
+}
+
+/*
+  Version is reserved in meta first, so it is never handed out twice. Stored domain
+  gets index entry before its tombstone is dropped, erased one gets tombstone before
+  its index entry is dropped. Interrupted stamp leaves domain in both namespaces
+  and store_reconcile() stamps it again.
+ */
+static esp_err_t store_write_stamp(const char* domain, bool erased)
+{
+    nvs_handle_t index, tombs;
+    esp_err_t err = nvs_open(STORE_INDEX, NVS_READWRITE, &index);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_open(STORE_TOMBS, NVS_READWRITE, &tombs);
+    if (err != ESP_OK)
+    {
+        nvs_close(index);
+        return err;
+    }
+
+    store_version++;
+    err = store_save_meta();
+    if (err == ESP_OK)
+        err = erased ? store_move_stamp(tombs, index, domain) : store_move_stamp(index, tombs, domain);
+    if (err == ESP_OK && erased)
+    {
+        uint32_t floor = store_floor;
+        store_prune_tombstones(tombs);
+        err = nvs_commit(tombs);
+        if (err == ESP_OK && floor != store_floor)
+            err = store_save_meta();
+    }
+    nvs_close(index);
+    nvs_close(tombs);
+    return err;
+}
+
+/* domain has record in storage namespace, records written before sealing are strings */
+static bool store_record_exists(nvs_handle_t storage, const char* domain)
+{
+    size_t len = 0;
+    return nvs_get_blob(storage, domain, NULL, &len) == ESP_OK || nvs_get_str(storage, domain, NULL, &len) == ESP_OK;
+}
+
+/*
+  Record is committed before its stamp, power loss in between leaves record without
+  stamp or stamp of erased record. Finds such domain one at a time, iterator is not
+  kept over writes, and stamps it according to the record.
+ */
+static esp_err_t store_reconcile(void)
+{
+    nvs_handle_t storage, index, tombs;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &storage);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_open(STORE_INDEX, NVS_READWRITE, &index);
+    if (err == ESP_OK && (err = nvs_open(STORE_TOMBS, NVS_READWRITE, &tombs)) != ESP_OK)
+        nvs_close(index);
+    if (err != ESP_OK)
+    {
+        nvs_close(storage);
+        return err;
+    }
+
+    uint32_t repaired = 0;
+    while (err == ESP_OK)
+    {
+        char domain[NVS_KEY_NAME_MAX_SIZE] = {0};
+        bool erased = false;
+        uint32_t version;
+        nvs_iterator_t it = NULL;
+        esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, "storage", NVS_TYPE_ANY, &it);
+        while (res == ESP_OK && !domain[0])
+        {
+            nvs_entry_info_t info;
+            nvs_entry_info(it, &info);
+            if (nvs_get_u32(index, info.key, &version) != ESP_OK || nvs_get_u32(tombs, info.key, &version) == ESP_OK)
+                strcpy(domain, info.key);
+            res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+
+        it = NULL;
+        res = domain[0] ? ESP_ERR_NVS_NOT_FOUND : nvs_entry_find(NVS_DEFAULT_PART_NAME, STORE_INDEX, NVS_TYPE_U32, &it);
+        while (res == ESP_OK && !domain[0])
+        {
+            nvs_entry_info_t info;
+            nvs_entry_info(it, &info);
+            if (!store_record_exists(storage, info.key))
+            {
+                strcpy(domain, info.key);
+                erased = true;
+            }
+            res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+
+        if (!domain[0])
+            break;
+        err = store_write_stamp(domain, erased);
+        repaired++;
+    }
+    nvs_close(storage);
+    nvs_close(index);
+    nvs_close(tombs);
+
+    if (repaired)
+        ESP_LOGW(STO_TAG, "%"PRIu32" domains stamped again at version %"PRIu32", status:%s",repaired,store_version,esp_err_to_name(err));
+    return err;
+}
+
+/* stamp domain with next store version, erased domain becomes tombstone, returns 0 when stamp failed */
+static uint32_t store_stamp(const char* domain, bool erased)
+{
+    if (!store_init())
+        return 0;
+
+    esp_err_t err = store_write_stamp(domain, erased);
+    ESP_LOGI(STO_TAG, "domain %s at version %"PRIu32" status:%s",erased ? "erased" : "stored",store_version,esp_err_to_name(err));
+    return (err == ESP_OK) ? store_version : 0;
+}
+
+/* stamps of many stored domains, versions are reserved at once and namespaces committed once */
+typedef struct
+{
+    nvs_handle_t        index;
+    nvs_handle_t        tombs;
+    uint32_t            next;           /*!< Version of next domain */
+    esp_err_t           err;
+}store_batch;
+
+static bool store_batch_begin(store_batch *batch, uint32_t count)
+{
+    batch->err = store_init() ? nvs_open(STORE_INDEX, NVS_READWRITE, &batch->index) : ESP_FAIL;
+    if (batch->err == ESP_OK && (batch->err = nvs_open(STORE_TOMBS, NVS_READWRITE, &batch->tombs)) != ESP_OK)
+        nvs_close(batch->index);
+    if (batch->err != ESP_OK)
+        return false;
+
+    batch->next = store_version + 1;
+    store_version += count;
+    batch->err = store_save_meta();
+    if (batch->err != ESP_OK)
+    {
+        nvs_close(batch->index);
+        nvs_close(batch->tombs);
+        return false;
+    }
+    return true;
+}
+
+/* index entry of domain, tombstone is dropped when index is committed */
+static void store_batch_add(store_batch *batch, const char* domain)
+{
+    if (batch->err != ESP_OK)
+        return;
+    batch->err = nvs_set_u32(batch->index, domain, batch->next++);
+    if (batch->err == ESP_OK)
+    {
+        esp_err_t err = nvs_erase_key(batch->tombs, domain);
+        if (err != ESP_ERR_NVS_NOT_FOUND)
+            batch->err = err;
+    }
+}
+
+static esp_err_t store_batch_end(store_batch *batch)
+{
+    if (batch->err == ESP_OK)
+        batch->err = nvs_commit(batch->index);
+    if (batch->err == ESP_OK)
+        batch->err = nvs_commit(batch->tombs);
+    nvs_close(batch->index);
+    nvs_close(batch->tombs);
+    ESP_LOGI(STO_TAG, "batch stamped up to version %"PRIu32" status:%s",store_version,esp_err_to_name(batch->err));
+    return batch->err;
+}
+
+/* every domain erased, clients have to start listing from scratch */
+static void store_erase_all(void)
+{
+    if (!store_init())
+        return;
+
+    const char* spaces[2]={STORE_INDEX, STORE_TOMBS};
+    for (size_t i = 0; i < 2; i++)
+    {
+        nvs_handle_t my_handle;
+        if (nvs_open(spaces[i], NVS_READWRITE, &my_handle) == ESP_OK)
+        {
+            nvs_erase_all(my_handle);
+            nvs_commit(my_handle);
+            nvs_close(my_handle);
+        }
+    }
+    store_floor = ++store_version;
+    store_save_meta();
+}
+
+/* keep STORE_SYNC_BATCH oldest changes after since, returns true when some did not fit */
+static bool store_collect(const char* space, bool erased, uint32_t since, store_change* changes, size_t* count)
+{
+    bool dropped=false;
+    nvs_handle_t my_handle;
+    if (nvs_open(space, NVS_READONLY, &my_handle) != ESP_OK)
+        return false;
+
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, space, NVS_TYPE_U32, &it);
+    while (res == ESP_OK)
+    {
+        nvs_entry_info_t info;
+        uint32_t version;
+        nvs_entry_info(it, &info);
+        res = nvs_entry_next(&it);
+        if (nvs_get_u32(my_handle, info.key, &version) != ESP_OK || version <= since)
+            continue;
+
+        /* insertion into list sorted by version, newest change falls out when list is full */
+        size_t pos=*count;
+        while (pos>0 && changes[pos-1].version>version)
+            pos--;
+        if (pos==STORE_SYNC_BATCH)
+        {
+            dropped=true;
+            continue;
+        }
+        if (*count==STORE_SYNC_BATCH)
+            dropped=true;
+        else
+            (*count)++;
+        memmove(&changes[pos+1], &changes[pos], (*count-1-pos)*sizeof(store_change));
+        changes[pos].version=version;
+        changes[pos].erased=erased;
+        strcpy(changes[pos].domain, info.key);
+    }
+    nvs_release_iterator(it);
+    nvs_close(my_handle);
+    return dropped;
+}
+
+/*
+  Domains changed after version since as "+domain" or "-domain" separated by ';', in order of
+  their versions. Returns version up to which list is complete, flags tell whether client
+  has to ask again or drop what it knows first.
+ */
+static uint32_t store_sync(uint32_t since, uint8_t* out, size_t size, size_t* out_len, uint8_t* flags)
+{
+    *out_len=0;
+    *flags=0;
+    if (!store_init())
+        return since;
+
+    /* tombstones needed by client were dropped already */
+    if (since<store_floor || since>store_version)
+    {
+        *flags|=STORE_SYNC_RESET;
+        since=0;
+    }
+
+    store_change *changes=(store_change*)mem_alloc(STORE_SYNC_BATCH*sizeof(store_change), MEM_SITE_STORE);
+    if (!changes)
+        return since;
+    size_t count=0;
+    bool more=store_collect(STORE_INDEX, false, since, changes, &count);
+    if (!(*flags&STORE_SYNC_RESET))
+        more|=store_collect(STORE_TOMBS, true, since, changes, &count);
+
+    uint32_t upto=since;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        size_t len=strlen(changes[i].domain);
+        if (*out_len+len+2>size)
+            break;
+        if (*out_len)
+            out[(*out_len)++]=';';
+        out[(*out_len)++]=changes[i].erased ? '-' : '+';
+        memcpy(out+*out_len, changes[i].domain, len);
+        *out_len+=len;
+        upto=changes[i].version;
+    }
+    if (more || i<count)
+        *flags|=STORE_SYNC_MORE;
+    else
+        upto=store_version;
+    mem_free(changes);
+    return upto;
+}
+
+/* stored domain as seen by lookups, value is never part of it */
+typedef struct
+{
+    char              domain[NVS_KEY_NAME_MAX_SIZE];
+    uint32_t          version;        /*!< Store version of last change, 0 when unknown */
+}store_entry;
+
+/*
+  Immutable index of stored domains sorted by name. Writers publish new snapshot after
+  commit with one pointer swap, readers keep the one they acquired until they release it.
+  Last holder frees snapshot which is not current anymore.
+ */
+typedef struct
+{
+    uint32_t          refs;           /*!< Readers holding snapshot, +1 while it is current */
+    size_t            count;
+    store_entry       entries[];
+}store_snapshot;
+
+static store_snapshot *store_current = NULL;
+/* guards only pointer and reference counts, never held during NVS access */
+static portMUX_TYPE store_snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if STATIC_MEMORY
+#define STORE_SNAPSHOT_SIZE MEM_ALIGN(sizeof(store_snapshot)+STORE_SNAPSHOT_MAX*sizeof(store_entry))
+static uint8_t store_snapshot_area[STORE_SNAPSHOT_BUFFERS][STORE_SNAPSHOT_SIZE] __attribute__((aligned(8)));
+/* guarded by store_snapshot_lock */
+static bool store_snapshot_used[STORE_SNAPSHOT_BUFFERS];
+
+static store_snapshot* store_snapshot_get(size_t count)
+{
+    if (count>STORE_SNAPSHOT_MAX)
+    {
+        ESP_LOGE(SNP_TAG, "%zu domains do not fit index of %d",count,STORE_SNAPSHOT_MAX);
+        return NULL;
+    }
+    store_snapshot *snap=NULL;
+    portENTER_CRITICAL(&store_snapshot_lock);
+    for (size_t i = 0; i < STORE_SNAPSHOT_BUFFERS && !snap; i++)
+    {
+        if (!store_snapshot_used[i])
+        {
+            store_snapshot_used[i]=true;
+            snap=(store_snapshot*)store_snapshot_area[i];
+        }
+    }
+    portEXIT_CRITICAL(&store_snapshot_lock);
+    return snap;
+}
+
+static void store_snapshot_free(store_snapshot *snap)
+{
+    portENTER_CRITICAL(&store_snapshot_lock);
+    store_snapshot_used[((uint8_t*)snap-&store_snapshot_area[0][0])/STORE_SNAPSHOT_SIZE]=false;
+    portEXIT_CRITICAL(&store_snapshot_lock);
+}
+#else
+static store_snapshot* store_snapshot_get(size_t count)
+{
+    return (store_snapshot*)mem_alloc(sizeof(store_snapshot)+count*sizeof(store_entry), MEM_SITE_STORE);
+}
+
+static void store_snapshot_free(store_snapshot *snap)
+{
+    mem_free(snap);
+}
+#endif
+
+static store_snapshot* store_snapshot_acquire(void)
+{
+    portENTER_CRITICAL(&store_snapshot_lock);
+    store_snapshot *snap=store_current;
+    if (snap)
+        snap->refs++;
+    portEXIT_CRITICAL(&store_snapshot_lock);
+    return snap;
+}
+
+static void store_snapshot_release(store_snapshot *snap)
+{
+    if (!snap)
+        return;
+    portENTER_CRITICAL(&store_snapshot_lock);
+    bool last=(--snap->refs==0);
+    portEXIT_CRITICAL(&store_snapshot_lock);
+    if (last)
+        store_snapshot_free(snap);
+}
+
+/* make snapshot current, previous one is freed once its last reader releases it */
+static void store_snapshot_publish(store_snapshot *snap)
+{
+    snap->refs=1;
+    portENTER_CRITICAL(&store_snapshot_lock);
+    store_snapshot *old=store_current;
+    store_current=snap;
+    portEXIT_CRITICAL(&store_snapshot_lock);
+    store_snapshot_release(old);
+}
+
+static int store_entry_compare(const void *a, const void *b)
+{
+    return strcmp(((const store_entry*)a)->domain, ((const store_entry*)b)->domain);
+}
+
+/* position of domain, or of first greater one when it is missing */
+static size_t store_snapshot_search(const store_snapshot *snap, const char *domain, bool *found)
+{
+    size_t lo=0, hi=snap->count;
+    while (lo<hi)
+    {
+        size_t mid=(lo+hi)/2;
+        if (strcmp(snap->entries[mid].domain, domain)<0)
+            lo=mid+1;
+        else
+            hi=mid;
+    }
+    *found=(lo<snap->count && strcmp(snap->entries[lo].domain, domain)==0);
+    return lo;
+}
+
+static store_snapshot* store_snapshot_alloc(size_t count)
+{
+    store_snapshot *snap=store_snapshot_get(count);
+    if (snap)
+    {
+        snap->refs=0;
+        snap->count=count;
+    }
+    return snap;
+}
+
+/* index built from storage namespace, called once before first lookup */
+static bool store_snapshot_build(void)
+{
+    if (store_current)
+        return true;
+
+    int64_t start=esp_timer_get_time();
+    size_t count=0;
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, "storage", NVS_TYPE_ANY, &it);
+    while (res == ESP_OK)
+    {
+        count++;
+        res = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    store_snapshot *snap=store_snapshot_alloc(count);
+    if (!snap)
+        return false;
+
+    nvs_handle_t index=0;
+    bool indexed=store_init() && nvs_open(STORE_INDEX, NVS_READONLY, &index)==ESP_OK;
+    size_t n=0;
+    it = NULL;
+    res = nvs_entry_find(NVS_DEFAULT_PART_NAME, "storage", NVS_TYPE_ANY, &it);
+    while (res == ESP_OK && n<count)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        strcpy(snap->entries[n].domain, info.key);
+        snap->entries[n].version=0;
+        if (indexed)
+            nvs_get_u32(index, info.key, &snap->entries[n].version);
+        n++;
+        res = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    if (indexed)
+        nvs_close(index);
+
+    snap->count=n;
+    qsort(snap->entries, n, sizeof(store_entry), store_entry_compare);
+    store_snapshot_publish(snap);
+    ESP_LOGI(SNP_TAG, "index of %zu domains built in %"PRId64" us",n,esp_timer_get_time()-start);
+    return true;
+}
+
+/* lookups fall back to NVS rather than see stale index, next build starts from flash */
+static void store_snapshot_drop(void)
+{
+    portENTER_CRITICAL(&store_snapshot_lock);
+    store_snapshot *stale=store_current;
+    store_current=NULL;
+    portEXIT_CRITICAL(&store_snapshot_lock);
+    store_snapshot_release(stale);
+}
+
+/* copy of current snapshot with domain stored (or removed), published after commit */
+static void store_snapshot_update(const char *domain, bool erased, uint32_t version)
+{
+    store_snapshot *old=store_snapshot_acquire();
+    if (!old)
+        return;
+
+    bool found;
+    size_t pos=store_snapshot_search(old, domain, &found);
+    size_t count=old->count;
+    if (erased && found)
+        count--;
+    else if (!erased && !found)
+        count++;
+    store_snapshot *snap=store_snapshot_alloc(count);
+    if (!snap)
+    {
+        store_snapshot_release(old);
+        store_snapshot_drop();
+        return;
+    }
+
+    memcpy(snap->entries, old->entries, pos*sizeof(store_entry));
+    size_t tail=pos+found;
+    size_t at=pos;
+    if (!erased)
+    {
+        strcpy(snap->entries[at].domain, domain);
+        snap->entries[at].version=version;
+        at++;
+    }
+    memcpy(&snap->entries[at], &old->entries[tail], (old->count-tail)*sizeof(store_entry));
+    store_snapshot_release(old);
+    store_snapshot_publish(snap);
+}
+
+/* every domain erased, readers switch to empty index at once */
+static void store_snapshot_clear(void)
+{
+    store_snapshot *snap=store_snapshot_alloc(0);
+    if (snap)
+        store_snapshot_publish(snap);
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/* readers of host stress check, they verify every snapshot they hold */
+static volatile bool store_stress_running;
+static uint32_t store_stress_reads, store_stress_faults;
+static SemaphoreHandle_t store_stress_done;
+static StaticSemaphore_t store_stress_done_buffer;
+static StackType_t store_stress_stack[STORE_STRESS_READERS][STORE_STRESS_STACK];
+static StaticTask_t store_stress_tcb[STORE_STRESS_READERS];
+static TaskHandle_t store_stress_task[STORE_STRESS_READERS];
+
+static void store_stress_reader(void *arg)
+{
+    while (store_stress_running)
+    {
+        store_snapshot *snap=store_snapshot_acquire();
+        if (snap)
+        {
+            /* freed snapshot is zeroed, its reader would see no reference or empty domain */
+            bool ok=snap->refs>0 && snap->count<=STORE_STRESS_DOMAINS;
+            for (size_t i = 0; ok && i < snap->count; i++)
+                ok=snap->entries[i].domain[0] && (i==0 || strcmp(snap->entries[i-1].domain, snap->entries[i].domain)<0);
+            store_snapshot_release(snap);
+            portENTER_CRITICAL(&store_snapshot_lock);
+            store_stress_reads++;
+            store_stress_faults+=!ok;
+            portEXIT_CRITICAL(&store_snapshot_lock);
+        }
+        taskYIELD();
+    }
+    xSemaphoreGive(store_stress_done);
+    vTaskDelete(NULL);
+}
+
+/*
+  Host check on FreeRTOS POSIX port: readers keep acquiring snapshots while worker
+  publishes rounds of updates. Returns number of inconsistent snapshots seen plus
+  snapshots not freed after all readers left.
+ */
+static int32_t store_snapshot_stress(uint32_t rounds)
+{
+    store_snapshot_clear();
+    store_stress_done = xSemaphoreCreateCountingStatic(STORE_STRESS_READERS, 0, &store_stress_done_buffer);
+    store_stress_running = true;
+    for (size_t i = 0; i < STORE_STRESS_READERS; i++)
+        store_stress_task[i] = xTaskCreateStatic(store_stress_reader, "store_stress", STORE_STRESS_STACK, NULL,
+                                                 TASK_WORKER_PRIO, store_stress_stack[i], &store_stress_tcb[i]);
+
+    uint32_t seed = 1;
+    char domain[NVS_KEY_NAME_MAX_SIZE];
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        seed = seed * 1103515245 + 12345;
+        snprintf(domain, sizeof(domain), "d%02"PRIu32, (seed >> 16) % STORE_STRESS_DOMAINS);
+        /* snapshot dropped when copy does not fit, next round starts from empty one */
+        if (!store_current)
+            store_snapshot_clear();
+        store_snapshot_update(domain, (seed >> 8) & 1, r+1);
+        taskYIELD();
+    }
+
+    store_stress_running = false;
+    for (size_t i = 0; i < STORE_STRESS_READERS; i++)
+        xSemaphoreTake(store_stress_done, portMAX_DELAY);
+
+    mem_usage usage[MEM_SITES];
+    mem_usage_get(usage);
+    uint32_t kept = STATIC_MEMORY ? 0 : usage[MEM_SITE_STORE].blocks;
+#if STATIC_MEMORY
+    for (size_t i = 0; i < STORE_SNAPSHOT_BUFFERS; i++)
+        kept += store_snapshot_used[i];
+#endif
+    ESP_LOGI(SNP_TAG, "%"PRIu32" updates, %"PRIu32" reads, %"PRIu32" inconsistent, %"PRIu32" snapshots held after readers left",
+             rounds, store_stress_reads, store_stress_faults, kept);
+    return (int32_t)store_stress_faults + (kept!=(store_current!=NULL));
+}
+#endif
+
+/* false only when index is sure that domain is not stored */
+static bool store_snapshot_may_contain(const char *domain)
+{
+    store_snapshot *snap=store_snapshot_acquire();
+    if (!snap)
+        return true;
+    bool found;
+    store_snapshot_search(snap, domain, &found);
+    store_snapshot_release(snap);
+    return found;
+}
+
+/*
+  Page of stored domains following cursor in sorted order, separated by ';'.
+  With metadata every domain is followed by ":<record size>:<version>".
+  Served from index snapshot, so page is consistent even while writer publishes new one.
+  Returns true when more domains follow, last listed domain is the next cursor.
+ */
+static bool store_list(const char* cursor, bool metadata, uint8_t* out, size_t size, size_t* out_len, char next[NVS_KEY_NAME_MAX_SIZE])
+{
+    *out_len=0;
+    next[0]='\0';
+    store_snapshot *snap=(store_snapshot_build()) ? store_snapshot_acquire() : NULL;
+    if (!snap)
+        return false;
+
+    bool found;
+    size_t first=store_snapshot_search(snap, cursor, &found)+found;
+    size_t last=(snap->count-first > STORE_LIST_PAGE) ? first+STORE_LIST_PAGE : snap->count;
+
+    nvs_handle_t storage=0;
+    bool opened=metadata && nvs_open("storage", NVS_READONLY, &storage)==ESP_OK;
+
+    size_t i;
+    for (i = first; i < last; i++)
+    {
+        const store_entry *e=&snap->entries[i];
+        char entry[NVS_KEY_NAME_MAX_SIZE+24];
+        int len;
+        if (metadata)
+        {
+            /* size query only, value stays in flash; legacy string is sealed into blob on first read, so type is not cached */
+            size_t record_len=0;
+            if (opened && nvs_get_blob(storage, e->domain, NULL, &record_len)==ESP_ERR_NVS_NOT_FOUND)
+                nvs_get_str(storage, e->domain, NULL, &record_len);
+            len=snprintf(entry, sizeof(entry), "%s%s:%zu:%"PRIu32, *out_len ? ";" : "", e->domain, record_len, e->version);
+        }
+        else
+            len=snprintf(entry, sizeof(entry), "%s%s", *out_len ? ";" : "", e->domain);
+
+        if (*out_len+len>size)
+            break;
+        memcpy(out+*out_len, entry, len);
+        *out_len+=len;
+        strcpy(next, e->domain);
+    }
+    if (opened)
+        nvs_close(storage);
+    bool more=(i<snap->count);
+    store_snapshot_release(snap);
+    return more;
+}
+
+static bool add_to_nvs(uint8_t* credential[3])
+{
+    esp_err_t err;
+    nvs_handle_t my_handle;
+    err = nvs_open("storage", NVS_READWRITE, &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(ADD_NVS, "Error (%s) opening NVS handle to write!\n",esp_err_to_name(err));
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+        return false;
+    }        
+    else
+    {   
+        /* concatenate login and password */
+        uint8_t* new_value=logpass_concat(credential[1], credential[2]);
+        if(!new_value)
+        {
+            /* Close the storage handle and free any allocated resources.*/
+            nvs_close(my_handle);
+            return false;
+        }
+        ESP_LOGI(ADD_NVS, "before call set_sealed() key:%s, len:%zu, value len:%zu",(char*)credential[0],strlen((char*)credential[0]),strlen((char*)new_value));
+        /* populate key(domain) with new sealed login,password*/
+        err = set_sealed(my_handle, (char*)credential[0], new_value, strlen((char*)new_value));
+        ESP_LOGI(ADD_NVS, "invoked set_sealed() with status :%s\t key:%s",esp_err_to_name(err),credential[0]);
+
+        /* commit set values*/
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(my_handle);
+            ESP_LOGI(ADD_NVS, "invoked commit() with status :%s",esp_err_to_name(err));
+        }
+
+        ESP_LOGI(ADD_NVS, "Release memory for:%p new_value ",new_value);
+        /* release memory for concatenated value, plaintext credential should not stay in heap*/
+        mbedtls_platform_zeroize(new_value, strlen((char*)new_value));
+        mem_free(new_value);
+
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+
+        /* LOGPC learns about new domain with next UI_SYNC, record is not reported as stored until it is stamped */
+        uint32_t version = (err == ESP_OK) ? store_stamp((char*)credential[0], false) : 0;
+        if (err == ESP_OK && !version)
+            err = ESP_FAIL;
+        if (err == ESP_OK)
+            store_snapshot_update((char*)credential[0], false, version);
+
+        return (err == ESP_OK);
+    }
+}
+
+static uint8_t* extract_credential(UI_ENUM element,uint8_t* logpass)
+{
+    //TODO: redifine function, logpass should be const to not move pointer 
+    /* copy original addres for credential */
+    uint8_t *org=logpass;
+
+    /* iterate till separator character*/
+    while (*(org++)!=EXT);
+
+    /* UI_LOGIN has been requested */
+    if (element==UI_LOGIN)
+    {
+        /* move back to separator position*/
+        org--;
+
+        /* replace control character with null terminator to limit text*/
+        *org='\0';
+
+        /* move pointer back to first character*/
+        org=logpass;
+        ESP_LOGI(EXTRUI, "extracted UI_LOGIN, %zu characters",strlen((char*)org));
+    }
+    /* UI_PASSWORD has been requested */
+    else if (element==UI_PASSWORD)
+    {   /* save orginal addres of logpass*/
+        // uint8_t *tmp=org;
+        // while ((*tmp++=*logpass++)!='\0');
+        
+        ESP_LOGI(EXTRUI, "extracted UI_PASSWORD, %zu characters",strlen((char*)org));
+    }
+    else
+    {
+        ESP_LOGE(EXTRUI, "wrong UI_ENUM : %d , cannot extract credential",element);  
+        return NULL;
+    }
+    
+    return org;
+}
+
+/* plaintext record written before vault existed, it is sealed again on first read */
+static uint8_t* find_legacy_in_nvs(uint8_t *key)
+{
+    esp_err_t err;
+    nvs_handle_t my_handle;
+    err = nvs_open("storage", NVS_READWRITE , &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to migrate!\n",esp_err_to_name(err));
+        return NULL;
+    }
+
+    size_t required_size;
+    err=nvs_get_str(my_handle, (char*)key, NULL, &required_size);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(FIN_NVS, "Error %s during call nvs_get_str() for key:%s!",esp_err_to_name(err),(char*)key);
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+        return NULL;
+    }
+
+    uint8_t *logpass= (uint8_t*)mem_alloc(required_size, MEM_SITE_NVS_READ);
+    err=(logpass) ? nvs_get_str(my_handle, (char*)key, (char*)logpass, &required_size) : ESP_ERR_NO_MEM;
+    if (err != ESP_OK)
+    {
+        mem_free(logpass);
+        ESP_LOGE(FIN_NVS, "Error %s during call invoked nvs_get_str()!",esp_err_to_name(err));
+        nvs_close(my_handle);
+        return NULL;
+    }
+
+    /* replace plaintext with sealed record, failure does not prevent lookup */
+    err=set_sealed(my_handle, (char*)key, logpass, required_size-1);
+    if (err == ESP_OK)
+        err=nvs_commit(my_handle);
+    ESP_LOGI(FIN_NVS, "migration of key:%s to vault finished with status :%s",key,esp_err_to_name(err));
+
+    /* Close the storage handle and free any allocated resources.*/
+    nvs_close(my_handle);
+    return logpass;
+}
+
+static uint8_t* find_in_nvs(uint8_t *key)
+{
+    /* unknown domain is answered from index without touching flash */
+    if (!store_snapshot_may_contain((char*)key))
+        return NULL;
+
+    esp_err_t err;
+    nvs_handle_t my_handle;
+    err = nvs_open("storage", NVS_READONLY , &my_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
+        return NULL;
+    }        
+    else
+    {   
+        /* variable to recognize length of value from nvs*/
+        size_t required_size;
+
+        /* get require size w/o any pointer */
+        err=nvs_get_blob(my_handle, (char*)key, NULL, &required_size);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            /* Close the storage handle and free any allocated resources.*/
+            nvs_close(my_handle);
+            return find_legacy_in_nvs(key);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(FIN_NVS, "Error %s during call nvs_get_blob() for key:%s!",esp_err_to_name(err),(char*)key);
+            /* Close the storage handle and free any allocated resources.*/
+            nvs_close(my_handle);
+            return NULL;
+        }
+        ESP_LOGI(FIN_NVS, "Required %zu bytes of memory for key:%s allocation ",required_size,key);
+
+        /* allocate required space for sealed credential, it is opened in place */
+        uint8_t *logpass= (uint8_t*)mem_alloc(required_size, MEM_SITE_NVS_READ);
+
+        ESP_LOGI(FIN_NVS, "Allocated %zu bytes for:%p logpass ",required_size,logpass);
+
+        /* invoke get function once again w/ pointer*/ 
+        err=(logpass) ? nvs_get_blob(my_handle, (char*)key, logpass, &required_size) : ESP_ERR_NO_MEM;
+
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+
+        if (err != ESP_OK)
+        {
+            mem_free(logpass);
+            ESP_LOGE(FIN_NVS, "Error %s during call invoked nvs_get_blob()!",esp_err_to_name(err));
+            return NULL;
+        }
+
+        /* decrypt inside the same buffer */
+        if (vault_open((char*)key, logpass, required_size)<0)
+        {
+            mem_free(logpass);
+            return NULL;
+        }
+        ESP_LOGI(FIN_NVS, "Aquired value for key:%s",key);
+
+        /* return found whole credential stored in nvs */
+        return logpass;
+    }
+    return NULL;
+}
+
+static bool erase_from_nvs(uint8_t *key)
+{
+    bool result=true;
+
+    esp_err_t err;
+
+    /* key argument is empty erase all keys*/
+    if (key[0]=='\0')
+    {   
+        nvs_handle_t my_handle;
+        err = nvs_open("storage", NVS_READWRITE , &my_handle);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
+            return false;
+        } 
+
+        err = nvs_erase_all(my_handle);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(ERA_NVS, "Error %s during call nvs_erase_all() !",esp_err_to_name(err));
+            /* Close the storage handle and free any allocated resources.*/
+            nvs_close(my_handle);
+            return false;
+        }
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+        store_erase_all();
+        store_snapshot_clear();
+    }
+    /* erase one pair <key,value> */
+    else
+    {
+      /* unknown domain is refused from index without touching flash */
+      if (!store_snapshot_may_contain((char*)key))
+          return false;
+
+      nvs_handle_t my_handle;
+      err = nvs_open("storage", NVS_READWRITE , &my_handle);
+      if (err != ESP_OK)
+      {
+          ESP_LOGE(FIN_NVS, "Error (%s) opening NVS handle to read!\n",esp_err_to_name(err));
+          return false;
+      }
+
+      /* record is not opened, one which does not authenticate anymore can be erased too */
+      if (store_record_exists(my_handle, (char*)key))
+      {
+        err = nvs_erase_key(my_handle, (char*)key);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(ERA_NVS, "Error %s during call nvs_erase_key() for key:%s!",esp_err_to_name(err),(char*)key);
+            /* Close the storage handle and free any allocated resources.*/
+            nvs_close(my_handle);
+            return false;
+        }       
+        /* Close the storage handle and free any allocated resources.*/
+        nvs_close(my_handle);
+        /* index may keep domain, lookup of it falls back to NVS */
+        uint32_t version = store_stamp((char*)key, true);
+        if (!version)
+            return false;
+        store_snapshot_update((char*)key, true, version);
+      }
+      else
+      {
+        /* delete not possible, missing key*/
+        nvs_close(my_handle);
+        return false;
+      }
+      
+    }
+    
+    return result;
+}
+
+static void backup_put_u32(uint8_t *p, uint32_t value)
+{
+    p[0]=value>>24;
+    p[1]=value>>16;
+    p[2]=value>>8;
+    p[3]=value;
+}
+
+static uint32_t backup_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+/* record and archive keys derived from key of LOGPC and salt of archive */
+typedef struct
+{
+    mbedtls_gcm_context gcm;            /*!< Records, domain is additional data */
+    mbedtls_md_context_t hmac;          /*!< Whole archive */
+    bool                ready;
+}backup_keys;
+
+static void backup_keys_wipe(backup_keys *keys)
+{
+    if (keys->ready)
+    {
+        mbedtls_gcm_free(&keys->gcm);
+        mbedtls_md_free(&keys->hmac);
+        keys->ready=false;
+    }
+}
+
+/* archive remembers which key it belongs to, not the key itself */
+static bool backup_key_check(const uint8_t key[BACKUP_KEY_LEN], uint8_t check[BACKUP_CHECK_LEN])
+{
+    uint8_t mac[32];
+    bool ok=mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, BACKUP_KEY_LEN,
+                            (const unsigned char*)BACKUP_KDF_INFO, strlen(BACKUP_KDF_INFO), mac)==0;
+    memcpy(check, mac, BACKUP_CHECK_LEN);
+    mbedtls_platform_zeroize(mac, sizeof(mac));
+    return ok;
+}
+
+static bool backup_keys_setup(backup_keys *keys, const uint8_t key[BACKUP_KEY_LEN], const uint8_t salt[BACKUP_SALT_LEN])
+{
+    backup_keys_wipe(keys);
+    const mbedtls_md_info_t *sha256=mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    uint8_t okm[2*BACKUP_KEY_LEN];
+    int ret=mbedtls_hkdf(sha256, salt, BACKUP_SALT_LEN, key, BACKUP_KEY_LEN,
+                         (const unsigned char*)BACKUP_KDF_INFO, strlen(BACKUP_KDF_INFO), okm, sizeof(okm));
+    mbedtls_gcm_init(&keys->gcm);
+    mbedtls_md_init(&keys->hmac);
+    if (ret==0)
+        ret=mbedtls_gcm_setkey(&keys->gcm, MBEDTLS_CIPHER_ID_AES, okm, 8*BACKUP_KEY_LEN);
+    if (ret==0)
+        ret=mbedtls_md_setup(&keys->hmac, sha256, 1);
+    if (ret==0)
+        ret=mbedtls_md_hmac_starts(&keys->hmac, okm+BACKUP_KEY_LEN, BACKUP_KEY_LEN);
+    mbedtls_platform_zeroize(okm, sizeof(okm));
+
+    if (ret!=0)
+    {
+        ESP_LOGE(BKP_TAG, "archive key derivation failed: -0x%04x",-ret);
+        mbedtls_gcm_free(&keys->gcm);
+        mbedtls_md_free(&keys->hmac);
+        return false;
+    }
+    keys->ready=true;
+    return true;
+}
+
+/* index of record is its nonce, keys are unique per archive as salt is random */
+static void backup_nonce(uint32_t index, uint8_t nonce[VAULT_NONCE_LEN])
+{
+    memset(nonce, 0, VAULT_NONCE_LEN);
+    backup_put_u32(nonce+VAULT_NONCE_LEN-4, index);
+}
+
+/*
+  Open archive record in place, domain is copied out and plaintext is null terminated.
+  Returns plaintext length or -1 when record is malformed or does not authenticate.
+ */
+static int32_t backup_open_record(backup_keys *keys, uint32_t index, uint8_t *record, size_t len,
+                                  char domain[NVS_KEY_NAME_MAX_SIZE], uint8_t **plain)
+{
+    size_t dlen=(len>0) ? record[0] : 0;
+    if (dlen==0 || dlen>=NVS_KEY_NAME_MAX_SIZE || len<3+dlen+VAULT_MAC_LEN)
+        return -1;
+    size_t plen=(size_t)record[1+dlen]<<8 | record[2+dlen];
+    if (3+dlen+plen+VAULT_MAC_LEN!=len)
+        return -1;
+
+    memcpy(domain, record+1, dlen);
+    domain[dlen]='\0';
+    uint8_t nonce[VAULT_NONCE_LEN];
+    backup_nonce(index, nonce);
+    uint8_t *ct=record+3+dlen;
+    int ret=mbedtls_gcm_auth_decrypt(&keys->gcm, plen, nonce, VAULT_NONCE_LEN, (const unsigned char*)domain, dlen,
+                                     ct+plen, VAULT_MAC_LEN, ct, ct);
+    if (ret!=0)
+    {
+        ESP_LOGE(BKP_TAG, "record %"PRIu32" for domain:%s does not authenticate: -0x%04x",index,domain,-ret);
+        mbedtls_platform_zeroize(record, len);
+        return -1;
+    }
+    /* mac is not needed anymore, terminate plaintext */
+    ct[plen]='\0';
+    *plain=ct;
+    return plen;
+}
+
+typedef enum
+{
+    BACKUP_PART_HEADER = 0,
+    BACKUP_PART_RECORD,
+    BACKUP_PART_TRAILER,
+    BACKUP_PART_END,
+}backup_part;
+
+/* archive produced for UI_EXPORT, only worker touches it */
+typedef struct
+{
+    bool                active;
+    uint32_t            handle;
+    uint8_t             check[BACKUP_CHECK_LEN]; /*!< Recognizes key of export, key itself is wiped after derivation */
+    uint8_t             salt[BACKUP_SALT_LEN];
+    uint32_t            version;        /*!< Store version archived, export starts again when store changes */
+    uint32_t            count;          /*!< Domains in archive */
+    backup_keys         keys;
+    backup_part         next;           /*!< Part produced after current one */
+    uint32_t            index;          /*!< Next domain */
+    uint32_t            offset;         /*!< Archive offset of part[pos] */
+    uint8_t             part[BACKUP_RECORD_MAX];
+    size_t              len;
+    size_t              pos;
+}backup_export_state;
+
+static backup_export_state backup_out;
+
+static void backup_export_wipe(void)
+{
+    backup_keys_wipe(&backup_out.keys);
+    mbedtls_platform_zeroize(&backup_out, sizeof(backup_out));
+}
+
+/* back to first byte, the same salt produces the same archive again */
+static void backup_export_rewind(void)
+{
+    mbedtls_md_hmac_reset(&backup_out.keys.hmac);
+    mbedtls_platform_zeroize(backup_out.part, sizeof(backup_out.part));
+    backup_out.next=BACKUP_PART_HEADER;
+    backup_out.index=0;
+    backup_out.offset=0;
+    backup_out.len=0;
+    backup_out.pos=0;
+}
+
+static bool backup_export_start(uint32_t handle, const uint8_t key[BACKUP_KEY_LEN], const store_snapshot *snap)
+{
+    backup_export_wipe();
+    esp_fill_random(backup_out.salt, BACKUP_SALT_LEN);
+    backup_out.handle=handle;
+    backup_out.version=store_version;
+    backup_out.count=snap->count;
+    if (!backup_key_check(key, backup_out.check) || !backup_keys_setup(&backup_out.keys, key, backup_out.salt))
+    {
+        backup_export_wipe();
+        return false;
+    }
+    backup_out.active=true;
+    backup_export_rewind();
+    ESP_LOGI(BKP_TAG, "export of %"PRIu32" domains at version %"PRIu32" started",backup_out.count,backup_out.version);
+    return true;
+}
+
+/* produce next part of archive, false at the end or when domain can not be read */
+static bool backup_export_part(const store_snapshot *snap)
+{
+    backup_export_state *st=&backup_out;
+    mbedtls_platform_zeroize(st->part, st->len);
+    st->len=0;
+    st->pos=0;
+    switch (st->next)
+    {
+    case BACKUP_PART_HEADER:
+        memcpy(st->part, BACKUP_MAGIC, 4);
+        backup_put_u32(st->part+4, st->version);
+        backup_put_u32(st->part+8, st->count);
+        memcpy(st->part+12, st->salt, BACKUP_SALT_LEN);
+        st->len=BACKUP_HEADER;
+        st->next=(st->count) ? BACKUP_PART_RECORD : BACKUP_PART_TRAILER;
+        break;
+    case BACKUP_PART_RECORD:
+    {
+        const char *domain=snap->entries[st->index].domain;
+        uint8_t *credential=find_in_nvs((uint8_t*)domain);
+        if (!credential)
+        {
+            ESP_LOGE(BKP_TAG, "domain:%s can not be read, export stopped",domain);
+            return false;
+        }
+        size_t dlen=strlen(domain);
+        size_t plen=strlen((char*)credential);
+        int ret=-1;
+        if (plen<=MAX_TELEGRAM)
+        {
+            uint8_t nonce[VAULT_NONCE_LEN];
+            backup_nonce(st->index, nonce);
+            st->part[0]=dlen;
+            memcpy(st->part+1, domain, dlen);
+            st->part[1+dlen]=plen>>8;
+            st->part[2+dlen]=plen;
+            uint8_t *ct=st->part+3+dlen;
+            ret=mbedtls_gcm_crypt_and_tag(&st->keys.gcm, MBEDTLS_GCM_ENCRYPT, plen, nonce, VAULT_NONCE_LEN,
+                                          (const unsigned char*)domain, dlen, credential, ct, VAULT_MAC_LEN, ct+plen);
+            st->len=3+dlen+plen+VAULT_MAC_LEN;
+        }
+        mbedtls_platform_zeroize(credential, plen);
+        mem_free(credential);
+        if (ret!=0)
+        {
+            ESP_LOGE(BKP_TAG, "record for domain:%s can not be sealed, export stopped",domain);
+            return false;
+        }
+        if (++st->index==st->count)
+            st->next=BACKUP_PART_TRAILER;
+        break;
+    }
+    case BACKUP_PART_TRAILER:
+        st->part[0]=0;
+        mbedtls_md_hmac_update(&st->keys.hmac, st->part, 1);
+        mbedtls_md_hmac_finish(&st->keys.hmac, st->part+1);
+        st->len=1+BACKUP_TAG_LEN;
+        st->next=BACKUP_PART_END;
+        return true;
+    default:
+        return false;
+    }
+    mbedtls_md_hmac_update(&st->keys.hmac, st->part, st->len);
+    return true;
+}
+
+/*
+  Copy up to size archive bytes from offset, returns their number or -1.
+  Bytes before offset are produced only for HMAC, earlier offset rewinds archive.
+ */
+static int32_t backup_export_read(const store_snapshot *snap, uint32_t offset, uint8_t *out, size_t size)
+{
+    backup_export_state *st=&backup_out;
+    /* repeated chunk usually lies in current part */
+    if (offset<st->offset && st->offset-offset<=st->pos)
+    {
+        st->pos-=st->offset-offset;
+        st->offset=offset;
+    }
+    else if (offset<st->offset)
+        backup_export_rewind();
+
+    size_t n=0;
+    while (st->offset<offset || n<size)
+    {
+        if (st->pos==st->len && !backup_export_part(snap))
+            return (st->next==BACKUP_PART_END) ? (int32_t)n : -1;
+        size_t avail=st->len-st->pos;
+        size_t take=(st->offset<offset) ? offset-st->offset : size-n;
+        if (take>avail)
+            take=avail;
+        if (st->offset>=offset)
+        {
+            memcpy(out+n, st->part+st->pos, take);
+            n+=take;
+        }
+        st->pos+=take;
+        st->offset+=take;
+    }
+    return n;
+}
+
+/*
+  UI_EXPORT: key (re)starts export, without key current export continues.
+  Chunk of archive from *offset is copied to out, *offset is set to 0 when
+  archive had to be started again. Chunk shorter than BACKUP_CHUNK is the last one.
+ */
+static bool backup_export(uint32_t handle, const uint8_t *key, uint32_t *offset, uint8_t out[BACKUP_CHUNK], size_t *out_len)
+{
+    store_snapshot *snap=(store_snapshot_build()) ? store_snapshot_acquire() : NULL;
+    if (!snap)
+        return false;
+
+    bool ok=true;
+    bool started=false;
+    uint8_t check[BACKUP_CHECK_LEN];
+    if (key && !(backup_out.active && backup_key_check(key, check) && memcmp(backup_out.check, check, BACKUP_CHECK_LEN)==0))
+        ok=started=backup_export_start(handle, key, snap);
+    else if (!backup_out.active || (!key && backup_out.handle!=handle))
+        ok=false;
+
+    /* store changed under export, LOGPC drops what it got so far and starts again with key */
+    if (ok && !started && (backup_out.version!=store_version || backup_out.count!=snap->count))
+    {
+        if (key)
+            ok=started=backup_export_start(handle, key, snap);
+        else
+        {
+            ESP_LOGW(BKP_TAG, "store changed under export, it has to be started again with key");
+            ok=false;
+        }
+    }
+    if (started)
+        *offset=0;
+
+    int32_t n=-1;
+    if (ok)
+    {
+        backup_out.handle=handle;
+        n=backup_export_read(snap, *offset, out, BACKUP_CHUNK);
+    }
+    store_snapshot_release(snap);
+
+    if (n<0 || n<BACKUP_CHUNK)
+    {
+        if (n>=0)
+            ESP_LOGI(BKP_TAG, "export finished with %"PRIu32" bytes",*offset+n);
+        backup_export_wipe();
+    }
+    if (n<0)
+        return false;
+    *out_len=n;
+    return true;
+}
+
+/* archive received by UI_IMPORT, staged records survive disconnection and reboot */
+typedef struct
+{
+    bool                active;
+    uint32_t            handle;
+    uint8_t             key[BACKUP_KEY_LEN]; /*!< Kept only until header brings salt, wiped once keys are derived */
+    backup_keys         keys;
+    bool                restoring;      /*!< Store is being written, staging is kept until restore finishes */
+    uint8_t             header[BACKUP_HEADER];
+    uint32_t            count;          /*!< Domains announced by header */
+    uint32_t            staged;         /*!< Records staged */
+    uint32_t            offset;         /*!< Archive bytes accepted */
+    uint32_t            committed;      /*!< Archive bytes staged and committed, import resumes here */
+    uint8_t             part[BACKUP_RECORD_MAX];
+    size_t              len;            /*!< Received bytes of part */
+    size_t              need;           /*!< Bytes completing part, known from its first bytes */
+}backup_import_state;
+
+static backup_import_state backup_in;
+
+static void backup_import_wipe(void)
+{
+    backup_keys_wipe(&backup_in.keys);
+    mbedtls_platform_zeroize(&backup_in, sizeof(backup_in));
+}
+
+/* staged archive is useless, next import starts from first byte */
+static void backup_import_drop(void)
+{
+    nvs_handle_t staging;
+    if (nvs_open(BACKUP_NAMESPACE, NVS_READWRITE, &staging)==ESP_OK)
+    {
+        nvs_erase_all(staging);
+        nvs_commit(staging);
+        nvs_close(staging);
+    }
+    backup_import_wipe();
+}
+
+/* resume point is written together with records staged before it */
+static bool backup_import_commit(nvs_handle_t staging)
+{
+    esp_err_t err=nvs_set_u32(staging, "offset", backup_in.offset);
+    if (err==ESP_OK)
+        err=nvs_set_u32(staging, "staged", backup_in.staged);
+    if (err==ESP_OK)
+        err=nvs_commit(staging);
+    if (err!=ESP_OK)
+    {
+        ESP_LOGE(BKP_TAG, "Error (%s) committing staged archive",esp_err_to_name(err));
+        return false;
+    }
+    backup_in.committed=backup_in.offset;
+    return true;
+}
+
+/* keys of archive are derived as soon as header brings salt, key of LOGPC is not kept after that */
+static bool backup_import_keys(void)
+{
+    bool ok=backup_keys_setup(&backup_in.keys, backup_in.key, backup_in.header+12);
+    mbedtls_platform_zeroize(backup_in.key, sizeof(backup_in.key));
+    return ok;
+}
+
+/* UI_IMPORT with key: archive staged with the same key continues, other one is dropped */
+static bool backup_import_begin(uint32_t handle, const uint8_t key[BACKUP_KEY_LEN], uint32_t *resume)
+{
+    backup_import_wipe();
+
+    uint8_t check[BACKUP_CHECK_LEN];
+    if (!backup_key_check(key, check))
+        return false;
+
+    nvs_handle_t staging;
+    esp_err_t err=nvs_open(BACKUP_NAMESPACE, NVS_READWRITE, &staging);
+    if (err!=ESP_OK)
+    {
+        ESP_LOGE(BKP_TAG, "Error (%s) opening NVS handle of staged archive!",esp_err_to_name(err));
+        return false;
+    }
+
+    uint8_t stored[BACKUP_CHECK_LEN];
+    size_t len=sizeof(stored);
+    bool same=nvs_get_blob(staging, "check", stored, &len)==ESP_OK && len==sizeof(stored)
+              && memcmp(stored, check, sizeof(stored))==0;
+    if (same)
+    {
+        len=BACKUP_HEADER;
+        uint8_t restoring=0;
+        nvs_get_u32(staging, "offset", &backup_in.committed);
+        nvs_get_u32(staging, "staged", &backup_in.staged);
+        nvs_get_u8(staging, "restoring", &restoring);
+        backup_in.restoring=restoring;
+        if (backup_in.committed>=BACKUP_HEADER && nvs_get_blob(staging, "header", backup_in.header, &len)!=ESP_OK)
+            same=false;
+    }
+    if (!same)
+    {
+        backup_in.committed=0;
+        backup_in.staged=0;
+        backup_in.restoring=false;
+        err=nvs_erase_all(staging);
+        if (err==ESP_OK)
+            err=nvs_set_blob(staging, "check", check, BACKUP_CHECK_LEN);
+        if (err==ESP_OK)
+            err=nvs_commit(staging);
+    }
+    nvs_close(staging);
+    if (err!=ESP_OK)
+    {
+        ESP_LOGE(BKP_TAG, "Error (%s) preparing staged archive",esp_err_to_name(err));
+        backup_import_wipe();
+        return false;
+    }
+
+    memcpy(backup_in.key, key, BACKUP_KEY_LEN);
+    backup_in.handle=handle;
+    backup_in.active=true;
+    backup_in.offset=backup_in.committed;
+    backup_in.count=(backup_in.committed>=BACKUP_HEADER) ? backup_get_u32(backup_in.header+8) : 0;
+    backup_in.need=(backup_in.committed>=BACKUP_HEADER) ? 1 : BACKUP_HEADER;
+    *resume=backup_in.committed;
+    ESP_LOGI(BKP_TAG, "import %s at offset %"PRIu32" with %"PRIu32" records staged",same ? "resumed" : "started",
+             backup_in.committed,backup_in.staged);
+    if (backup_in.committed>=BACKUP_HEADER && !backup_import_keys())
+    {
+        backup_import_wipe();
+        return false;
+    }
+    return true;
+}
+
+/* one archive byte, completed header or record is staged, *finished is set by complete trailer */
+static bool backup_import_byte(nvs_handle_t staging, uint8_t byte, bool *finished)
+{
+    backup_import_state *st=&backup_in;
+    st->part[st->len++]=byte;
+    st->offset++;
+    if (st->len<st->need)
+        return true;
+
+    if (st->offset==st->len)
+    {
+        if (memcmp(st->part, BACKUP_MAGIC, 4)!=0)
+        {
+            ESP_LOGE(BKP_TAG, "archive has unknown format");
+            return false;
+        }
+        memcpy(st->header, st->part, BACKUP_HEADER);
+        st->count=backup_get_u32(st->header+8);
+        st->len=0;
+        st->need=1;
+        return backup_import_keys() && nvs_set_blob(staging, "header", st->header, BACKUP_HEADER)==ESP_OK
+               && backup_import_commit(staging);
+    }
+
+    size_t dlen=st->part[0];
+    if (dlen==0)
+    {
+        /* terminating zero is followed by HMAC of archive */
+        if (st->need==1)
+            st->need=1+BACKUP_TAG_LEN;
+        else
+            *finished=true;
+        return true;
+    }
+    if (dlen>=NVS_KEY_NAME_MAX_SIZE || st->staged>=st->count)
+    {
+        ESP_LOGE(BKP_TAG, "record %"PRIu32" is malformed",st->staged);
+        return false;
+    }
+    if (st->need==1)
+    {
+        st->need=3+dlen;
+        return true;
+    }
+    if (st->need==3+dlen)
+    {
+        size_t plen=(size_t)st->part[1+dlen]<<8 | st->part[2+dlen];
+        if (plen>MAX_TELEGRAM)
+        {
+            ESP_LOGE(BKP_TAG, "record %"PRIu32" is too long",st->staged);
+            return false;
+        }
+        st->need=3+dlen+plen+VAULT_MAC_LEN;
+        return true;
+    }
+
+    /* record is staged as received, plaintext never reaches flash before verification */
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    snprintf(name, sizeof(name), "r%"PRIu32, st->staged);
+    if (nvs_set_blob(staging, name, st->part, st->len)!=ESP_OK)
+        return false;
+    st->staged++;
+    st->len=0;
+    st->need=1;
+    return (st->staged%BACKUP_COMMIT) ? true : backup_import_commit(staging);
+}
+
+/*
+  Whole staged archive is verified with HMAC and every record with GCM before
+  the first one is written, and restore does not start unless NVS has room for all
+  of them. Records are sealed by vault of this device, domains which exist already
+  are overwritten. Once store is touched staging is kept with archive tag, import
+  resumed with the same key finishes interrupted restore.
+ */
+static bool backup_restore(nvs_handle_t staging, const uint8_t tag[BACKUP_TAG_LEN])
+{
+    backup_import_state *st=&backup_in;
+    if (st->staged!=st->count || !st->keys.ready)
+        return false;
+
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    char domain[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *plain;
+    size_t needed=0;
+    mbedtls_md_hmac_reset(&st->keys.hmac);
+    mbedtls_md_hmac_update(&st->keys.hmac, st->header, BACKUP_HEADER);
+    for (uint32_t i = 0; i < st->staged; i++)
+    {
+        size_t len=sizeof(st->part);
+        snprintf(name, sizeof(name), "r%"PRIu32, i);
+        if (nvs_get_blob(staging, name, st->part, &len)!=ESP_OK)
+            return false;
+        mbedtls_md_hmac_update(&st->keys.hmac, st->part, len);
+        int32_t plen=backup_open_record(&st->keys, i, st->part, len, domain, &plain);
+        mbedtls_platform_zeroize(st->part, sizeof(st->part));
+        if (plen<0)
+            return false;
+        /* blob header, index and data entries of sealed record plus its version in index namespace */
+        needed+=3+(plen+VAULT_NONCE_LEN+VAULT_MAC_LEN+31)/32;
+    }
+    uint8_t zero=0, expected[BACKUP_TAG_LEN];
+    mbedtls_md_hmac_update(&st->keys.hmac, &zero, 1);
+    mbedtls_md_hmac_finish(&st->keys.hmac, expected);
+    uint8_t diff=0;
+    for (size_t i = 0; i < BACKUP_TAG_LEN; i++)
+        diff|=expected[i]^tag[i];
+    if (diff)
+    {
+        ESP_LOGE(BKP_TAG, "archive does not authenticate, nothing restored");
+        return false;
+    }
+
+    nvs_stats_t stats;
+    if (nvs_get_stats(NULL, &stats)!=ESP_OK || stats.free_entries<needed+BACKUP_RESTORE_RESERVE)
+    {
+        ESP_LOGE(BKP_TAG, "restore needs %zu NVS entries, %zu free, nothing restored",needed,(size_t)stats.free_entries);
+        return false;
+    }
+
+    /* from here on staging survives failure, it is the only complete copy of archive */
+    esp_err_t err=nvs_set_blob(staging, "tag", tag, BACKUP_TAG_LEN);
+    if (err==ESP_OK)
+        err=nvs_set_u8(staging, "restoring", 1);
+    if (err==ESP_OK)
+        err=nvs_commit(staging);
+    if (err!=ESP_OK)
+        return false;
+    st->restoring=true;
+
+    nvs_handle_t storage;
+    err=nvs_open("storage", NVS_READWRITE, &storage);
+    if (err!=ESP_OK)
+        return false;
+    int64_t start=esp_timer_get_time();
+    for (uint32_t i = 0; i < st->staged && err==ESP_OK; i++)
+    {
+        size_t len=sizeof(st->part);
+        snprintf(name, sizeof(name), "r%"PRIu32, i);
+        err=nvs_get_blob(staging, name, st->part, &len);
+        int32_t plen=(err==ESP_OK) ? backup_open_record(&st->keys, i, st->part, len, domain, &plain) : -1;
+        if (plen>=0)
+            err=set_sealed(storage, domain, plain, plen);
+        else
+            err=ESP_FAIL;
+        mbedtls_platform_zeroize(st->part, sizeof(st->part));
+    }
+    if (err==ESP_OK)
+        err=nvs_commit(storage);
+    nvs_close(storage);
+
+    /* records are committed, their versions follow in one batch; domain is plaintext part of record */
+    store_batch batch;
+    if (err==ESP_OK && store_batch_begin(&batch, st->staged))
+    {
+        for (uint32_t i = 0; i < st->staged && batch.err==ESP_OK; i++)
+        {
+            size_t len=sizeof(st->part);
+            snprintf(name, sizeof(name), "r%"PRIu32, i);
+            batch.err=nvs_get_blob(staging, name, st->part, &len);
+            if (batch.err==ESP_OK)
+            {
+                memcpy(domain, st->part+1, st->part[0]);
+                domain[st->part[0]]='\0';
+                store_batch_add(&batch, domain);
+            }
+            mbedtls_platform_zeroize(st->part, sizeof(st->part));
+        }
+        err=store_batch_end(&batch);
+    }
+    else if (err==ESP_OK)
+        err=batch.err;
+    /* index of many domains is read again rather than copied once per domain */
+    store_snapshot_drop();
+    store_snapshot_build();
+
+    ESP_LOGI(BKP_TAG, "%"PRIu32" domains restored in %"PRId64" us, status:%s",st->staged,esp_timer_get_time()-start,esp_err_to_name(err));
+    return err==ESP_OK;
+}
+
+/* UI_IMPORT with key found store half restored, archive is verified and written again */
+static bool backup_import_finish(bool *restored)
+{
+    nvs_handle_t staging;
+    uint8_t tag[BACKUP_TAG_LEN];
+    size_t len=sizeof(tag);
+    bool ok=nvs_open(BACKUP_NAMESPACE, NVS_READWRITE, &staging)==ESP_OK;
+    if (!ok)
+        return false;
+    ok=nvs_get_blob(staging, "tag", tag, &len)==ESP_OK && len==BACKUP_TAG_LEN && backup_restore(staging, tag);
+    nvs_close(staging);
+    ESP_LOGI(BKP_TAG, "interrupted restore %s", ok ? "finished" : "failed again");
+    *restored=ok;
+    if (ok)
+        backup_import_drop();
+    else
+        backup_import_wipe();
+    return ok;
+}
+
+/*
+  UI_IMPORT chunk at offset. Gap or repeated bytes are ignored, *expected tells LOGPC
+  where to continue and *resume where to start after disconnection.
+  Returns false when archive is broken and staging is dropped.
+ */
+static bool backup_import_chunk(uint32_t handle, uint32_t offset, const uint8_t *data, size_t len,
+                                uint32_t *expected, uint32_t *resume, bool *restored)
+{
+    *restored=false;
+    if (!backup_in.active || backup_in.handle!=handle)
+        return false;
+    *expected=backup_in.offset;
+    *resume=backup_in.committed;
+    if (offset>backup_in.offset || offset+len<=backup_in.offset)
+        return true;
+
+    nvs_handle_t staging;
+    if (nvs_open(BACKUP_NAMESPACE, NVS_READWRITE, &staging)!=ESP_OK)
+        return false;
+    bool ok=true, finished=false;
+    for (size_t i = backup_in.offset-offset; i < len && ok && !finished; i++)
+        ok=backup_import_byte(staging, data[i], &finished);
+    if (ok && finished)
+    {
+        uint8_t tag[BACKUP_TAG_LEN];
+        memcpy(tag, backup_in.part+1, BACKUP_TAG_LEN);
+        ok=backup_import_commit(staging) && backup_restore(staging, tag);
+        *restored=ok;
+    }
+    nvs_close(staging);
+    *expected=backup_in.offset;
+    *resume=backup_in.committed;
+
+    /* half restored store is finished from staging by next UI_IMPORT with key */
+    if (!ok && backup_in.restoring)
+        backup_import_wipe();
+    else if (!ok || finished)
+        backup_import_drop();
+    return ok;
+}
+
+static uint32_t usage_stats()
+{
+    //get overview of actual statistics of data entries :
+    nvs_stats_t nvs_stats;
+    nvs_get_stats(NULL, &nvs_stats);
+    ESP_LOGI(SPP_TAG,"Count: UsedEntries = (%zu), FreeEntries = (%zu), Usage = (%zu%%) AllEntries = (%zu)\n",
+    nvs_stats.used_entries, nvs_stats.free_entries, (nvs_stats.used_entries*100/nvs_stats.total_entries), nvs_stats.total_entries);
+    return (nvs_stats.used_entries*100/nvs_stats.total_entries);
+}
+
+/*
+  Feed event which happened at now_ms into power policy, returns state which should be applied.
+  Touch or telegram make device active, idle follows POWER_IDLE_MS (or expired inactivity
+  timer) without them and light sleep follows POWER_SLEEP_MS without them.
+ */
+static power_state power_policy_step(power_policy *pp, power_event ev, uint32_t now_ms)
+{
+    pp->time_ms[pp->state] += now_ms - pp->accounted_ms;
+    pp->accounted_ms = now_ms;
+
+    switch (ev)
+    {
+    case PWR_EV_TOUCH:
+        pp->waiting = true;
+        pp->request_ms = now_ms;
+        pp->request_state = pp->state;
+        pp->activity_ms = now_ms;
+        pp->state = PWR_ACTIVE;
+        break;
+    case PWR_EV_TRAFFIC:
+        /* first telegram after touch is reply of LOGPC */
+        if (pp->waiting)
+        {
+            pp->latency_ms[pp->request_state] += now_ms - pp->request_ms;
+            pp->requests[pp->request_state]++;
+            pp->waiting = false;
+        }
+        pp->activity_ms = now_ms;
+        pp->state = PWR_ACTIVE;
+        break;
+    case PWR_EV_INACTIVE:
+        if (pp->state == PWR_ACTIVE)
+            pp->state = PWR_IDLE;
+        break;
+    case PWR_EV_TICK:
+        if (now_ms - pp->activity_ms >= POWER_SLEEP_MS)
+            pp->state = PWR_SLEEP;
+        else if (now_ms - pp->activity_ms >= POWER_IDLE_MS && pp->state == PWR_ACTIVE)
+            pp->state = PWR_IDLE;
+        break;
+    }
+    return pp->state;
+}
+
+/* hold power management locks required by state */
+static void power_apply(power_state state)
+{
+#if CONFIG_PM_ENABLE
+    static bool cpu_held = false, sleep_held = false;
+    bool cpu = (state == PWR_ACTIVE), sleep = (state != PWR_SLEEP);
+    if (cpu && !cpu_held)
+        esp_pm_lock_acquire(power_cpu_lock);
+    else if (!cpu && cpu_held)
+        esp_pm_lock_release(power_cpu_lock);
+    if (sleep && !sleep_held)
+        esp_pm_lock_acquire(power_sleep_lock);
+    else if (!sleep && sleep_held)
+        esp_pm_lock_release(power_sleep_lock);
+    cpu_held = cpu;
+    sleep_held = sleep;
+#endif
+    ESP_LOGI(PWR_TAG, "state %d", state);
+}
+
+static void power_notify(power_event ev)
+{
+    xSemaphoreTake(power_mutex, portMAX_DELAY);
+    power_state old = power.state;
+    power_state state = power_policy_step(&power, ev, (uint32_t)(esp_timer_get_time() / 1000));
+    if (state != old)
+        power_apply(state);
+    xSemaphoreGive(power_mutex);
+}
+
+static void power_report(void)
+{
+    xSemaphoreTake(power_mutex, portMAX_DELAY);
+    for (int i = 0; i < PWR_COUNT; i++)
+    {
+        ESP_LOGI(PWR_TAG, "state %d: %"PRIu32" s, %"PRIu32" touches answered in %"PRIu32" ms on average", i,
+                 power.time_ms[i] / 1000, power.requests[i], power.requests[i] ? power.latency_ms[i] / power.requests[i] : 0);
+    }
+    ESP_LOGI(PWR_TAG, "link entered sniff %"PRIu32" times", power_sniff);
+    xSemaphoreGive(power_mutex);
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
+/* idle task goes to wait for interrupt after hooks, every call follows one wakeup */
+static bool power_idle_hook(void)
+{
+    power_cpu_wakeups[xPortGetCoreID()]++;
+    return true;
+}
+#endif
+
+static uint32_t power_wakeups(void)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++)
+        sum += power_cpu_wakeups[i];
+    return sum;
+}
+
+static void power_init(void)
+{
+    power_mutex = xSemaphoreCreateMutexStatic(&power_mutex_buffer);
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    power.activity_ms = power.accounted_ms = now_ms;
+    power.state = PWR_ACTIVE;
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true
+#endif
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_cpu", &power_cpu_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "power_sleep", &power_sleep_lock));
+#endif
+#if !CONFIG_PM_ENABLE
+    ESP_LOGW(PWR_TAG, "power management disabled, states are only accounted");
+#endif
+    power_apply(PWR_ACTIVE);
+#if !CONFIG_IDF_TARGET_LINUX
+    /* simulated scheduler of linux target has no idle hooks, CPU wakeups stay 0 there */
+    for (int i = 0; i < portNUM_PROCESSORS; i++)
+        esp_register_freertos_idle_hook_for_cpu(power_idle_hook, i);
+#endif
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/* scripted timeline for host check of power policy and state expected after every event */
+typedef struct
+{
+    power_event         ev;
+    uint32_t            ms;
+    power_state         state;
+}power_check_step;
+
+static const power_check_step power_check_steps[] = {
+    {PWR_EV_TICK,       POWER_IDLE_MS - 1,                      PWR_ACTIVE},
+    {PWR_EV_TICK,       POWER_IDLE_MS,                          PWR_IDLE},
+    {PWR_EV_TOUCH,      POWER_IDLE_MS + 1000,                   PWR_ACTIVE},  /* touch in idle */
+    {PWR_EV_TICK,       POWER_IDLE_MS + 1100,                   PWR_ACTIVE},
+    {PWR_EV_TRAFFIC,    POWER_IDLE_MS + 1250,                   PWR_ACTIVE},  /* reply 250 ms later */
+    {PWR_EV_TRAFFIC,    POWER_IDLE_MS + 2000,                   PWR_ACTIVE},  /* not a reply */
+    {PWR_EV_INACTIVE,   POWER_IDLE_MS + 5000,                   PWR_IDLE},
+    {PWR_EV_INACTIVE,   POWER_IDLE_MS + 6000,                   PWR_IDLE},
+    {PWR_EV_TICK,       POWER_IDLE_MS + 2000 + POWER_SLEEP_MS - 1, PWR_IDLE},
+    {PWR_EV_TICK,       POWER_IDLE_MS + 2000 + POWER_SLEEP_MS,  PWR_SLEEP},
+    {PWR_EV_TOUCH,      POWER_IDLE_MS + 3000 + POWER_SLEEP_MS,  PWR_ACTIVE},  /* touch in light sleep */
+    {PWR_EV_TRAFFIC,    POWER_IDLE_MS + 3400 + POWER_SLEEP_MS,  PWR_ACTIVE},  /* reply 400 ms later */
+};
+
+/*
+  Host check of power policy, device builds only account time and latency per state while
+  CONFIG_PM_ENABLE is off. Returns number of steps and totals which differ from expected ones.
+ */
+static int32_t power_check(void)
+{
+    int32_t faults = 0;
+    power_policy pp = {.state = PWR_ACTIVE};
+    for (size_t i = 0; i < sizeof(power_check_steps)/sizeof(power_check_steps[0]); i++)
+    {
+        const power_check_step *step = &power_check_steps[i];
+        power_state state = power_policy_step(&pp, step->ev, step->ms);
+        if (state != step->state)
+        {
+            ESP_LOGE(PWR_TAG, "step %zu: event %d at %"PRIu32" ms gives state %d, expected %d", i, step->ev, step->ms, state, step->state);
+            faults++;
+        }
+    }
+    const uint32_t end_ms = power_check_steps[sizeof(power_check_steps)/sizeof(power_check_steps[0]) - 1].ms;
+    const uint32_t time_ms[PWR_COUNT] = {
+        [PWR_ACTIVE] = POWER_IDLE_MS + 4000 + 400,
+        [PWR_IDLE] = 1000 + POWER_SLEEP_MS - 3000,
+        [PWR_SLEEP] = 1000,
+    };
+    const uint32_t requests[PWR_COUNT] = {[PWR_IDLE] = 1, [PWR_SLEEP] = 1};
+    const uint32_t latency_ms[PWR_COUNT] = {[PWR_IDLE] = 250, [PWR_SLEEP] = 400};
+    uint32_t sum_ms = 0;
+    for (int i = 0; i < PWR_COUNT; i++)
+    {
+        sum_ms += pp.time_ms[i];
+        if (pp.time_ms[i] != time_ms[i] || pp.requests[i] != requests[i] || pp.latency_ms[i] != latency_ms[i])
+        {
+            ESP_LOGE(PWR_TAG, "state %d: %"PRIu32" ms, %"PRIu32" touches in %"PRIu32" ms, expected %"PRIu32", %"PRIu32", %"PRIu32, i,
+                     pp.time_ms[i], pp.requests[i], pp.latency_ms[i], time_ms[i], requests[i], latency_ms[i]);
+            faults++;
+        }
+    }
+    if (sum_ms != end_ms)
+    {
+        ESP_LOGE(PWR_TAG, "accounted %"PRIu32" ms of %"PRIu32" ms", sum_ms, end_ms);
+        faults++;
+    }
+    ESP_LOGI(PWR_TAG, "power check: %"PRId32" faults", faults);
+    return faults;
+}
+#endif
+
+/*
+  Keep reply prepared for domain LOGPC shows, it replaces previous one; without message only
+  domain is kept. Message opened under older generation than current one was opened before
+  vault lock wiped hints, then only its domain is kept as well.
+ */
+static void conn_hint_set(uint32_t handle, const msg_field* domain, const uint8_t* message, size_t len, uint32_t generation)
+{
+    if (domain->len>=NVS_KEY_NAME_MAX_SIZE || len>MAX_TELEGRAM)
+        return;
+
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
+    {
+        if (generation!=conn_hint_generation)
+            len=0;
+        mbedtls_platform_zeroize(conn->hint, sizeof(conn->hint));
+        if (len)
+            memcpy(conn->hint, message, len);
+        conn->hint_len=len;
+        memcpy(conn->hint_domain, domain->data, domain->len);
+        conn->hint_domain_len=domain->len;
+        conn->hint_version=store_version;
+        conn->hint_at=xTaskGetTickCount();
+    }
+    xSemaphoreGive(conn_mutex);
+}
+
+/* forget prepared reply, conn_mutex has to be taken */
+static void conn_hint_wipe(conn_ctx* conn)
+{
+    mbedtls_platform_zeroize(conn->hint, sizeof(conn->hint));
+    conn->hint_len=0;
+    conn->hint_domain_len=0;
+}
+
+static void conn_hint_clear(uint32_t handle)
+{
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
+        conn_hint_wipe(conn);
+    xSemaphoreGive(conn_mutex);
+}
+
+static size_t hint_build(const msg_field* domain, uint8_t* message, size_t size);
+
+/*
+  Send reply prepared by UI_HINT, it is used once. Reply wiped by vault lock is built
+  again from remembered domain. Returns false when there is no hint or it is stale
+  (too old or store changed since) and UI_DOMAIN handshake is needed.
+ */
+static bool conn_hint_send(uint32_t handle)
+{
+    uint8_t frame[CHANNEL_HEADER+MAX_TELEGRAM+CHANNEL_MAC_LEN];
+    uint8_t domain[NVS_KEY_NAME_MAX_SIZE];
+    size_t len=0, domain_len=0;
+
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn && conn->hint_domain_len)
+    {
+        bool fresh=(xTaskGetTickCount()-conn->hint_at < HINT_LIFETIME) && conn->hint_version==store_version;
+        if (fresh)
+        {
+            len=conn->hint_len;
+            memcpy(frame+CHANNEL_HEADER, conn->hint, len);
+            domain_len=conn->hint_domain_len;
+            memcpy(domain, conn->hint_domain, domain_len);
+        }
+        conn_hint_wipe(conn);
+    }
+    xSemaphoreGive(conn_mutex);
+    if (!domain_len)
+        return false;
+
+    msg_field field={domain,domain_len};
+    if (!len)
+        len=hint_build(&field, frame+CHANNEL_HEADER, MAX_TELEGRAM);
+    if (!len)
+        return false;
+    ESP_LOGI(TCH_PAD, "prepared reply for domain %.*s sent on touch",(int)domain_len,domain);
+    bool sent=send_prepared(UI_LOGPASS, &field, frame, len, handle);
+    mbedtls_platform_zeroize(frame, sizeof(frame));
+    return sent;
+}
+
+/* UI_LOGPASS reply of domain, returns its length or 0 when domain is not stored */
+static size_t hint_build(const msg_field* domain, uint8_t* message, size_t size)
+{
+    uint8_t* credential=find_in_nvs((uint8_t*)domain->data);
+    if (!credential)
+        return 0;
+
+    size_t credential_len=strlen((char*)credential);
+    uint8_t* pass_cred=extract_credential(UI_PASSWORD,credential);
+    uint8_t* log_cred=extract_credential(UI_LOGIN,credential);
+    msg_field fields[3]={*domain,str_field(log_cred),str_field(pass_cred)};
+    size_t len;
+    if (build_message(UI_LOGPASS, fields, 3, message, size, &len)!=ESP_OK)
+        len=0;
+
+    mbedtls_platform_zeroize(credential, credential_len);
+    mem_free(credential);
+    return len;
+}
+
+/*
+  Resolve credential of domain shown by LOGPC before user touches the pad. While user
+  is not around vault stays locked, only domain is kept and reply is built on touch.
+ */
+static void hint_prepare(uint32_t handle, const msg_field* domain, bool present)
+{
+    /* generation is taken before vault state, lock after it keeps reply from being stored */
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    uint32_t generation=conn_hint_generation;
+    xSemaphoreGive(conn_mutex);
+
+    if (!present || !vault_is_unlocked())
+    {
+        if (store_snapshot_may_contain((char*)domain->data))
+            conn_hint_set(handle, domain, NULL, 0, generation);
+        else
+            conn_hint_clear(handle);
+        return;
+    }
+
+    uint8_t message[MAX_TELEGRAM];
+    size_t len=hint_build(domain, message, sizeof(message));
+    if (len)
+        conn_hint_set(handle, domain, message, len, generation);
+    else
+        conn_hint_clear(handle);
+    mbedtls_platform_zeroize(message, sizeof(message));
+}
+
+/* store or erase record and reply, runs in storage writer or, without it, in worker */
+static void store_mutate(const store_job *job)
+{
+    uint8_t* const *content=job->content;
+    int j=job->count;
+    /*domain is first element of every reply*/
+    msg_field domain={content[0],job->content_len[0]};
+    session_mutation done;
+
+    if (job->mode==UI_NEW_CREDENTIAL)
+    {
+        /*telegram should contains three elements*/
+        if (j==3 && job->sequenced && session_mutation_find(job->handle,job->seq,&done))
+        {   /* retry of stored credential, flash is not written again */
+            msg_field stored={done.domain,done.domain_len};
+            create_message(done.result,&stored,done.fields,job->handle);
+        }
+        else if (j==3)
+        {  /* add new credential*/
+            UI_ENUM result;
+            if (add_to_nvs((uint8_t**)content))
+            {
+                ESP_LOGI(TEL_TAG, "Succesfully added to nvs domain: %s ",(char*)content[0]);
+                result=UI_DONE;
+            }
+            else
+            {
+                ESP_LOGI(TEL_TAG, "Fail to add to nvs domain:  %s ",(char*)content[0]);
+                result=UI_FAIL;
+            }
+            if (job->sequenced)
+                session_mutation_record(job->handle,job->seq,result,&domain,1);
+            /* create message w/o credential*/
+            create_message(result,&domain,1,job->handle);
+        }
+        else
+            ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);
+        return;
+    }
+
+    /* retry of erase which is already done, deleted key would fail now */
+    if (j<=1 && job->sequenced && session_mutation_find(job->handle,job->seq,&done))
+    {
+        msg_field erased={done.domain,done.domain_len};
+        create_message(done.result,&erased,done.fields,job->handle);
+        return;
+    }
+    /* erase exactly one pair <key,value>*/
+    bool res=true;
+    if (j==1)
+    {
+        res=erase_from_nvs(content[0]);
+    }
+    /* erase all stored pairs <key,value>*/
+    else if(j==0)
+    {
+        /* create pointer to empty string */
+        uint8_t *temp = (uint8_t *)"";
+        res=erase_from_nvs(temp);
+    }
+
+    if (res)
+    {
+        ESP_LOGI(TEL_TAG, "Succesfully erased from nvs %s ",((j==0) ? "all keys" : (char*)content[0]));
+        /* create message w/o credential*/
+        create_message(UI_DONE,&domain,j,job->handle);
+    }
+    else
+    {
+        ESP_LOGE(TEL_TAG, "Failed to erase from nvs %s ",((j==0) ? "all keys" : (char*)content[0]));
+        /* create message w/o credential*/
+        create_message(UI_FAIL,&domain,j,job->handle);
+    }
+    if (job->sequenced && j<=1)
+        session_mutation_record(job->handle,job->seq,res ? UI_DONE : UI_FAIL,&domain,j);
+}
+
+/*
+  Hand mutation to storage writer, which takes over parsed elements (*count becomes 0).
+  Without writer, or when connection is gone, it is done right here.
+ */
+static void store_submit(uint32_t handle, UI_ENUM mode, bool sequenced, uint32_t seq, uint8_t* content[3], const size_t content_len[3], int *count)
+{
+    store_job job={.handle=handle, .mode=mode, .sequenced=sequenced, .seq=seq, .count=*count};
+    memcpy(job.content, content, sizeof(job.content));
+    memcpy(job.content_len, content_len, sizeof(job.content_len));
+
+    conn_ctx *conn=NULL;
+    if (writer_enabled)
+    {
+        xSemaphoreTake(conn_mutex, portMAX_DELAY);
+        conn=conn_find(handle);
+        if (conn)
+        {
+            job.slot=conn-connections;
+            conn->writes++;
+        }
+        xSemaphoreGive(conn_mutex);
+    }
+    if (!conn)
+    {
+        store_mutate(&job);
+        return;
+    }
+
+    xQueueSend(store_jobs, &job, portMAX_DELAY);
+    memset(content, 0, sizeof(job.content));
+    *count=0;
+}
+
+/* mutations of connection (or of every one when NULL) still in storage writer */
+static bool store_writes_pending(const conn_ctx *conn)
+{
+    uint32_t writes=0;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+    {
+        if (!conn || conn==&connections[i])
+            writes+=connections[i].writes;
+    }
+    xSemaphoreGive(conn_mutex);
+    return writes>0;
+}
+
+/* worker waits until writer is done with mutations of connection (or with all of them when NULL) */
+static void store_writes_wait(const conn_ctx *conn)
+{
+    bool waited=false;
+    while (store_writes_pending(conn))
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        waited=true;
+    }
+    /* notifications taken meanwhile may have announced packets */
+    if (waited)
+        xTaskNotifyGive(worker_task);
+}
+
+/* storage writer, flash is written while worker goes on with telegrams of other clients */
+static void store_write_task(void *arg)
+{
+    store_job job;
+    while (1)
+    {
+        if (xQueueReceive(store_jobs, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+        store_mutate(&job);
+        for (int k = 0; k < job.count; k++)
+            mem_free(job.content[k]);
+
+        xSemaphoreTake(conn_mutex, portMAX_DELAY);
+        connections[job.slot].writes--;
+        xSemaphoreGive(conn_mutex);
+        /* worker skipped packets of the slot meanwhile */
+        xTaskNotifyGive(worker_task);
+    }
+}
+
+/*Process one complete telegram (or AEAD frame) from SPP client*/
+static void process_single(rcv_tele *tel)
+{
+    /*telegram protected by secure channel, plaintext replaces frame*/
+    bool framed=(tel->len>0 && tel->data[0]==CHANNEL_FRAME);
+    if (framed)
+    {
+        int32_t plain=channel_open(tel->handle,tel->data,tel->len);
+        tel->len=(plain<0) ? 0 : plain;
+        tel->data[tel->len]='\0';
+    }
+    /*content is never logged, it carries credentials and keys*/
+    ESP_LOGI(TEL_TAG, "%s telegram len:%d",framed ? "sealed" : "plaintext",tel->len);
+
+    /*first bytes consist of telegram mode followed by separator*/
+    size_t sep;
+    UI_ENUM mode=telegram_mode(tel->data,tel->len,&sep);
+    /*retried mutation carries the same sequence number*/
+    uint32_t seq=0;
+    bool sequenced=telegram_sequence(tel->data,tel->len,&sep,&seq);
+
+    /*once channel is secured (or required, or negotiated before reconnection) only handshake may come in plaintext*/
+    bool plaintext_allowed=!CHANNEL_REQUIRED && !channel_secured(tel->handle);
+    bool allowed=session_request(tel->handle,framed) && (framed || plaintext_allowed);
+    if (!allowed && mode!=UI_HELLO && mode!=UI_RESUME)
+    {
+        ESP_LOGE(TEL_TAG, "plaintext telegram mode %d rejected, secure channel expected",mode);
+        mode=UI_UNKNOWN;
+    }
+    else
+    {
+        /*replay which could not be queued at connection*/
+        session_replay(tel->handle);
+    }
+
+    /*valid mode in telegram*/
+    if(mode>UI_UNKNOWN)
+    {
+        /*telegram should contains at most 3 additional text places mode,domain,login,password*/
+        uint8_t* content[3]={NULL};
+
+        /*length of every element, known from parsing so no strlen is required later*/
+        size_t content_len[3]={0};
+
+        /*entry number from telegram*/
+        int j=0;
+
+        /*first and last character of element in telegram*/
+        int start_char,end_char=sep;
+
+        //TODO: can happen that telegram will not contain comma (delete all or get statws)
+        /* correct separator after mode bytefield*/
+        if(sep<tel->len && tel->data[sep]==EXT)
+        {
+            /*loop through whole telegram w/o mode bit */
+            for (size_t i = sep+1 ; i <= tel->len; i++)
+            {   
+                /*comma separator ',' or last character is read*/
+                if(tel->data[i]==EXT || i==tel->len)
+                {
+                    /*content can hold only 3 elements, rest of telegram is ignored*/
+                    if (j==3)
+                    {
+                        /*echo payload is taken whole, its separators are not elements*/
+                        if (mode!=UI_ECHO)
+                            ESP_LOGE(TEL_TAG, "too many elements in telegram, ignored from position:%zu",i);
+                        break;
+                    }
+
+                    /*last end_char is ',' so next start_char should be end_char+1*/
+                    start_char=end_char+1;
+                    /*save found position*/
+                    end_char=i;
+                    
+                    /*allocate memory for found element (+1 for null terminator)*/
+                    content[j]=(uint8_t *)mem_alloc(sizeof(uint8_t)*(end_char-start_char+1), MEM_SITE_PARSER);
+                    if (!content[j])
+                    {
+                        ESP_LOGE(TEL_TAG, "no memory for element %d, ignored from position:%d",j,start_char);
+                        break;
+                    }
+
+                    ESP_LOGI(TEL_TAG, "Allocated %zu bytes for:%p content[%d] ",sizeof(uint8_t)*(end_char-start_char+1),content[j],j);
+
+                    memcpy(content[j],&tel->data[start_char],(end_char-start_char+1));
+                    content_len[j]=end_char-start_char;
+
+                    /* replace seperator character with null terminator*/
+                    content[j][end_char-start_char]='\0';
+                    ESP_LOGI(TEL_TAG, "%d element found in telegram start_char:%d, end_char:%d ",j,start_char,end_char);
+                    /*search for next element in telegram*/
+                    j++;
+                }
+            }
+            /*domain is first element of every reply*/
+            msg_field domain={content[0],content_len[0]};
+
+            /*which mode has telegram*/
+            switch (mode)
+            {
+            case UI_DOMAIN:
+                ESP_LOGI(TEL_TAG, "UI_DOMAIN telegram len:%d",tel->len);
+                //TODO: domain telegram
+                break;
+            case UI_LOGIN...UI_PASSWORD:
+                /*TELEGRAM:UI_ENUM,domain*/
+                ESP_LOGI(TEL_TAG, "%s telegram len:%d",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",tel->len);
+
+                /*telegram should contains only one element*/
+                if (j==1)
+                {   
+                    /*search credential in non-volatile storage memory*/
+                    uint8_t* credential=find_in_nvs((uint8_t*)content[0]);
+
+                    /* credential found; create message with found item*/
+                    if(credential)
+                    {   
+                        uint8_t* element_cred=extract_credential(mode,credential);
+                        msg_field fields[2]={domain,str_field(element_cred)};
+                        create_message(mode,fields,2,tel->handle);
+
+                        ESP_LOGI(TEL_TAG, "Release memory for:%p credential ",credential);
+                        /* clean up after msg has been created*/
+                        mem_free(credential);
+                    }
+                    else
+                    {       
+                        // ESP_LOGE(TEL_TAG, "%s for domain:%s missed in NVS",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",content[0]); //redundant message
+                        /* create message w/o credential*/
+                        create_message(UI_MISSED,&domain,1,tel->handle);
+                    }
+                }
+                else
+                    ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);                        
+                break;
+            case UI_LOGPASS:
+                ESP_LOGI(TEL_TAG, "UI_LOGPASS telegram len:%d",tel->len);
+
+                /*telegram should contains only one element*/
+                if (j==1)
+                {   
+                    /*search credential in non-volatile storage memory*/
+                    uint8_t* credential=find_in_nvs((uint8_t*)content[0]);
+
+                    /* credential found; create message with found item*/
+                    if(credential)
+                    { 
+                        uint8_t* pass_cred=extract_credential(UI_PASSWORD,credential);
+                        uint8_t* log_cred=extract_credential(UI_LOGIN,credential);
+                        msg_field fields[3]={domain,str_field(log_cred),str_field(pass_cred)};
+                        create_message(mode,fields,3,tel->handle);   
+
+                        ESP_LOGI(TEL_TAG, "Release memory for:%p credential ",credential);
+                        /* clean up after msg has been created*/
+                        mem_free(credential);        
+                    }
+                        
+                    else
+                    {       
+                        // ESP_LOGE(TEL_TAG, "%s for domain:%s missed in NVS",(mode==UI_LOGIN) ? "UI_LOGIN" : "UI_PASSWORD",content[0]); //redundant message
+                        /* create message w/o credential*/
+                        create_message(UI_MISSED,&domain,1,tel->handle);
+                    }
+
+                }
+
+                break;
+            case UI_DONE:
+                ESP_LOGI(TEL_TAG, "UI_DONE telegram len:%d",tel->len);
+                /*credential reached LOGPC*/
+                if (j==1)
+                    session_acknowledge(tel->handle,&domain);
+
+                break;
+            case UI_NEW_CREDENTIAL:
+                /*TELEGRAM:UI_ENUM,domain,login,password*/
+                ESP_LOGI(TEL_TAG, "UI_NEW_CREDENTIAL telegram len:%d",tel->len);
+                store_submit(tel->handle,mode,sequenced,seq,content,content_len,&j);
+                break;
+            case UI_ERASE:
+                ESP_LOGI(TEL_TAG, "UI_ERASE telegram len:%d",tel->len);
+                store_submit(tel->handle,mode,sequenced,seq,content,content_len,&j);
+                break;
+            case UI_MISSED:
+                ESP_LOGI(TEL_TAG, "UI_MISSED telegram len:%d",tel->len);
+                //TODO: missed telegram
+                break;    
+            case UI_FAIL:
+                ESP_LOGI(TEL_TAG, "UI_FAIL telegram len:%d",tel->len);
+                //TODO: missed telegram
+                break;    
+            case UI_STATS:
+                ESP_LOGI(TEL_TAG, "UI_STATS telegram len:%d",tel->len);
+                /* allocations and flash usage without mutations in flight */
+                store_writes_wait(NULL);
+                /* max 3 characters "0"<->"100"*/
+                char prc[4];
+                /* boot phase times, at most 11 characters each */
+                char boot[BOOT_PHASES*12];
+                /* live/blocks/allocations/peak of every allocation site */
+                char mem[MEM_SITES*48];
+                /* int to char**/
+                msg_field stats[3]={{(uint8_t*)prc,sprintf(prc,"%"PRIu32,usage_stats())},
+                                    {(uint8_t*)boot,boot_format(boot,sizeof(boot))},
+                                    {(uint8_t*)mem,mem_format(mem,sizeof(mem))}};
+                create_message(UI_STATS,stats,3,tel->handle);
+                break;                                                                                 
+            case UI_HELLO:
+                /*TELEGRAM:UI_ENUM,public key*/
+                ESP_LOGI(TEL_TAG, "UI_HELLO telegram len:%d",tel->len);
+                if (j==1)
+                    channel_hello(tel->handle,&domain);
+                else
+                    ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);
+                break;
+            case UI_RESUME:
+                /*TELEGRAM:UI_ENUM,ticket,nonce*/
+                ESP_LOGI(TEL_TAG, "UI_RESUME telegram len:%d",tel->len);
+                if (j==2)
+                {
+                    msg_field nonce={content[1],content_len[1]};
+                    channel_resume(tel->handle,&domain,&nonce);
+                }
+                else
+                    ESP_LOGE(TEL_TAG, "Invalid amount of elements in telegram:%d",j);
+                break;
+            case UI_SYNC:
+                /*TELEGRAM:UI_ENUM,known version, reply UI_ENUM,version,flags,changed domains*/
+                ESP_LOGI(TEL_TAG, "UI_SYNC telegram len:%d",tel->len);
+                /* version must cover mutations of other clients already answered */
+                store_writes_wait(NULL);
+                if (j==1)
+                {
+                    uint8_t changed[MAX_TELEGRAM-24];
+                    size_t changed_len;
+                    uint8_t flags;
+                    char upto[11], flag[2];
+                    uint32_t version=store_sync(strtoul((char*)content[0],NULL,10),changed,sizeof(changed),&changed_len,&flags);
+                    msg_field sync[3]={{(uint8_t*)upto,sprintf(upto,"%"PRIu32,version)},
+                                       {(uint8_t*)flag,sprintf(flag,"%d",flags)},
+                                       {changed,changed_len}};
+                    create_message(UI_SYNC,sync,3,tel->handle);
+                }
+                else
+                    create_message(UI_FAIL,&domain,1,tel->handle);
+                break;
+            case UI_LIST:
+                /*TELEGRAM:UI_ENUM,cursor[,m], reply UI_ENUM,next cursor,domains*/
+                ESP_LOGI(TEL_TAG, "UI_LIST telegram len:%d",tel->len);
+                if (j==1 || j==2)
+                {
+                    uint8_t listed[MAX_TELEGRAM-24];
+                    size_t listed_len;
+                    char next[NVS_KEY_NAME_MAX_SIZE];
+                    bool metadata=(j==2 && content[1][0]=='m');
+                    if (!store_list((char*)content[0],metadata,listed,sizeof(listed),&listed_len,next))
+                        next[0]='\0';
+                    msg_field list[2]={str_field((uint8_t*)next),{listed,listed_len}};
+                    create_message(UI_LIST,list,2,tel->handle);
+                }
+                else
+                    create_message(UI_FAIL,&domain,1,tel->handle);
+                break;
+            case UI_HINT:
+                /*TELEGRAM:UI_ENUM,domain of active browser tab, no reply*/
+                ESP_LOGI(TEL_TAG, "UI_HINT telegram len:%d",tel->len);
+                if (j==1)
+                    hint_prepare(tel->handle,&domain,xTimerIsTimerActive( xTimer_inactivity )==pdTRUE);
+                else
+                    conn_hint_clear(tel->handle);
+                break;
+            case UI_EXPORT:
+                /*TELEGRAM:UI_ENUM,offset[,key], reply UI_ENUM,offset,chunk,crc*/
+                ESP_LOGI(TEL_TAG, "UI_EXPORT telegram with %d elements",j);
+                store_writes_wait(NULL);
+                uint8_t backup_key[BACKUP_KEY_LEN];
+                /* archive key and credentials leave device only over secure channel */
+                if (framed && (j==1 || (j==2 && hex_decode(content[1],content_len[1],backup_key,sizeof(backup_key)))))
+                {
+                    uint8_t chunk[BACKUP_CHUNK];
+                    uint8_t chunk_hex[2*BACKUP_CHUNK];
+                    size_t chunk_len;
+                    char at[11], crc[9];
+                    uint32_t offset=strtoul((char*)content[0],NULL,10);
+                    if (backup_export(tel->handle,(j==2) ? backup_key : NULL,&offset,chunk,&chunk_len))
+                    {
+                        hex_encode(chunk,chunk_len,chunk_hex);
+                        msg_field archive[3]={{(uint8_t*)at,sprintf(at,"%"PRIu32,offset)},
+                                              {chunk_hex,2*chunk_len},
+                                              {(uint8_t*)crc,sprintf(crc,"%08"PRIx32,esp_rom_crc32_le(0,chunk,chunk_len))}};
+                        create_message(UI_EXPORT,archive,3,tel->handle);
+                    }
+                    else
+                        create_message(UI_FAIL,&domain,1,tel->handle);
+                }
+                else
+                    create_message(UI_FAIL,&domain,1,tel->handle);
+                mbedtls_platform_zeroize(backup_key,sizeof(backup_key));
+                /* key derived for export is not kept when user is not around */
+                if (xTimerIsTimerActive( xTimer_inactivity ) !=pdTRUE)
+                    vault_lock();
+                break;
+            case UI_IMPORT:
+                /*TELEGRAM:UI_ENUM,key or UI_ENUM,offset,chunk,crc, reply UI_ENUM,expected offset,resume offset,restored*/
+                ESP_LOGI(TEL_TAG, "UI_IMPORT telegram with %d elements",j);
+                /* restore is the only other writer of storage */
+                store_writes_wait(NULL);
+                {
+                    bool imported=false, restored=false;
+                    uint32_t expected=0, resume=0;
+                    uint8_t import_key[BACKUP_KEY_LEN];
+                    if (framed && j==1 && hex_decode(content[0],content_len[0],import_key,sizeof(import_key)))
+                    {
+                        imported=backup_import_begin(tel->handle,import_key,&resume);
+                        expected=resume;
+                        if (imported && backup_in.restoring)
+                            imported=backup_import_finish(&restored);
+                    }
+                    else if (framed && j==3 && content_len[1]%2==0 && content_len[1]<=2*BACKUP_CHUNK)
+                    {
+                        uint8_t chunk[BACKUP_CHUNK];
+                        size_t chunk_len=content_len[1]/2;
+                        if (!hex_decode(content[1],content_len[1],chunk,chunk_len)
+                            || strtoul((char*)content[2],NULL,16)!=esp_rom_crc32_le(0,chunk,chunk_len))
+                        {
+                            /* damaged chunk is not applied, reply asks for it again */
+                            ESP_LOGE(BKP_TAG, "chunk at offset %s has wrong checksum",(char*)content[0]);
+                            chunk_len=0;
+                        }
+                        imported=backup_import_chunk(tel->handle,strtoul((char*)content[0],NULL,10),chunk,chunk_len,
+                                                     &expected,&resume,&restored);
+                    }
+                    mbedtls_platform_zeroize(import_key,sizeof(import_key));
+
+                    if (imported)
+                    {
+                        char next[11], from[11], flag[2];
+                        msg_field progress[3]={{(uint8_t*)next,sprintf(next,"%"PRIu32,expected)},
+                                               {(uint8_t*)from,sprintf(from,"%"PRIu32,resume)},
+                                               {(uint8_t*)flag,sprintf(flag,"%d",restored)}};
+                        create_message(UI_IMPORT,progress,3,tel->handle);
+                    }
+                    else
+                        create_message(UI_FAIL,&domain,1,tel->handle);
+                    if (xTimerIsTimerActive( xTimer_inactivity ) !=pdTRUE)
+                        vault_lock();
+                }
+                break;
+            case UI_TRACE:
+                /*TELEGRAM:UI_ENUM,first record, reply UI_ENUM,next record,records*/
+                ESP_LOGI(TEL_TAG, "UI_TRACE telegram len:%d",tel->len);
+                if (j==1 && TRACE_RECORDER)
+                {
+                    uint8_t records[MAX_TELEGRAM-16];
+                    size_t records_len;
+                    char next[11];
+                    uint32_t seq=trace_export(strtoul((char*)content[0],NULL,10),records,sizeof(records),&records_len);
+                    msg_field trace[2]={{(uint8_t*)next,sprintf(next,"%"PRIu32,seq)},{records,records_len}};
+                    create_message(UI_TRACE,trace,2,tel->handle);
+                }
+                else
+                    create_message(UI_FAIL,&domain,1,tel->handle);
+                break;
+            case UI_ECHO:
+                /*TELEGRAM:UI_ENUM,payload, reply UI_ENUM,payload - LOGPC measures round trip and throughput of transport*/
+                {
+                    /*payload is returned as received, separators inside it included*/
+                    msg_field echo={tel->data+sep+1, j ? tel->len-sep-1 : 0};
+                    create_message(UI_ECHO,&echo,j ? 1 : 0,tel->handle);
+                }
+                break;
+            default:
+                ESP_LOGE(TEL_TAG, "Undifined mode telegram len:%d",tel->len);
+                break;
+            }
+
+            /*release memory for extracted elements from telegram*/
+            while(--j>=0)
+            {
+                ESP_LOGI(TEL_TAG, "Release memory for:%p content[%d] ",content[j],j);
+                mem_free(content[j]); 
+            }
+                
+
+        }
+        else
+            ESP_LOGE(TEL_TAG, "first separator field has not been recognized telegram len:%d",tel->len);
+
+        
+    }
+    else
+        ESP_LOGE(TEL_TAG, "UI_UNKNOWN structure telegram len:%d",tel->len);
+
+}
+
+/* pass collected telegram to parser and forget it, it may contain credentials */
+static void frame_dispatch(conn_ctx *conn)
+{
+    if (conn->frame_len>0)
+    {
+        rcv_tele tel={.handle=conn->frame_handle, .len=conn->frame_len, .data=conn->frame};
+        conn->frame[conn->frame_len]='\0';
+        /* telegram after mutation in the same packet sees stored record */
+        store_writes_wait(conn);
+        process_single(&tel);
+        mbedtls_platform_zeroize(conn->frame, sizeof(conn->frame));
+    }
+    conn->frame_len=0;
+}
+
+/*
+  Split received packet into telegrams. AEAD frame is collected by length from its
+  header and may span several packets. Plaintext telegram ends with new line or,
+  on packet based transport, with the packet, as LOGPC sends one telegram per packet.
+ */
+static void process_packet(conn_ctx *conn, rcv_tele *tel)
+{
+    /* slot reused by new connection, bytes of previous one are useless */
+    if (conn->frame_handle!=tel->handle)
+    {
+        mbedtls_platform_zeroize(conn->frame, sizeof(conn->frame));
+        conn->frame_len=0;
+        conn->frame_handle=tel->handle;
+    }
+
+    for (size_t i = 0; i < tel->len; i++)
+    {
+        uint8_t byte=tel->data[i];
+        bool framed=(conn->frame_len>0) ? (conn->frame[0]==CHANNEL_FRAME) : (byte==CHANNEL_FRAME);
+
+        if (!framed && (byte=='\n' || byte=='\r'))
+        {
+            frame_dispatch(conn);
+            continue;
+        }
+
+        if (conn->frame_len>=CONN_FRAME_BUF-1)
+        {
+            ESP_LOGE(CON_TAG, "telegram from handle:%"PRIu32" exceeds %d bytes, dropped",tel->handle,CONN_FRAME_BUF-1);
+            mbedtls_platform_zeroize(conn->frame, sizeof(conn->frame));
+            conn->frame_len=0;
+            continue;
+        }
+        conn->frame[conn->frame_len++]=byte;
+
+        if (framed && conn->frame_len>=CHANNEL_HEADER
+            && conn->frame_len==CHANNEL_HEADER+((size_t)conn->frame[1]<<8 | conn->frame[2]))
+            frame_dispatch(conn);
+    }
+
+    if (conn->frame_len>0 && conn->frame[0]!=CHANNEL_FRAME && conn->transport->packets)
+        frame_dispatch(conn);
+}
+
+/*Process incomming messages from SPP clients*/
+static void process_telegram(void *arg)
+{
+    /*struct pointer for buffer from queue*/
+    rcv_tele *tel;
+    task_latency latency = {0};
+    while(1)
+    {
+        /*wait until any connection received something*/
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        /*device became connectable, prepare what first handshake needs*/
+        if (boot_warm_pending)
+        {
+            boot_warm_pending = false;
+            if (channel_load_identity())
+                boot_mark(BOOT_IDENTITY);
+            store_snapshot_build();
+        }
+
+        /*one packet per connection in every round, busy client can not starve others*/
+        bool pending;
+        do
+        {
+            pending=false;
+            for (size_t i = 0; i < CONN_SLOTS; i++)
+            {
+                /*client waits for its mutation, writer notifies once it is stored*/
+                if (store_writes_pending(&connections[i]))
+                    continue;
+                if(xQueueReceive(connections[i].rx, &tel, 0) != pdTRUE)
+                    continue;
+                pending=true;
+
+                /*packet of connection which is already closed*/
+                xSemaphoreTake(conn_mutex, portMAX_DELAY);
+                bool alive=(conn_find(tel->handle)==&connections[i]);
+                xSemaphoreGive(conn_mutex);
+
+                /*connection opened, replies lost with previous connection are sent again*/
+                if (alive && !tel->data)
+                    session_replay(tel->handle);
+                else if (alive)
+                {
+                    process_packet(&connections[i],tel);
+                    task_latency_add(&latency, esp_timer_get_time()-tel->received);
+                    /*elements handed to writer are still allocated*/
+                    if (!store_writes_pending(NULL))
+                        mem_check_transient();
+                }
+
+                if (tel->data)
+                {
+                    mbedtls_platform_zeroize(tel->data, tel->len);
+                    mem_free(tel->data);
+                }
+                mem_free(tel);
+            }
+        } while (pending);
+    }
+}
+
+/* post packet (or connection opened marker when data is NULL) to worker */
+static bool conn_post(uint32_t handle, const uint8_t* data, size_t len)
+{
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    QueueHandle_t rx=NULL;
+    if (conn)
+    {
+        rx=conn->rx;
+        if (data)
+            conn->active=xTaskGetTickCount();
+    }
+    xSemaphoreGive(conn_mutex);
+    if (!rx)
+        return false;
+    if (data)
+        power_notify(PWR_EV_TRAFFIC);
+
+    rcv_tele *tel=(rcv_tele*) mem_alloc(sizeof(rcv_tele), MEM_SITE_BT);
+    if (!tel)
+        return false;
+    tel->handle=handle;
+    tel->len=len;
+    tel->data=NULL;
+    tel->received=esp_timer_get_time();
+    if (data)
+    {
+        tel->data=(uint8_t *)mem_alloc(len+1, MEM_SITE_BT);
+        if (!tel->data)
+        {
+            mem_free(tel);
+            return false;
+        }
+        memcpy(tel->data,data,len);
+        tel->data[len]='\0';
+    }
+
+    /* when queue is full packet is lost, replay waits for next telegram of peer */
+    bool queued=(xQueueSend(rx, &tel, ( TickType_t ) 0)==pdTRUE);
+    if (data)
+        trace_record_event(TRACE_RX, handle, uxQueueMessagesWaiting(rx), data, len);
+    if (!queued)
+    {
+        ESP_LOGE(CON_TAG, "receive queue of handle:%"PRIu32" full, %zu bytes dropped",handle,len);
+        mem_free(tel->data);
+        mem_free(tel);
+        return false;
+    }
+    xTaskNotifyGive(worker_task);
+    return true;
+}
+
+/* take free slot for new client, client is disconnected when all slots are busy */
+static bool conn_open(const transport_ops *transport, uint32_t handle)
+{
+    conn_ctx *conn=NULL;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < CONN_SLOTS && !conn; i++)
+    {
+        if (!connections[i].used)
+            conn=&connections[i];
+    }
+    if (conn)
+    {
+        /* link starts in plaintext, LOGPC opens with UI_HELLO or UI_RESUME */
+        channel_wipe(&conn->channel);
+        conn->used=true;
+        conn->handle=handle;
+        conn->transport=transport;
+        conn->opened=conn->active=xTaskGetTickCount();
+        conn->tx_head=0;
+        conn->tx_len=0;
+        conn->congested=false;
+        conn->flushing=false;
+        conn->tx_sent=0;
+        conn->tx_delivered=0;
+    }
+    xSemaphoreGive(conn_mutex);
+
+    if (!conn)
+    {
+        ESP_LOGE(CON_TAG, "all %d connection slots busy, %s handle:%"PRIu32" refused",CONN_SLOTS,transport->name,handle);
+        transport->disconnect(handle);
+    }
+    return (conn!=NULL);
+}
+
+/* release slot of closed client, returns number of clients still connected over links which can close */
+static size_t conn_close(uint32_t handle)
+{
+    size_t remaining=0;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn)
+    {
+        channel_wipe(&conn->channel);
+        conn_hint_wipe(conn);
+        mbedtls_platform_zeroize(conn->tx, sizeof(conn->tx));
+        conn->tx_len=0;
+        conn->used=false;
+    }
+    /* serial client counts as connected forever, vault would never lock with it */
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+        remaining+=connections[i].used && !connections[i].transport->persistent;
+    xSemaphoreGive(conn_mutex);
+    return remaining;
+}
+
+/* transport reported congestion state of link, waiting bytes are sent once it is clear */
+static void conn_congestion(uint32_t handle, bool congested)
+{
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn && conn->congested!=congested)
+        trace_record_event(congested ? TRACE_CONG : TRACE_UNCONG, handle, conn->tx_len, NULL, 0);
+    if (conn)
+        conn->congested=congested;
+    xSemaphoreGive(conn_mutex);
+
+    if (!congested)
+        conn_flush(handle);
+}
+
+/* connections which should get UI_DOMAIN after touch, returns their number */
+static size_t conn_route_wakeup(uint32_t handles[CONN_SLOTS])
+{
+    size_t count=0;
+    conn_ctx *chosen=NULL;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+    {
+        conn_ctx *conn=&connections[i];
+        if (!conn->used)
+            continue;
+#if TOUCH_ROUTE==TOUCH_ROUTE_ALL
+        handles[count++]=conn->handle;
+#elif TOUCH_ROUTE==TOUCH_ROUTE_PRIMARY
+        if (!chosen || (TickType_t)(conn->opened-chosen->opened) > portMAX_DELAY/2)
+            chosen=conn;
+#else
+        if (!chosen || (TickType_t)(conn->active-chosen->active) < portMAX_DELAY/2)
+            chosen=conn;
+#endif
+    }
+    if (chosen)
+        handles[count++]=chosen->handle;
+    xSemaphoreGive(conn_mutex);
+    return count;
+}
+
+/* client connected through transport, peer address finds its session within grace period */
+static bool transport_opened(const transport_ops *transport, uint32_t handle, const uint8_t* peer)
+{
+    if (!conn_open(transport, handle))
+        return false;
+    /* 1.look for last connected neighbor, its state is taken over within grace period */
+    session_open(peer, handle);
+    /* let worker replay replies which did not reach peer before disconnection */
+    conn_post(handle, NULL, 0);
+    return true;
+}
+
+/* bytes received by transport, worker splits them into telegrams */
+static bool transport_received(const transport_ops *transport, uint32_t handle, const uint8_t* data, size_t len)
+{
+    portENTER_CRITICAL(&transport_lock);
+    transport->stats->rx_bytes+=len;
+    portEXIT_CRITICAL(&transport_lock);
+    return conn_post(handle, data, len);
+}
+
+/* link confirmed oldest send of connection which is not confirmed yet */
+static void transport_delivered(const transport_ops *transport, uint32_t handle)
+{
+    int64_t now=esp_timer_get_time();
+    int64_t start=-1;
+    xSemaphoreTake(conn_mutex, portMAX_DELAY);
+    conn_ctx *conn=conn_find(handle);
+    if (conn && conn->tx_delivered!=conn->tx_sent)
+    {
+        /* start of send is overwritten when more than CONN_IN_FLIGHT wait, such send is not timed */
+        if (conn->tx_sent-conn->tx_delivered<=CONN_IN_FLIGHT)
+            start=conn->tx_sent_us[conn->tx_delivered%CONN_IN_FLIGHT];
+        conn->tx_delivered++;
+    }
+    xSemaphoreGive(conn_mutex);
+    if (start>=0)
+        transport_delivery(transport, now-start);
+}
+
+static void transport_closed(uint32_t handle)
+{
+    /* credentials are not needed without any peer */
+    if (conn_close(handle)==0)
+        vault_lock();
+    session_close(handle);
+}
+
+/* transport accepts clients, worker prepares what first handshake needs */
+static void transport_ready(const transport_ops *transport)
+{
+    ESP_LOGI(TRN_TAG, "%s ready", transport->name);
+    boot_mark(BOOT_DISCOVERABLE);
+    boot_warm_pending = true;
+    xTaskNotifyGive(worker_task);
+}
+
+static void transport_start(const transport_ops *transport)
+{
+    for (size_t i = 0; i < TRANSPORT_BACKENDS; i++)
+    {
+        if (transport_active[i])
+            continue;
+        transport_active[i]=transport;
+        transport->stats->since_us=esp_timer_get_time();
+        break;
+    }
+    if (!transport->start())
+        ESP_LOGE(TRN_TAG, "%s failed to start", transport->name);
+}
+
+/* throughput and send time of every transport since previous report */
+static void transport_report(int64_t now_us)
+{
+    for (size_t i = 0; i < TRANSPORT_BACKENDS && transport_active[i]; i++)
+    {
+        transport_stats *stats=transport_active[i]->stats;
+        portENTER_CRITICAL(&transport_lock);
+        transport_stats period=*stats;
+        memset(stats, 0, sizeof(*stats));
+        stats->since_us=now_us;
+        portEXIT_CRITICAL(&transport_lock);
+
+        int64_t ms=(now_us-period.since_us)/1000;
+        ESP_LOGI(TRN_TAG, "%s: rx %"PRIu32" bytes, tx %"PRIu32" bytes (%"PRId64" bytes/s) in %"PRIu32" sends, send %"PRId64" us average, %"PRId64" us max, %"PRIu32" failed, "
+                 "%"PRIu32" delivered in %"PRId64" us average, %"PRId64" us max",
+                 transport_active[i]->name, period.rx_bytes, period.tx_bytes, (int64_t)period.tx_bytes*1000/(ms>0 ? ms : 1),
+                 period.sends, period.sends ? period.send_us/period.sends : 0, period.send_max_us, period.errors,
+                 period.delivered, period.delivered ? period.deliver_us/period.delivered : 0, period.deliver_max_us);
+    }
+}
 
-            /*release memory for original telegram after reading data*/  
-            ESP_LOGI(TEL_TAG, "Release memory for:%p tel->data ",tel->data);    
-            free(tel->data);
+/* SPP backend, Bluedroid reports link events to esp_spp_cb */
+#if TRANSPORTS & TRANSPORT_SPP
+static esp_err_t spp_send(uint32_t handle, const uint8_t* data, size_t len)
+{
+    return esp_spp_write(handle, len, (uint8_t*)data);
+}
 
-            ESP_LOGI(TEL_TAG, "Release memory for:%p tel; ",tel);    
-            free(tel);
-        }
-    }
+static void spp_disconnect(uint32_t handle)
+{
+    esp_spp_disconnect(handle);
 }
 
+static transport_stats spp_stats;
+/* defined after spp_start which registers esp_spp_cb */
+static const transport_ops transport_spp;
+
 static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
 {
     char bda_str[18] = {0};
@@ -717,8 +5471,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
     case ESP_SPP_CLOSE_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_CLOSE_EVT status:%d handle:%"PRIu32" close_by_remote:%d", param->close.status,
                  param->close.handle, param->close.async);
-                 connection_established=false;
-                 serial_handle=0;
+        transport_closed(param->close.handle);
         break;
     case ESP_SPP_START_EVT:
         if (param->start.status == ESP_SPP_SUCCESS) {
@@ -726,67 +5479,32 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
                      param->start.scn);
             esp_bt_dev_set_device_name(EXAMPLE_DEVICE_NAME);
             esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_GENERAL_DISCOVERABLE);
+            transport_ready(&transport_spp);
         } else {
             ESP_LOGE(SPP_TAG, "ESP_SPP_START_EVT status:%d", param->start.status);
         }
         break;
-        //TODO: 1.SPP server started -> look for last connected neighbor
     case ESP_SPP_CL_INIT_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_CL_INIT_EVT");
         break;
     case ESP_SPP_DATA_IND_EVT:
-        /*
-         * We only show the data in which the data length is less than 128 here. If you want to print the data and
-         * the data rate is high, it is strongly recommended to process them in other lower priority application task
-         * rather than in this callback directly. Since the printing takes too much time, it may stuck the Bluetooth
-         * stack and also have a effect on the throughput!
-         */
+        /* payload is not printed, it carries credentials and would stall BT stack at high data rate */
         //TODO: 3. data received -> send to queue & reset timer to sleep -> verify correctness of telegram
-        ESP_LOGI(SPP_TAG, "ESP_SPP_DATA_IND_EVT len:%d handle:%lu",
+        ESP_LOGI(SPP_TAG, "ESP_SPP_DATA_IND_EVT len:%d handle:%"PRIu32,
                  param->data_ind.len, param->data_ind.handle);
-        if (param->data_ind.len < 128) {
-            esp_log_buffer_hex("", param->data_ind.data, param->data_ind.len);
-
-            /* memory allocation for telegram string */
-            uint8_t* telegram=(uint8_t *)malloc(sizeof(uint8_t)*(param->data_ind.len+1));
-            ESP_LOGI(SPP_TAG, "Allocated %d bytes for:%p telegram ",sizeof(uint8_t)*(param->data_ind.len+1),telegram);
-
-            memcpy(telegram,param->data_ind.data,param->data_ind.len);
-            telegram[param->data_ind.len]='\0';
-            printf("%s\t %d\n",telegram,param->data_ind.len);
-            
-            /* memory allocation for struct to be stored in queue */
-            rcv_tele *new_telegram=(rcv_tele*) malloc(sizeof(rcv_tele*));
-            ESP_LOGI(SPP_TAG, "Allocated %d bytes for:%p new_telegram ",sizeof(rcv_tele*),new_telegram);
-
-            new_telegram->data=telegram;
-            new_telegram->len=param->data_ind.len;
-            new_telegram->handle=param->data_ind.handle;
-
-
-
-        xQueueSend( /* The handle of the queue. */
-               ReceivedQueue,
-               /* The address of the variable that holds the address of new_telegram.
-               sizeof( new_telegram* ) bytes are copied from here into the queue. As the
-               variable holds the address of new_telegram it is the address of new_telegram
-               that is copied into the queue. */
-                &new_telegram,
-               ( TickType_t ) 0 );
-        }
-
-        UBaseType_t len= uxQueueMessagesWaiting( ReceivedQueue );
-        printf("%d\n",len);
-        // param->data_ind.data[4]='\3';
-        // esp_err_t res=esp_spp_write(param->data_ind.handle, param->data_ind.len, param->data_ind.data);
-        /* Send the address of xMessage to the queue created to hold 10    pointers. */
+
+        /* copy goes to receive queue of connection, worker splits it into telegrams */
+        transport_received(&transport_spp, param->data_ind.handle, param->data_ind.data, param->data_ind.len);
         break;
     case ESP_SPP_CONG_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT");
+        ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT handle:%"PRIu32" cong:%d", param->cong.handle, param->cong.cong);
+        conn_congestion(param->cong.handle, param->cong.cong);
         break;
     case ESP_SPP_WRITE_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_WRITE_EVT");
-        //TODO: telegram sended
+        ESP_LOGI(SPP_TAG, "ESP_SPP_WRITE_EVT handle:%"PRIu32" len:%d cong:%d", param->write.handle, param->write.len, param->write.cong);
+        /* Bluedroid confirms every esp_spp_write once the data went down to the link */
+        transport_delivered(&transport_spp, param->write.handle);
+        conn_congestion(param->write.handle, param->write.cong);
         break;
     case ESP_SPP_SRV_OPEN_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_SRV_OPEN_EVT status:%d handle:%"PRIu32", rem_bda:[%s]", param->srv_open.status,
@@ -794,8 +5512,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
         gettimeofday(&time_old, NULL);
         ESP_LOGI(SPP_TAG, "SAY HELLO TO LOG PC");
         //TODO:WAKEUP LOGPC
-        connection_established=true;
-        serial_handle=param->srv_open.handle;
+        transport_opened(&transport_spp, param->srv_open.handle, param->srv_open.rem_bda);
         break;
     case ESP_SPP_SRV_STOP_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_SRV_STOP_EVT");
@@ -856,7 +5573,9 @@ void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
     case ESP_BT_GAP_MODE_CHG_EVT:
         ESP_LOGI(SPP_TAG, "ESP_BT_GAP_MODE_CHG_EVT mode:%s bda:[%s]", mode_to_str(param->mode_chg.mode),
                  bda2str(param->mode_chg.bda, bda_str, sizeof(bda_str)));
-                 //TODO: change mode handling
+        /* Bluedroid power policy of SPP puts idle link into sniff and leaves it on first data */
+        if (param->mode_chg.mode == ESP_BT_PM_MD_SNIFF)
+            power_sniff++;
         break;
     case ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT:
         ESP_LOGI(SPP_TAG, "ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT status:%d ",param->acl_conn_cmpl_stat.stat);
@@ -874,13 +5593,228 @@ void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
     return;
 }
 
+/* controller, Bluedroid, GAP and SPP server, ESP_SPP_START_EVT makes device connectable */
+static bool spp_start(void)
+{
+    char bda_str[18] = {0};
+    esp_err_t ret;
+    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_BLE));
+
+    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+    if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s initialize controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    if ((ret = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT)) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+    boot_mark(BOOT_CONTROLLER);
+
+    if ((ret = esp_bluedroid_init()) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s initialize bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    if ((ret = esp_bluedroid_enable()) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s enable bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+    boot_mark(BOOT_BLUEDROID);
+
+    if ((ret = esp_bt_gap_register_callback(esp_bt_gap_cb)) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s gap register failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    if ((ret = esp_spp_register_callback(esp_spp_cb)) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s spp register failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    esp_spp_cfg_t bt_spp_cfg = {
+        .mode = esp_spp_mode,
+        .enable_l2cap_ertm = esp_spp_enable_l2cap_ertm,
+        .tx_buffer_size = 0, /* Only used for ESP_SPP_MODE_VFS mode */
+    };
+    if ((ret = esp_spp_enhanced_init(&bt_spp_cfg)) != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "%s spp init failed: %s\n", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+// #if (CONFIG_BT_SSP_ENABLED == true)
+    /* Set default parameters for Secure Simple Pairing */
+    esp_bt_sp_param_t param_type = ESP_BT_SP_IOCAP_MODE;
+    esp_bt_io_cap_t iocap = ESP_BT_IO_CAP_IO;
+    esp_bt_gap_set_security_param(param_type, &iocap, sizeof(uint8_t));
+// #endif
+
+    /*
+     * Set default parameters for Legacy Pairing
+     * Use variable pin, input pin code when pairing
+     */
+    esp_bt_pin_type_t pin_type = ESP_BT_PIN_TYPE_VARIABLE;
+    esp_bt_pin_code_t pin_code;
+    esp_bt_gap_set_pin(pin_type, 0, pin_code);
+    boot_mark(BOOT_SPP);
+
+    ESP_LOGI(SPP_TAG, "Own address:[%s]", bda2str((uint8_t *)esp_bt_dev_get_address(), bda_str, sizeof(bda_str)));
+    return true;
+}
+
+static const transport_ops transport_spp = {"spp", spp_start, spp_send, spp_disconnect, true, false, true, &spp_stats};
+#endif
+
+/*
+  UART backend. Serial line has no connection events, LOGPC on the other end is
+  client as long as device runs. On linux target the line is a pty, so the same
+  engine runs on host with LOGPC or test script attached to the slave side.
+ */
+#if TRANSPORTS & TRANSPORT_UART
+/* session of serial client, it has no BDA */
+static const uint8_t uart_peer[ESP_BD_ADDR_LEN] = {'U', 'A', 'R', 'T', 0, TRANSPORT_UART_PORT};
+static transport_stats uart_stats;
+static TaskHandle_t uart_task = NULL;
+/* serial client has connection slot, cleared by disconnect so reader opens it again */
+static volatile bool uart_opened = false;
+#if CONFIG_IDF_TARGET_LINUX
+static int uart_fd = -1;
+/* slave side of pty, LOGPC or host benchmark attaches to it */
+static char uart_pty[64];
+#endif
+
+static esp_err_t uart_send(uint32_t handle, const uint8_t* data, size_t len)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    ssize_t written=write(uart_fd, data, len);
+#else
+    /* driver has no transmit ring, bytes have left the line when send returns */
+    int written=uart_write_bytes(TRANSPORT_UART_PORT, data, len);
+    if (written==(int)len && uart_wait_tx_done(TRANSPORT_UART_PORT, portMAX_DELAY)!=ESP_OK)
+        written=-1;
+#endif
+    return (written==(int)len) ? ESP_OK : ESP_FAIL;
+}
+
+/*
+  Serial line can not be dropped, only its client is closed like SPP one after
+  ESP_SPP_CLOSE_EVT. Reader opens it again with its next data.
+ */
+static void uart_disconnect(uint32_t handle)
+{
+    if (handle!=TRANSPORT_UART_HANDLE)
+        return;
+    /* slot is released first, data read meanwhile is dropped instead of reaching closed client */
+    transport_closed(handle);
+    uart_opened=false;
+}
+
+static const transport_ops transport_uart;
+
+/* reader stands in for BT callback, it posts whatever arrived within idle time */
+static void uart_read_task(void *arg)
+{
+    uint8_t buf[MAX_SPP_PACKET];
+    uart_opened=transport_opened(&transport_uart, TRANSPORT_UART_HANDLE, uart_peer);
+    transport_ready(&transport_uart);
+    while (1)
+    {
+#if CONFIG_IDF_TARGET_LINUX
+        /* pty is non-blocking, blocked read would stall simulated scheduler */
+        ssize_t len=read(uart_fd, buf, sizeof(buf));
+        if (len<=0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(TRANSPORT_UART_IDLE_MS));
+            continue;
+        }
+#else
+        int len=uart_read_bytes(TRANSPORT_UART_PORT, buf, sizeof(buf), pdMS_TO_TICKS(TRANSPORT_UART_IDLE_MS));
+        if (len<=0)
+            continue;
+#endif
+        if (!uart_opened)
+            uart_opened=transport_opened(&transport_uart, TRANSPORT_UART_HANDLE, uart_peer);
+        if (uart_opened)
+            transport_received(&transport_uart, TRANSPORT_UART_HANDLE, buf, len);
+        mbedtls_platform_zeroize(buf, len);
+    }
+}
+
+static StackType_t uart_stack[TASK_UART_STACK];
+static StaticTask_t uart_tcb;
+static const task_spec task_uart = {"uart_read_task", uart_read_task, TASK_UART_CORE, TASK_UART_PRIO,
+                                    TASK_UART_STACK, uart_stack, &uart_tcb, &uart_task};
+
+static bool uart_start(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    /* slave stays open, so master does not fail while no client is attached */
+    struct termios tio;
+    int slave;
+    if (openpty(&uart_fd, &slave, uart_pty, NULL, NULL)!=0 || tcgetattr(slave, &tio)!=0)
+    {
+        ESP_LOGE(TRN_TAG, "pty failed to open");
+        return false;
+    }
+    /* telegrams are binary, no echo or line editing */
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(uart_fd, F_SETFL, fcntl(uart_fd, F_GETFL) | O_NONBLOCK);
+    ESP_LOGI(TRN_TAG, "uart on pty %s", uart_pty);
+#else
+    uart_config_t uart_cfg = {
+        .baud_rate = TRANSPORT_UART_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    esp_err_t ret;
+    if ((ret = uart_driver_install(TRANSPORT_UART_PORT, TRANSPORT_UART_BUF, 0, 0, NULL, 0)) != ESP_OK
+        || (ret = uart_param_config(TRANSPORT_UART_PORT, &uart_cfg)) != ESP_OK
+        || (ret = uart_set_pin(TRANSPORT_UART_PORT, TRANSPORT_UART_TX, TRANSPORT_UART_RX, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE)) != ESP_OK) {
+        ESP_LOGE(TRN_TAG, "%s uart %d failed: %s", __func__, TRANSPORT_UART_PORT, esp_err_to_name(ret));
+        return false;
+    }
+    ESP_LOGI(TRN_TAG, "uart %d at %d baud", TRANSPORT_UART_PORT, TRANSPORT_UART_BAUD);
+#endif
+    task_start(&task_uart);
+    return true;
+}
+
+static const transport_ops transport_uart = {"uart", uart_start, uart_send, uart_disconnect, false, true, false, &uart_stats};
+#endif
+
+/* order of start, SPP comes first so its boot phases keep their meaning */
+static const transport_ops *const transport_backends[] = {
+#if TRANSPORTS & TRANSPORT_SPP
+    &transport_spp,
+#endif
+#if TRANSPORTS & TRANSPORT_UART
+    &transport_uart,
+#endif
+};
+
+/* blue LED is on while user is around, linux target has no LED */
+static void led_set(uint32_t level)
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    gpio_set_level(BLUE_LED, level);
+#endif
+}
+
 void timer_callback(TimerHandle_t xtimer)
 {
-    if ((uint32_t)pvTimerGetTimerID(xtimer)==0)
+    if ((uintptr_t)pvTimerGetTimerID(xtimer)==0)
     {
         ESP_LOGI(TIM_CB, "timer 0 expired");
         ESP_LOGI(TCH_PAD, "Switch off LED");
-        gpio_set_level(BLUE_LED, 0);
+        led_set(0);
+        /* user is gone, forget session key */
+        vault_lock();
+        power_notify(PWR_EV_INACTIVE);
     }
 }
 static void renew_timer()
@@ -890,20 +5824,21 @@ static void renew_timer()
     {
         ESP_LOGI(RNW_TIM, "Timer: %s has been reseted ", pcTimerGetName(xTimer_inactivity));
         ESP_LOGI(RNW_TIM, "Switch on LED");
-        gpio_set_level(BLUE_LED, 1);
+        led_set(1);
     }
 } 
 
 
 /*
   Read value sensed at available touch pad.
-  Use 2 / 3 of read value as the threshold
+  Use TOUCH_THRESH_PERCENT of read value as the threshold
   to trigger interrupt when the pad is touched.
   Note: this routine demonstrates a simple way
   to configure activation threshold for the touch pads.
   Do not touch any pads when this routine
   is running (on application start).
  */
+#if !CONFIG_IDF_TARGET_LINUX
  static void tp_example_set_thresholds(void)
 {
     uint16_t touch_value;
@@ -911,95 +5846,252 @@ static void renew_timer()
         touch_pad_read_filtered(TOUCH_PAD_IO, &touch_value);
         pad_init_val = touch_value;
         ESP_LOGI(TCH_PAD, "test init: touch pad [%d] val is %d", TOUCH_PAD_IO, touch_value);
-        //set interrupt threshold.
-        //ESP_ERROR_CHECK(touch_pad_set_thresh(TOUCH_PAD_IO, touch_value * 2 / 3));
+        //set interrupt threshold, the same one which touch task uses for filtered value.
+#if TOUCH_INTERRUPT
+        ESP_ERROR_CHECK(touch_pad_set_thresh(TOUCH_PAD_IO, touch_value * TOUCH_THRESH_PERCENT / 100));
+#endif
 } 
+#endif
+
+static void touch_baseline_init(touch_baseline *tb, uint16_t value, uint32_t now_ms)
+{
+    tb->value_q8 = (int32_t)value << 8;
+    tb->remainder = 0;
+    tb->updated_ms = now_ms;
+    tb->touched = false;
+}
+
+static uint16_t touch_baseline_threshold(const touch_baseline *tb, uint32_t percent)
+{
+    return (uint16_t)(((tb->value_q8 >> 8) * percent) / 100);
+}
+
+/* classify sample against baseline, touch starts below TOUCH_THRESH_PERCENT and ends above TOUCH_RELEASE_PERCENT */
+static bool touch_baseline_sample(touch_baseline *tb, uint16_t value)
+{
+    if (tb->touched)
+        tb->touched = (value <= touch_baseline_threshold(tb, TOUCH_RELEASE_PERCENT));
+    else
+        tb->touched = (value < touch_baseline_threshold(tb, TOUCH_THRESH_PERCENT));
+    return tb->touched;
+}
 
 /*
-  Check if any of touch pads has been activated
-  by reading a table updated by rtc_intr()
-  If so, then print it out on a serial monitor.
-  Clear related entry in the table afterwards
+  Move baseline towards sample with time constant TOUCH_BASELINE_TAU_MS.
+  Only quiet pad is tracked, otherwise finger would become part of baseline.
+  Step of 10 ms sample is below 1/256 count for drift under ~23 counts, its
+  remainder is carried so slow drift is followed in polling mode as well.
+ */
+static void touch_baseline_track(touch_baseline *tb, uint16_t value, uint32_t now_ms, bool quiet)
+{
+    uint32_t dt = now_ms - tb->updated_ms;
+    tb->updated_ms = now_ms;
+    if (!quiet || dt == 0)
+        return;
 
-  In interrupt mode, the table is updated in touch ISR.
+    int64_t diff = ((int32_t)value << 8) - tb->value_q8;
+    int64_t num = diff * dt + tb->remainder;
+    int64_t step = num / (TOUCH_BASELINE_TAU_MS + dt);
+    tb->remainder = num - step * (TOUCH_BASELINE_TAU_MS + dt);
+    tb->value_q8 += (int32_t)step;
+}
 
-  In filter mode, we will compare the current filtered value with the initial one.
-  If the current filtered value is less than 80% of the initial value, we can
-  regard it as a 'touched' event.
-  When calling touch_pad_init, a timer will be started to run the filter.
-  This mode is designed for the situation that the pad is covered
-  by a 2-or-3-mm-thick medium, usually glass or plastic.
-  The difference caused by a 'touch' action could be very small, but we can still use
-  filter mode to detect a 'touch' event.
+/*
+  Feed one pad sample taken at now_ms into debounce state machine.
+  Sample has to keep its value for TOUCH_DEBOUNCE_MS before steady state follows it,
+  returns edge of steady state if there is one.
  */
-static void tp_example_read_task(void *pvParameter)
+static touch_event touch_debounce_step(touch_debounce *db, bool sample, uint32_t now_ms)
 {
-    bool touch_state = false;
-    bool last_flicker_state = false;
-    bool last_steady_state = false;
-    TickType_t last_flicker = 0;
-    while(1)
+    /* state has been change */
+    if (sample != db->sample)
     {
-        uint16_t value = 0;
-        /* get filtered value */
-        touch_pad_read_filtered(TOUCH_PAD_IO, &value);
-        /* state of touch pad */
-        touch_state= (value < pad_init_val * TOUCH_THRESH_PERCENT / 100);
-        
-        /* state has been change */
-        if (touch_state != last_flicker_state)
+        /* store last flickering/change */
+        db->changed_ms = now_ms;
+        db->sample = sample;
+    }
+
+    if (now_ms - db->changed_ms <= TOUCH_DEBOUNCE_MS || sample == db->steady)
+        return TOUCH_NONE;
+
+    db->steady = sample;
+    return sample ? TOUCH_PRESSED : TOUCH_RELEASED;
+}
+
+/* nothing to evaluate until pad changes again, interrupt may take over sampling */
+static bool touch_debounce_idle(const touch_debounce *db)
+{
+    return !db->sample && !db->steady;
+}
+
+/* pad untouched and settled long enough after last change to be used as baseline */
+static bool touch_debounce_quiet(const touch_debounce *db, uint32_t now_ms)
+{
+    return touch_debounce_idle(db) && now_ms - db->changed_ms > TOUCH_DEBOUNCE_MS;
+}
+
+static void touch_detector_init(touch_detector *td, uint16_t value, uint32_t now_ms)
+{
+    memset(td, 0, sizeof(*td));
+    touch_baseline_init(&td->tb, value, now_ms);
+}
+
+/* classify sample against baseline, debounce it and track baseline, returns edge of debounced state */
+static touch_event touch_detector_step(touch_detector *td, uint16_t value, uint32_t now_ms)
+{
+    bool touched = touch_baseline_sample(&td->tb, value);
+    td->candidate |= touched;
+
+    touch_event ev = touch_debounce_step(&td->db, touched, now_ms);
+    if (ev == TOUCH_PRESSED)
+    {
+        td->accepted++;
+        td->pressed = true;
+    }
+
+    if (touch_debounce_idle(&td->db))
+    {
+        /* touch which did not last debounce period, e.g. drift or noise */
+        if (td->candidate && !td->pressed)
+            td->rejected++;
+        td->candidate = td->pressed = false;
+    }
+
+    touch_baseline_track(&td->tb, value, now_ms, touch_debounce_quiet(&td->db, now_ms));
+    return ev;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/*
+  Feed trace logged with TOUCH_TRACE into fresh detector, recomputed baseline and
+  events have to match recorded ones sample by sample. Returns number of samples
+  which differ, -1 when trace can not be read.
+ */
+static int32_t touch_replay(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        ESP_LOGE(TCH_PAD, "trace %s can not be opened", path);
+        return -1;
+    }
+
+    touch_detector td;
+    bool started = false;
+    uint32_t samples = 0, differ = 0;
+    char line[160];
+    while (fgets(line, sizeof(line), f))
+    {
+        const char *rec;
+        uint32_t ms;
+        unsigned value;
+        int32_t baseline;
+        int event;
+        if ((rec = strstr(line, "trace-init:")) && sscanf(rec, "trace-init:%"SCNu32",%u", &ms, &value) == 2)
         {
-            /* store last flickering/change */
-            last_flicker = xTaskGetTickCount();
-            /* update state*/
-            last_flicker_state = touch_state;
+            touch_detector_init(&td, value, ms);
+            started = true;
+            continue;
         }
-        
-        if(xTaskGetTickCount()-last_flicker>30)
+        if (!started || !(rec = strstr(line, "trace:"))
+            || sscanf(rec, "trace:%"SCNu32",%u,%"SCNd32",%d", &ms, &value, &baseline, &event) != 4)
+            continue;
+
+        touch_event ev = touch_detector_step(&td, value, ms);
+        samples++;
+        if ((td.tb.value_q8 >> 8) != baseline || (int)ev != event)
         {
-            
-            if (!last_steady_state && touch_state)
-            {
-                ESP_LOGI(TCH_PAD, "T%d activated!", TOUCH_PAD_IO);
+            if (differ++ < TOUCH_REPLAY_REPORT)
+                ESP_LOGE(TCH_PAD, "replay differs at %"PRIu32" ms: baseline %"PRId32" recorded %"PRId32", event %d recorded %d",
+                         ms, td.tb.value_q8 >> 8, baseline, ev, event);
+        }
+    }
+    fclose(f);
 
-                if (xTimerIsTimerActive( xTimer_inactivity ) !=pdTRUE && connection_established)
-                {
-                    renew_timer();
-                    ESP_LOGI(TCH_PAD, "Switch on LED");
-                    gpio_set_level(BLUE_LED, 1);
-                    create_message(UI_DOMAIN,NULL,NULL,NULL,serial_handle);
-                }
-            }
-                    
-            if(last_steady_state && !touch_state)
-            {
-                ESP_LOGI(TCH_PAD, "T%d deactivated!", TOUCH_PAD_IO); 
-            }
-                
+    ESP_LOGI(TCH_PAD, "replayed %"PRIu32" samples, activations accepted:%"PRIu32" rejected:%"PRIu32", %"PRIu32" samples differ",
+             samples, started ? td.accepted : 0, started ? td.rejected : 0, differ);
+    return started ? (int32_t)differ : -1;
+}
+#endif
+
+#if !CONFIG_IDF_TARGET_LINUX
+/* touch pad has been activated, wake up LOGPC */
+static void touch_pressed(void)
+{
+    ESP_LOGI(TCH_PAD, "T%d activated!", TOUCH_PAD_IO);
+    power_notify(PWR_EV_TOUCH);
 
-                last_steady_state=touch_state;      
+    uint32_t handles[CONN_SLOTS];
+    size_t routed=0;
+    if (xTimerIsTimerActive( xTimer_inactivity ) !=pdTRUE && (routed=conn_route_wakeup(handles))>0)
+    {
+        renew_timer();
+        ESP_LOGI(TCH_PAD, "Switch on LED");
+        led_set(1);
+        /* prepared credential saves round trip of UI_DOMAIN handshake */
+        for (size_t i = 0; i < routed; i++)
+        {
+            if (!conn_hint_send(handles[i]))
+                create_message(UI_DOMAIN,NULL,0,handles[i]);
         }
-            // ESP_LOGI(TCH_PAD, "T%d activated!", TOUCH_PAD_IO);
-            // ESP_LOGI(TCH_PAD, "value: %"PRIu16"; init val: %"PRIu32, value, pad_init_val);
-            vTaskDelay(10 / portTICK_PERIOD_MS);
-    }
 
+        /* derive session key while LOGPC searches for login fields */
+        if (vault_acquire())
+            vault_release();
+    }
+}
+#endif
 
+static void touch_report(int64_t now_us)
+{
+    uint32_t cpu_wakeups = power_wakeups();
+    ESP_LOGI(TCH_PAD, "%s mode: %"PRIu32" task wakeups, %"PRId64" per hour, %"PRIu32" CPU wakeups, %"PRId64" per hour, activations accepted:%"PRIu32" rejected:%"PRIu32,
+             TOUCH_INTERRUPT ? "interrupt" : "polling", touch_wakeups, (int64_t)touch_wakeups*3600*1000000/(now_us>0 ? now_us : 1),
+             cpu_wakeups, (int64_t)cpu_wakeups*3600*1000000/(now_us>0 ? now_us : 1), touch_det.accepted, touch_det.rejected);
+    power_report();
+    mem_report();
+    transport_report(now_us);
 }
-    
 
-static void tp_init()
+#if CONFIG_IDF_TARGET_LINUX
+/* linux target has no pad, task only keeps hourly report */
+static void tp_example_read_task(void *pvParameter)
 {
-    /* Set the GPIO as a push/pull output */
-    gpio_reset_pin(BLUE_LED);
-    gpio_set_direction(BLUE_LED, GPIO_MODE_OUTPUT);
+    while(1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(TOUCH_REPORT_MS));
+        touch_report(esp_timer_get_time());
+    }
+}
+#else
+#if TOUCH_INTERRUPT
+/* pad value fell below threshold, touch task takes over until pad is released */
+static void IRAM_ATTR touch_isr(void *arg)
+{
+    uint32_t status = touch_pad_get_status();
+    touch_pad_clear_status();
+    if (status & (1UL << TOUCH_PAD_IO))
+    {
+        touch_pad_intr_disable();
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(touch_task, &woken);
+        if (woken)
+            portYIELD_FROM_ISR();
+    }
+}
+#endif
 
+/* Touch pad peripheral and threshold, pad must not be touched meanwhile */
+static void tp_calibrate(void)
+{
     // Initialize touch pad peripheral.
     // The default fsm mode is software trigger mode.
     ESP_ERROR_CHECK(touch_pad_init());
 
     // If use interrupt trigger mode, should set touch sensor FSM mode at 'TOUCH_FSM_MODE_TIMER'.
-    // touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
+#if TOUCH_INTERRUPT
+    touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
+#endif
     
     // Set reference voltage for charging/discharging
     // For most usage scenarios, we recommend using the following combination:
@@ -1015,14 +6107,218 @@ static void tp_init()
     // Set thresh hold
     tp_example_set_thresholds();
 
+#if TOUCH_INTERRUPT
+    // Filter runs fast only while task samples touch, otherwise its timer would wake CPU every 10 ms
+    touch_pad_set_filter_period(TOUCHPAD_FILTER_IDLE_PERIOD);
+    // Register touch interrupt ISR, touch_task is set by task before it gets here
+    touch_pad_isr_register(touch_isr, NULL);
+    touch_pad_clear_status();
+    touch_pad_intr_enable();
+#endif
+    boot_mark(BOOT_TOUCH);
+}
+
+/*
+  Check if touch pad has been activated.
+
+  In interrupt mode task sleeps until touch ISR wakes it, then samples filtered
+  value every TOUCH_SAMPLE_MS until pad is released and debounced, and gives
+  control back to the interrupt. Filter timer runs at touch period only while
+  task samples, otherwise it would keep CPU awake in interrupt mode.
+
+  In polling mode task samples filtered value every TOUCH_SAMPLE_MS forever.
+
+  In both cases current filtered value is compared with the initial one.
+  If the current filtered value is less than 80% of the initial value, we can
+  regard it as a 'touched' event.
+  When calling touch_pad_init, a timer will be started to run the filter.
+  This mode is designed for the situation that the pad is covered
+  by a 2-or-3-mm-thick medium, usually glass or plastic.
+  The difference caused by a 'touch' action could be very small, but we can still use
+  filter mode to detect a 'touch' event.
+ */
+static void tp_example_read_task(void *pvParameter)
+{
+    /* task_start sets handle only after creation returns, ISR may fire sooner */
+    touch_task = xTaskGetCurrentTaskHandle();
+    tp_calibrate();
+
+    int64_t last_report = esp_timer_get_time();
+    touch_detector_init(&touch_det, pad_init_val, (uint32_t)(last_report / 1000));
+#if TOUCH_TRACE
+    ESP_LOGI(TCH_PAD, "trace-init:%"PRIu32",%"PRIu32, (uint32_t)(last_report / 1000), pad_init_val);
+#endif
+    bool sampling = !TOUCH_INTERRUPT;
+#if TOUCH_INTERRUPT
+    /* time of last interrupt, sampling goes on until filter settles */
+    uint32_t woken_ms = 0;
+#endif
+    while(1)
+    {
+        if (sampling)
+            vTaskDelay(TOUCH_SAMPLE_MS / portTICK_PERIOD_MS);
+#if TOUCH_INTERRUPT
+        else if (ulTaskNotifyTake(pdTRUE, TOUCH_BASELINE_MS / portTICK_PERIOD_MS))
+        {
+            touch_pad_set_filter_period(TOUCHPAD_FILTER_TOUCH_PERIOD);
+            woken_ms = (uint32_t)(esp_timer_get_time() / 1000);
+            sampling = true;
+        }
+#endif
+        touch_wakeups++;
+        power_notify(PWR_EV_TICK);
+
+        int64_t now = esp_timer_get_time();
+        if (now - last_report >= (int64_t)TOUCH_REPORT_MS*1000)
+        {
+            touch_report(now);
+            last_report = now;
+        }
+
+        uint16_t value = 0;
+        /* get filtered value */
+        touch_pad_read_filtered(TOUCH_PAD_IO, &value);
+        uint32_t now_ms = (uint32_t)(now / 1000);
+        touch_event ev = touch_detector_step(&touch_det, value, now_ms);
+#if TOUCH_TRACE
+        ESP_LOGI(TCH_PAD, "trace:%"PRIu32",%"PRIu16",%"PRId32",%d", now_ms, value, touch_det.tb.value_q8 >> 8, ev);
+#endif
+
+        switch (ev)
+        {
+        case TOUCH_PRESSED:
+            touch_pressed();
+            break;
+        case TOUCH_RELEASED:
+            ESP_LOGI(TCH_PAD, "T%d deactivated!", TOUCH_PAD_IO);
+            break;
+        default:
+            break;
+        }
+
+#if TOUCH_INTERRUPT
+        /* interrupt which woke task may be false alarm, give control back once pad is quiet */
+        bool release = sampling && touch_debounce_idle(&touch_det.db) && now_ms - woken_ms > TOUCH_FILTER_SETTLE_MS;
+        /* drifted baseline moves interrupt threshold as well */
+        if (!sampling || release)
+            touch_pad_set_thresh(TOUCH_PAD_IO, touch_baseline_threshold(&touch_det.tb, TOUCH_THRESH_PERCENT));
+        if (release)
+        {
+            sampling = false;
+            touch_pad_set_filter_period(TOUCHPAD_FILTER_IDLE_PERIOD);
+            touch_pad_clear_status();
+            touch_pad_intr_enable();
+        }
+#endif
+    }
+}
+#endif
+
+/* log line waiting for logger, cut to LOGGER_LINE */
+typedef struct
+{
+    char                text[LOGGER_LINE];
+}logger_line;
+
+static QueueHandle_t logger_lines = NULL;
+static StaticQueue_t logger_queue;
+static uint8_t logger_storage[LOGGER_DEPTH*sizeof(logger_line)];
+/* output which logger replaced, it is kept once saved */
+static vprintf_like_t logger_sink = NULL;
+static uint32_t logger_dropped = 0;
+static portMUX_TYPE logger_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int logger_print(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len=logger_sink(format, args);
+    va_end(args);
+    return len;
+}
+
+/* replaces console output, caller only formats line and does not wait for console */
+static int logger_vprintf(const char *format, va_list args)
+{
+    logger_line line;
+    int len=vsnprintf(line.text, sizeof(line.text), format, args);
+    if (len<0)
+        return len;
+    /* cut line still ends, next one starts on its own */
+    if ((size_t)len>=sizeof(line.text))
+        line.text[sizeof(line.text)-2]='\n';
+    if (xQueueSend(logger_lines, &line, 0)!=pdTRUE)
+    {
+        portENTER_CRITICAL(&logger_lock);
+        logger_dropped++;
+        portEXIT_CRITICAL(&logger_lock);
+    }
+    return len;
+}
+
+/* logger, prints lines queued by other tasks at lowest application priority */
+static void log_write_task(void *arg)
+{
+    logger_line line;
+    while (1)
+    {
+        if (xQueueReceive(logger_lines, &line, portMAX_DELAY) != pdTRUE)
+            continue;
+        logger_print("%s", line.text);
+
+        portENTER_CRITICAL(&logger_lock);
+        uint32_t dropped=logger_dropped;
+        logger_dropped=0;
+        portEXIT_CRITICAL(&logger_lock);
+        if (dropped)
+            logger_print("%"PRIu32" log lines dropped, logger queue full\n", dropped);
+    }
+}
+
+/* route log output through logger or let every task print its own lines again */
+static void logger_enable(bool enabled)
+{
+    if (!logger_sink)
+        logger_sink=esp_log_set_vprintf(vprintf);
+    esp_log_set_vprintf(enabled ? logger_vprintf : logger_sink);
+}
+
+static StackType_t worker_stack[TASK_WORKER_STACK];
+static StaticTask_t worker_tcb;
+static StackType_t touch_stack[TASK_TOUCH_STACK];
+static StaticTask_t touch_tcb;
+static StackType_t writer_stack[TASK_WRITER_STACK];
+static StaticTask_t writer_tcb;
+static StackType_t logger_stack[TASK_LOGGER_STACK];
+static StaticTask_t logger_tcb;
+static TaskHandle_t logger_task = NULL;
+
+static const task_spec task_worker = {"process_telegram", process_telegram, TASK_WORKER_CORE, TASK_WORKER_PRIO,
+                                      TASK_WORKER_STACK, worker_stack, &worker_tcb, &worker_task};
+static const task_spec task_touch = {"touch_sensor_read_task", tp_example_read_task, TASK_TOUCH_CORE, TASK_TOUCH_PRIO,
+                                     TASK_TOUCH_STACK, touch_stack, &touch_tcb, &touch_task};
+static const task_spec task_writer = {"store_write_task", store_write_task, TASK_WRITER_CORE, TASK_WRITER_PRIO,
+                                      TASK_WRITER_STACK, writer_stack, &writer_tcb, &writer_task};
+static const task_spec task_logger = {"log_write_task", log_write_task, TASK_LOGGER_CORE, TASK_LOGGER_PRIO,
+                                      TASK_LOGGER_STACK, logger_stack, &logger_tcb, &logger_task};
+
+static void tp_init()
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    /* Set the GPIO as a push/pull output */
+    gpio_reset_pin(BLUE_LED);
+    gpio_set_direction(BLUE_LED, GPIO_MODE_OUTPUT);
+#endif
+
     // Create Mutex before it is used (in task or ISR)
     // mtx_timer_expired = xSemaphoreCreateMutex();
 
-                xTimer_inactivity = xTimerCreate( " Inactivity timer",       // Just a text name, not used by the kernel.
+                xTimer_inactivity = xTimerCreateStatic( " Inactivity timer",       // Just a text name, not used by the kernel.
                 5000 / portTICK_PERIOD_MS,   // The timer period in ticks.
                 pdFALSE,        // The timers will auto-reload themselves when they expire.
                 ( void * ) 0,  // Assign each timer a unique id equal to its array index.
-                timer_callback); // Each timer calls the same callback when it expires.
+                timer_callback, // Each timer calls the same callback when it expires.
+                &xTimer_inactivity_buffer); // Control block is static, timer never touches heap.
         
                 if( xTimer_inactivity == NULL)        
                 {
@@ -1035,7 +6331,7 @@ static void tp_init()
                     // Start the timer.  No block time is specified, and even if one was
                     // it would be ignored because the scheduler has not yet been
                     // star
-                    if( xTimerStart( xTimer_inactivity, portMAX_DELAY) != pdPASS )
+                    if( xTimerStart( xTimer_inactivity, 0) != pdPASS )
                     {
                         // The timer could not be set into the Active state.
                     }
@@ -1046,98 +6342,985 @@ static void tp_init()
                 {
                         ESP_LOGI(TCH_PAD, "xTimer_inactivity active");
                         ESP_LOGI(TCH_PAD, "Switch on LED");
-                        gpio_set_level(BLUE_LED, 1);
+                        led_set(1);
                 }
                 
-    // Register touch interrupt ISR task
-    // touch_pad_isr_register(tp_example_rtc_intr, NULL);
-    
-    // Start a task to show what pads have been touched
-    xTaskCreate(&tp_example_read_task, "touch_sensor_read_task", 4096, NULL, 5, NULL);
+    // Start a task to show what pads have been touched, it calibrates pad concurrently with BT bring-up
+    task_start(&task_touch);
 }
 
-void app_main(void)
+/* static RAM of every subsystem, checked against RAM_LIMIT_* at compile time and logged at boot */
+#if TRANSPORTS & TRANSPORT_UART
+#define RAM_UART_TASK (sizeof(uart_stack)+sizeof(uart_tcb))
+#else
+#define RAM_UART_TASK 0
+#endif
+#define RAM_WRITER_TASK (sizeof(writer_stack)+sizeof(writer_tcb)+sizeof(store_jobs_queue)+sizeof(store_jobs_storage))
+#define RAM_LOGGER_TASK (sizeof(logger_stack)+sizeof(logger_tcb)+sizeof(logger_queue)+sizeof(logger_storage))
+#define RAM_TASKS (sizeof(worker_stack)+sizeof(worker_tcb)+sizeof(touch_stack)+sizeof(touch_tcb)+sizeof(xTimer_inactivity_buffer)+RAM_UART_TASK \
+                   +RAM_WRITER_TASK+RAM_LOGGER_TASK)
+#define RAM_CONNECTIONS (sizeof(connections)+sizeof(conn_rx_queue)+sizeof(conn_rx_storage)+sizeof(conn_mutex_buffer))
+#define RAM_SESSIONS (sizeof(sessions)+sizeof(session_mutex_buffer)+sizeof(channel_tickets)+sizeof(vault_mutex_buffer))
+#if STATIC_MEMORY
+#define RAM_POOLS (sizeof(mem_small_area)+sizeof(mem_large_area)+sizeof(mem_pools))
+#define RAM_STORE (sizeof(store_snapshot_area)+sizeof(store_snapshot_used))
+#else
+#define RAM_POOLS 0
+#define RAM_STORE 0
+#endif
+#if TRACE_RECORDER
+#define RAM_TRACE (sizeof(trace_ring)+sizeof(trace_mutex_buffer))
+#else
+#define RAM_TRACE 0
+#endif
+#define RAM_BACKUP (sizeof(backup_out)+sizeof(backup_in))
+#define RAM_TOTAL (RAM_TASKS+RAM_CONNECTIONS+RAM_SESSIONS+RAM_POOLS+RAM_STORE+RAM_TRACE+RAM_BACKUP)
+
+_Static_assert(RAM_TASKS<=RAM_LIMIT_TASKS, "task stacks exceed RAM_LIMIT_TASKS");
+_Static_assert(RAM_CONNECTIONS<=RAM_LIMIT_CONNECTIONS, "connection table exceeds RAM_LIMIT_CONNECTIONS");
+_Static_assert(RAM_SESSIONS<=RAM_LIMIT_SESSIONS, "sessions exceed RAM_LIMIT_SESSIONS");
+_Static_assert(RAM_POOLS<=RAM_LIMIT_POOLS, "buffer pools exceed RAM_LIMIT_POOLS");
+_Static_assert(RAM_STORE<=RAM_LIMIT_STORE, "index snapshots exceed RAM_LIMIT_STORE");
+_Static_assert(RAM_TRACE<=RAM_LIMIT_TRACE, "trace ring exceeds RAM_LIMIT_TRACE");
+_Static_assert(RAM_BACKUP<=RAM_LIMIT_BACKUP, "backup buffers exceed RAM_LIMIT_BACKUP");
+_Static_assert(RAM_TOTAL<=RAM_LIMIT_TOTAL, "static RAM exceeds RAM_LIMIT_TOTAL");
+#if STATIC_MEMORY
+_Static_assert(CONN_FRAME_BUF+VAULT_OVERHEAD+sizeof(mem_header)<=MEM_LARGE_SIZE, "sealed record does not fit large block");
+_Static_assert(STORE_SYNC_BATCH*sizeof(store_change)+sizeof(mem_header)<=MEM_LARGE_SIZE, "UI_SYNC batch does not fit large block");
+_Static_assert(sizeof(rcv_tele)+sizeof(mem_header)<=MEM_SMALL_SIZE, "packet descriptor does not fit small block");
+#endif
+
+static void ram_report(void)
 {
-    char bda_str[18] = {0};
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+    ESP_LOGI(MEM_TAG, "%s memory, static RAM: tasks %zu/%d, connections %zu/%d, sessions %zu/%d, pools %zu/%d, store %zu/%d, trace %zu/%d, backup %zu/%d, total %zu/%d bytes",
+             STATIC_MEMORY ? "static" : "heap",
+             (size_t)RAM_TASKS, RAM_LIMIT_TASKS, (size_t)RAM_CONNECTIONS, RAM_LIMIT_CONNECTIONS, (size_t)RAM_SESSIONS, RAM_LIMIT_SESSIONS,
+             (size_t)RAM_POOLS, RAM_LIMIT_POOLS, (size_t)RAM_STORE, RAM_LIMIT_STORE, (size_t)RAM_TRACE, RAM_LIMIT_TRACE,
+             (size_t)RAM_BACKUP, RAM_LIMIT_BACKUP, (size_t)RAM_TOTAL, RAM_LIMIT_TOTAL);
+    mem_report();
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/* client of host load generator, it keeps bytes it was sent until they are taken */
+typedef struct
+{
+    uint8_t             rx[LOAD_RX_BUF];   /*!< Received stream, oldest bytes are dropped when it is full */
+    size_t              rx_len;            /*!< Number of bytes in rx */
+    int64_t             rx_us;             /*!< Time of last send to client */
+    int64_t             first_us;          /*!< Time of send which found rx empty */
+}load_client;
+
+static const uint8_t load_peers[LOAD_CLIENTS][ESP_BD_ADDR_LEN] = {{'L', 'O', 'A', 'D', 0, 0}, {'L', 'O', 'A', 'D', 0, 1}};
+static transport_stats load_stats;
+static load_client load_clients[LOAD_CLIENTS];
+/* given on every send, generator does not have to poll with tick resolution */
+static SemaphoreHandle_t load_signal;
+static StaticSemaphore_t load_signal_buffer;
+
+static esp_err_t load_send(uint32_t handle, const uint8_t* data, size_t len)
+{
+    if (handle-LOAD_HANDLE>=LOAD_CLIENTS)
+        return ESP_ERR_INVALID_ARG;
+    load_client *client=&load_clients[handle-LOAD_HANDLE];
+    size_t take=(len>LOAD_RX_BUF) ? LOAD_RX_BUF : len;
+    portENTER_CRITICAL(&transport_lock);
+    if (client->rx_len==0)
+        client->first_us=esp_timer_get_time();
+    size_t keep=(client->rx_len>LOAD_RX_BUF-take) ? LOAD_RX_BUF-take : client->rx_len;
+    memmove(client->rx, client->rx+client->rx_len-keep, keep);
+    memcpy(client->rx+keep, data+len-take, take);
+    client->rx_len=keep+take;
+    client->rx_us=esp_timer_get_time();
+    portEXIT_CRITICAL(&transport_lock);
+    xSemaphoreGive(load_signal);
+    return ESP_OK;
+}
+
+static void load_disconnect(uint32_t handle)
+{
+}
+
+/* never started, generators open their connections directly */
+static const transport_ops transport_load = {"load", NULL, load_send, load_disconnect, true, false, false, &load_stats};
+
+static bool load_open(size_t client)
+{
+    if (!load_signal)
+        load_signal=xSemaphoreCreateBinaryStatic(&load_signal_buffer);
+    portENTER_CRITICAL(&transport_lock);
+    load_clients[client].rx_len=0;
+    portEXIT_CRITICAL(&transport_lock);
+    return transport_opened(&transport_load, LOAD_HANDLE+client, load_peers[client]);
+}
+
+static void load_close(size_t client)
+{
+    transport_closed(LOAD_HANDLE+client);
+}
+
+/* wait for next send to any client, false when nothing came within timeout */
+static bool load_wait(TickType_t start)
+{
+    TickType_t waited=xTaskGetTickCount()-start;
+    if (waited>pdMS_TO_TICKS(LOAD_TIMEOUT_MS))
+        return false;
+    xSemaphoreTake(load_signal, pdMS_TO_TICKS(LOAD_TIMEOUT_MS)-waited+1);
+    return true;
+}
+
+static bool load_echoed(size_t client, const char *echo)
+{
+    size_t len=strlen(echo);
+    portENTER_CRITICAL(&transport_lock);
+    load_client *c=&load_clients[client];
+    bool seen=(c->rx_len>=len && memcmp(c->rx+c->rx_len-len, echo, len)==0);
+    portEXIT_CRITICAL(&transport_lock);
+    return seen;
+}
+
+/* take first len bytes client was sent, us gets time of the send which completed them */
+static bool load_take(size_t client, uint8_t *out, size_t len, int64_t *us)
+{
+    TickType_t start=xTaskGetTickCount();
+    load_client *c=&load_clients[client];
+    while (1)
+    {
+        portENTER_CRITICAL(&transport_lock);
+        bool ready=(c->rx_len>=len);
+        if (ready)
+        {
+            memcpy(out, c->rx, len);
+            memmove(c->rx, c->rx+len, c->rx_len-len);
+            c->rx_len-=len;
+            *us=c->rx_us;
+        }
+        portEXIT_CRITICAL(&transport_lock);
+        if (ready)
+            return true;
+        if (!load_wait(start))
+            return false;
     }
-    ESP_ERROR_CHECK( ret );
+}
 
+/* drop whatever client was sent, returns its number of bytes, first_us gets time of first one */
+static size_t load_drain(size_t client, int64_t *first_us)
+{
+    load_client *c=&load_clients[client];
+    portENTER_CRITICAL(&transport_lock);
+    size_t len=c->rx_len;
+    *first_us=c->first_us;
+    c->rx_len=0;
+    portEXIT_CRITICAL(&transport_lock);
+    return len;
+}
 
-    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_BLE));
+/* number of bytes client was sent and did not take yet */
+static size_t load_received(size_t client)
+{
+    portENTER_CRITICAL(&transport_lock);
+    size_t len=load_clients[client].rx_len;
+    portEXIT_CRITICAL(&transport_lock);
+    return len;
+}
 
-    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-    if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s initialize controller failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+/* take whole AEAD frame, returns its length or 0 */
+static size_t load_take_frame(size_t client, uint8_t *frame, size_t size, int64_t *us)
+{
+    if (!load_take(client, frame, CHANNEL_HEADER, us) || frame[0]!=CHANNEL_FRAME)
+        return 0;
+    size_t len=CHANNEL_HEADER+((size_t)frame[1]<<8 | frame[2]);
+    if (len>size || !load_take(client, frame+CHANNEL_HEADER, len-CHANNEL_HEADER, us))
+        return 0;
+    return len;
+}
+
+/*
+  Store, look up, acknowledge and erase one domain, then wait for echo of the request
+  number. Telegrams of one connection are processed in order, so echo closes request.
+ */
+static bool load_request(uint32_t n)
+{
+    uint32_t k=n%LOAD_DOMAINS;
+    char telegrams[5][48];
+    snprintf(telegrams[0], sizeof(telegrams[0]), "%d#%"PRIu32",load%"PRIu32",user%"PRIu32",pass%"PRIu32, UI_NEW_CREDENTIAL, 2*n+1, k, k, n);
+    snprintf(telegrams[1], sizeof(telegrams[1]), "%d,load%"PRIu32, UI_LOGPASS, k);
+    snprintf(telegrams[2], sizeof(telegrams[2]), "%d,load%"PRIu32, UI_DONE, k);
+    snprintf(telegrams[3], sizeof(telegrams[3]), "%d#%"PRIu32",load%"PRIu32, UI_ERASE, 2*n+2, k);
+    snprintf(telegrams[4], sizeof(telegrams[4]), "%d,load,%"PRIu32, UI_ECHO, n);
+    for (size_t i = 0; i < sizeof(telegrams)/sizeof(telegrams[0]); i++)
+    {
+        if (!transport_received(&transport_load, LOAD_HANDLE, (uint8_t*)telegrams[i], strlen(telegrams[i])))
+            return false;
     }
 
-    if ((ret = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT)) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+    /* worker runs above app_main, it is waiting for next packet again once echo is seen here */
+    TickType_t start=xTaskGetTickCount();
+    while (!load_echoed(0, telegrams[4]))
+    {
+        if (!load_wait(start))
+            return false;
     }
+    return true;
+}
 
-    if ((ret = esp_bluedroid_init()) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s initialize bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+/*
+  Host load generator: after warm-up every call site has to hold no more bytes and
+  blocks after requests than before them. Returns number of sites which grew,
+  -1 when client can not connect or request is not answered.
+ */
+static int32_t load_check(uint32_t requests)
+{
+    if (!load_open(0))
+        return -1;
+
+    mem_usage before[MEM_SITES], after[MEM_SITES];
+    for (uint32_t n = 0; n < LOAD_WARMUP+requests; n++)
+    {
+        if (n==LOAD_WARMUP)
+            mem_usage_get(before);
+        if (!load_request(n))
+        {
+            ESP_LOGE(MEM_TAG, "load request %"PRIu32" not answered within %d ms", n, LOAD_TIMEOUT_MS);
+            return -1;
+        }
     }
+    if (requests==0)
+        mem_usage_get(before);
+    mem_usage_get(after);
 
-    if ((ret = esp_bluedroid_enable()) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s enable bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+    int32_t grew=0;
+    uint32_t allocations=0;
+    for (size_t i = 0; i < MEM_SITES; i++)
+    {
+        allocations+=after[i].count-before[i].count;
+        if (after[i].live>before[i].live || after[i].blocks>before[i].blocks)
+        {
+            ESP_LOGE(MEM_TAG, "%s grew from %"PRIu32" bytes in %"PRIu32" blocks to %"PRIu32" bytes in %"PRIu32" blocks",
+                     mem_site_name[i], before[i].live, before[i].blocks, after[i].live, after[i].blocks);
+            grew++;
+        }
     }
+    ESP_LOGI(MEM_TAG, "load check: %"PRIu32" requests, %"PRIu32" allocations, %"PRId32" sites grew", requests, allocations, grew);
+    return grew;
+}
 
-    if ((ret = esp_bt_gap_register_callback(esp_bt_gap_cb)) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s gap register failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+/* send telegrams of client and wait for echo which follows them, as in load_request */
+static bool topology_script(size_t client, char telegrams[][48], size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!transport_received(&transport_load, LOAD_HANDLE+client, (uint8_t*)telegrams[i], strlen(telegrams[i])))
+            return false;
     }
+    TickType_t start=xTaskGetTickCount();
+    while (!load_echoed(client, telegrams[count-1]))
+    {
+        if (!load_wait(start))
+            return false;
+    }
+    return true;
+}
 
-    if ((ret = esp_spp_register_callback(esp_spp_cb)) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s spp register failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+/*
+  Host benchmark of task topologies. First client stores records while second one looks
+  up another record at the same moment, with and without storage writer and logger.
+  Lines are logged at INFO level, so console costs as much as on device. Returns -1
+  when request is not answered.
+ */
+static int32_t topology_bench(uint32_t requests)
+{
+    if (requests>BENCH_SAMPLES)
+        requests=BENCH_SAMPLES;
+    if (!load_open(0) || !load_open(1))
+        return -1;
+
+    char telegrams[LOAD_DOMAINS+1][48];
+    snprintf(telegrams[0], sizeof(telegrams[0]), "%d,topo0,user0,pass0", UI_NEW_CREDENTIAL);
+    snprintf(telegrams[1], sizeof(telegrams[1]), "%d,topo,0", UI_ECHO);
+    if (!topology_script(0, telegrams, 2))
+        return -1;
+
+    int64_t summary[4][2];
+    for (size_t t = 0; t < 4; t++)
+    {
+        bool writer=(t&1), logger=(t&2);
+        /* mutations queued under previous topology are stored first */
+        while (store_writes_pending(NULL))
+            vTaskDelay(1);
+        writer_enabled=writer;
+        logger_enable(logger);
+
+        for (uint32_t n = 0; n < requests; n++)
+        {
+            uint32_t k=1+n%(LOAD_DOMAINS-1);
+            char mutation[48], lookup[24], done[24];
+            snprintf(mutation, sizeof(mutation), "%d,topo%"PRIu32",user%"PRIu32",pass%"PRIu32, UI_NEW_CREDENTIAL, k, k, n);
+            snprintf(lookup, sizeof(lookup), "%d,topo0", UI_LOGPASS);
+            snprintf(done, sizeof(done), "%d,topo0", UI_DONE);
+
+            int64_t first_us;
+            load_drain(0, &first_us);
+            load_drain(1, &first_us);
+            int64_t sent=esp_timer_get_time();
+            if (!transport_received(&transport_load, LOAD_HANDLE, (uint8_t*)mutation, strlen(mutation))
+                || !transport_received(&transport_load, LOAD_HANDLE+1, (uint8_t*)lookup, strlen(lookup)))
+                return -1;
+
+            TickType_t start=xTaskGetTickCount();
+            while (load_received(0)==0 || load_received(1)==0)
+            {
+                if (!load_wait(start))
+                {
+                    logger_enable(false);
+                    ESP_LOGE(BNC_TAG, "topology request %"PRIu32" not answered within %d ms", n, LOAD_TIMEOUT_MS);
+                    return -1;
+                }
+            }
+            load_drain(0, &first_us);
+            bench_samples[0][n]=first_us-sent;
+            load_drain(1, &first_us);
+            bench_samples[1][n]=first_us-sent;
+            transport_received(&transport_load, LOAD_HANDLE+1, (uint8_t*)done, strlen(done));
+        }
+
+        /* results are not queued behind lines which logger may drop */
+        logger_enable(false);
+        while (uxQueueMessagesWaiting(logger_lines))
+            vTaskDelay(1);
+        char name[64];
+        snprintf(name, sizeof(name), "writer %s, logger %s, mutation", writer ? "on" : "off", logger ? "on" : "off");
+        summary[t][0]=bench_report(name, bench_samples[0], requests);
+        snprintf(name, sizeof(name), "writer %s, logger %s, lookup", writer ? "on" : "off", logger ? "on" : "off");
+        summary[t][1]=bench_report(name, bench_samples[1], requests);
     }
 
-    esp_spp_cfg_t bt_spp_cfg = {
-        .mode = esp_spp_mode,
-        .enable_l2cap_ertm = esp_spp_enable_l2cap_ertm,
-        .tx_buffer_size = 0, /* Only used for ESP_SPP_MODE_VFS mode */
-    };
-    if ((ret = esp_spp_enhanced_init(&bt_spp_cfg)) != ESP_OK) {
-        ESP_LOGE(SPP_TAG, "%s spp init failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+    /* records of benchmark are erased again */
+    while (store_writes_pending(NULL))
+        vTaskDelay(1);
+    for (size_t k = 0; k < LOAD_DOMAINS; k++)
+        snprintf(telegrams[k], sizeof(telegrams[k]), "%d,topo%zu", UI_ERASE, k);
+    snprintf(telegrams[LOAD_DOMAINS], sizeof(telegrams[LOAD_DOMAINS]), "%d,topo,1", UI_ECHO);
+    bool erased=topology_script(0, telegrams, LOAD_DOMAINS+1);
+
+    writer_enabled=TASK_WRITER;
+    logger_enable(TASK_LOGGER);
+    for (size_t t = 0; t < 4; t++)
+        ESP_LOGI(BNC_TAG, "writer %s, logger %s: median mutation %"PRId64" us, median lookup %"PRId64" us",
+                 (t&1) ? "on" : "off", (t&2) ? "on" : "off", summary[t][0], summary[t][1]);
+    load_close(0);
+    load_close(1);
+    return erased ? 0 : -1;
+}
+
+/* LOGPC side of AEAD frame, telegram at frame+CHANNEL_HEADER is followed by room for mac */
+static bool bench_seal(mbedtls_gcm_context *gcm, uint64_t seq, uint8_t *frame, size_t len)
+{
+    uint8_t nonce[VAULT_NONCE_LEN];
+    channel_nonce(seq, nonce);
+    frame[0]=CHANNEL_FRAME;
+    frame[1]=(len+CHANNEL_MAC_LEN)>>8;
+    frame[2]=(len+CHANNEL_MAC_LEN)&0xff;
+    return mbedtls_gcm_crypt_and_tag(gcm, MBEDTLS_GCM_ENCRYPT, len, nonce, sizeof(nonce), frame, CHANNEL_HEADER,
+                                     frame+CHANNEL_HEADER, frame+CHANNEL_HEADER, CHANNEL_MAC_LEN, frame+CHANNEL_HEADER+len)==0;
+}
+
+/* open frame of device in place, returns length of telegram at frame+CHANNEL_HEADER or -1 */
+static int32_t bench_unseal(mbedtls_gcm_context *gcm, uint64_t seq, uint8_t *frame, size_t len)
+{
+    if (len<CHANNEL_HEADER+CHANNEL_MAC_LEN)
+        return -1;
+    size_t plain=len-CHANNEL_HEADER-CHANNEL_MAC_LEN;
+    uint8_t nonce[VAULT_NONCE_LEN];
+    channel_nonce(seq, nonce);
+    if (mbedtls_gcm_auth_decrypt(gcm, plain, nonce, sizeof(nonce), frame, CHANNEL_HEADER,
+                                 frame+CHANNEL_HEADER+plain, CHANNEL_MAC_LEN, frame+CHANNEL_HEADER, frame+CHANNEL_HEADER)!=0)
+        return -1;
+    return plain;
+}
+
+/* first sealed frame of new channel carries next ticket, it proves both sides derived the same keys */
+static bool bench_ticket(size_t client, const uint8_t keys[3*CHANNEL_KEY_LEN], uint8_t ticket[2*CHANNEL_TICKET_LEN], int64_t *us)
+{
+    uint8_t frame[CHANNEL_HEADER+3+2*CHANNEL_TICKET_LEN+CHANNEL_MAC_LEN];
+    size_t len=load_take_frame(client, frame, sizeof(frame), us);
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int32_t plain=-1;
+    if (len && mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, keys+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN*8)==0)
+        plain=bench_unseal(&gcm, 0, frame, len);
+    mbedtls_gcm_free(&gcm);
+    if (plain!=3+2*CHANNEL_TICKET_LEN || memcmp(frame+CHANNEL_HEADER, "11,", 3)!=0)
+        return false;
+    memcpy(ticket, frame+CHANNEL_HEADER+3, 2*CHANNEL_TICKET_LEN);
+    return true;
+}
+
+/* LOGPC side of full handshake, us gets time from UI_HELLO until ticket frame */
+static bool bench_hello(size_t client, mbedtls_ecp_group *grp, uint8_t keys[3*CHANNEL_KEY_LEN], uint8_t ticket[2*CHANNEL_TICKET_LEN], int64_t *us)
+{
+    mbedtls_mpi eph, shared;
+    mbedtls_ecp_point eph_pub, peer_pub;
+    mbedtls_mpi_init(&eph);
+    mbedtls_mpi_init(&shared);
+    mbedtls_ecp_point_init(&eph_pub);
+    mbedtls_ecp_point_init(&peer_pub);
+
+    /* transcript: label | own ephemeral | device ephemeral | device static */
+    uint8_t info[sizeof(CHANNEL_HELLO_INFO)-1+3*CHANNEL_KEY_LEN];
+    uint8_t *transcript=info+sizeof(CHANNEL_HELLO_INFO)-1;
+    memcpy(info, CHANNEL_HELLO_INFO, sizeof(CHANNEL_HELLO_INFO)-1);
+    uint8_t hello[3+2*CHANNEL_KEY_LEN];
+    uint8_t reply[3+2*CHANNEL_KEY_LEN+1+2*CHANNEL_KEY_LEN];
+    uint8_t ikm[2*CHANNEL_KEY_LEN];
+    size_t olen;
+    int64_t start=0, end;
+    int ret=mbedtls_ecdh_gen_public(grp, &eph, &eph_pub, channel_rng, NULL);
+    if (ret==0)
+        ret=mbedtls_ecp_point_write_binary(grp, &eph_pub, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, transcript, CHANNEL_KEY_LEN);
+    if (ret==0)
+    {
+        memcpy(hello, "10,", 3);
+        hex_encode(transcript, CHANNEL_KEY_LEN, hello+3);
+        start=esp_timer_get_time();
+        if (!transport_received(&transport_load, LOAD_HANDLE+client, hello, sizeof(hello)) ||
+            !load_take(client, reply, sizeof(reply), &end) || memcmp(reply, "10,", 3)!=0 || reply[3+2*CHANNEL_KEY_LEN]!=',' ||
+            !hex_decode(reply+3, 2*CHANNEL_KEY_LEN, transcript+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN) ||
+            !hex_decode(reply+4+2*CHANNEL_KEY_LEN, 2*CHANNEL_KEY_LEN, transcript+2*CHANNEL_KEY_LEN, CHANNEL_KEY_LEN))
+            ret=-1;
     }
+    /* ephemeral-ephemeral | ephemeral-static, as derived by device */
+    for (size_t i = 0; i < 2 && ret==0; i++)
+    {
+        ret=mbedtls_ecp_point_read_binary(grp, &peer_pub, transcript+(i+1)*CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+        if (ret==0)
+            ret=mbedtls_ecdh_compute_shared(grp, &shared, &peer_pub, &eph, channel_rng, NULL);
+        if (ret==0)
+            ret=mbedtls_mpi_write_binary_le(&shared, ikm+i*CHANNEL_KEY_LEN, CHANNEL_KEY_LEN);
+    }
+    if (ret==0)
+        ret=mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, ikm, sizeof(ikm), info, sizeof(info), keys, 3*CHANNEL_KEY_LEN);
+    mbedtls_platform_zeroize(ikm, sizeof(ikm));
+    mbedtls_mpi_free(&eph);
+    mbedtls_mpi_free(&shared);
+    mbedtls_ecp_point_free(&eph_pub);
+    mbedtls_ecp_point_free(&peer_pub);
+
+    if (ret!=0 || !bench_ticket(client, keys, ticket, &end))
+        return false;
+    *us=end-start;
+    return true;
+}
 
-// #if (CONFIG_BT_SSP_ENABLED == true)
-    /* Set default parameters for Secure Simple Pairing */
-    esp_bt_sp_param_t param_type = ESP_BT_SP_IOCAP_MODE;
-    esp_bt_io_cap_t iocap = ESP_BT_IO_CAP_IO;
-    esp_bt_gap_set_security_param(param_type, &iocap, sizeof(uint8_t));
-// #endif
+/* LOGPC side of resumption, keys hold secret of ticket and get keys of resumed channel */
+static bool bench_resume(size_t client, uint8_t keys[3*CHANNEL_KEY_LEN], uint8_t ticket[2*CHANNEL_TICKET_LEN], int64_t *us)
+{
+    /* client nonce | server nonce */
+    uint8_t salt[2*CHANNEL_NONCE_LEN];
+    esp_fill_random(salt, CHANNEL_NONCE_LEN);
+    uint8_t resume[3+2*CHANNEL_TICKET_LEN+1+2*CHANNEL_NONCE_LEN];
+    uint8_t reply[3+2*CHANNEL_NONCE_LEN];
+    memcpy(resume, "11,", 3);
+    memcpy(resume+3, ticket, 2*CHANNEL_TICKET_LEN);
+    resume[3+2*CHANNEL_TICKET_LEN]=',';
+    hex_encode(salt, CHANNEL_NONCE_LEN, resume+4+2*CHANNEL_TICKET_LEN);
+
+    int64_t start=esp_timer_get_time(), end;
+    if (!transport_received(&transport_load, LOAD_HANDLE+client, resume, sizeof(resume)) ||
+        !load_take(client, reply, sizeof(reply), &end) || memcmp(reply, "11,", 3)!=0 ||
+        !hex_decode(reply+3, 2*CHANNEL_NONCE_LEN, salt+CHANNEL_NONCE_LEN, CHANNEL_NONCE_LEN))
+        return false;
 
-    /*
-     * Set default parameters for Legacy Pairing
-     * Use variable pin, input pin code when pairing
-     */
-    esp_bt_pin_type_t pin_type = ESP_BT_PIN_TYPE_VARIABLE;
-    esp_bt_pin_code_t pin_code;
-    esp_bt_gap_set_pin(pin_type, 0, pin_code);
+    uint8_t secret[CHANNEL_KEY_LEN];
+    memcpy(secret, keys+2*CHANNEL_KEY_LEN, sizeof(secret));
+    int ret=mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), salt, sizeof(salt), secret, sizeof(secret),
+                         (const unsigned char*)CHANNEL_RESUME_INFO, sizeof(CHANNEL_RESUME_INFO)-1, keys, 3*CHANNEL_KEY_LEN);
+    mbedtls_platform_zeroize(secret, sizeof(secret));
+    if (ret!=0 || !bench_ticket(client, keys, ticket, &end))
+        return false;
+    *us=end-start;
+    return true;
+}
 
-    ESP_LOGI(SPP_TAG, "Own address:[%s]", bda2str((uint8_t *)esp_bt_dev_get_address(), bda_str, sizeof(bda_str)));
+/*
+  Host benchmark of secure channel: echo of CHANNEL_BENCH_PAYLOAD bytes in plaintext,
+  full handshakes and resumptions on fresh connections, then the same echo sealed.
+  Plaintext runs first, device refuses it from peer which negotiated channel before.
+  Returns number of failed exchanges, -1 when client can not connect.
+ */
+static int32_t channel_bench(uint32_t frames)
+{
+    if (frames==0 || frames>BENCH_SAMPLES)
+        frames=BENCH_SAMPLES;
+    bench_quiet(true);
+    if (!load_open(0))
+        return -1;
+
+    uint8_t echo[3+CHANNEL_BENCH_PAYLOAD];
+    uint8_t frame[CHANNEL_HEADER+sizeof(echo)+CHANNEL_MAC_LEN];
+    memcpy(echo, "18,", 3);
+    memset(echo+3, 'e', CHANNEL_BENCH_PAYLOAD);
+    int32_t faults=0;
+    size_t count=0;
+    int64_t start, end;
+    for (uint32_t i = 0; i < LOAD_WARMUP+frames; i++)
+    {
+        start=esp_timer_get_time();
+        if (!transport_received(&transport_load, LOAD_HANDLE, echo, sizeof(echo)) ||
+            !load_take(0, frame, sizeof(echo), &end) || memcmp(frame, echo, sizeof(echo))!=0)
+            faults++;
+        else if (i>=LOAD_WARMUP)
+            bench_samples[0][count++]=end-start;
+    }
+    int64_t plain=bench_report("plaintext echo", bench_samples[0], count);
+
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_group_init(&grp);
+    if (mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519)!=0)
+    {
+        load_close(0);
+        return -1;
+    }
+
+    /* device answers UI_HELLO and UI_RESUME in plaintext only on link which is not secured yet */
+    uint8_t keys[3*CHANNEL_KEY_LEN];
+    uint8_t ticket[2*CHANNEL_TICKET_LEN];
+    bool secured=false;
+    count=0;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        load_close(0);
+        bool opened=load_open(0);
+        if (opened && bench_hello(0, &grp, keys, ticket, &bench_samples[0][count]))
+        {
+            count++;
+            secured=true;
+        }
+        else
+            faults++;
+    }
+    mbedtls_ecp_group_free(&grp);
+    bench_report("full handshake", bench_samples[0], count);
+
+    count=0;
+    for (uint32_t i = 0; i < frames && secured; i++)
+    {
+        load_close(0);
+        bool opened=load_open(0);
+        if (opened && bench_resume(0, keys, ticket, &bench_samples[0][count]))
+            count++;
+        else
+        {
+            /* ticket is used up either way, next resumption has nothing to offer */
+            faults+=frames-i;
+            secured=false;
+        }
+    }
+    bench_report("resumption", bench_samples[0], count);
+
+    /* last resumed channel: LOGPC->device | device->LOGPC, ticket frame took device sequence 0 */
+    mbedtls_gcm_context tx, rx;
+    mbedtls_gcm_init(&tx);
+    mbedtls_gcm_init(&rx);
+    if (secured && (mbedtls_gcm_setkey(&tx, MBEDTLS_CIPHER_ID_AES, keys, CHANNEL_KEY_LEN*8)!=0 ||
+                    mbedtls_gcm_setkey(&rx, MBEDTLS_CIPHER_ID_AES, keys+CHANNEL_KEY_LEN, CHANNEL_KEY_LEN*8)!=0))
+        secured=false;
+    mbedtls_platform_zeroize(keys, sizeof(keys));
+    count=0;
+    for (uint32_t i = 0; i < frames && secured; i++)
+    {
+        memcpy(frame+CHANNEL_HEADER, echo, sizeof(echo));
+        start=esp_timer_get_time();
+        size_t len=0;
+        if (bench_seal(&tx, i, frame, sizeof(echo)) &&
+            transport_received(&transport_load, LOAD_HANDLE, frame, sizeof(frame)))
+            len=load_take_frame(0, frame, sizeof(frame), &end);
+        if (len && bench_unseal(&rx, i+1, frame, len)==(int32_t)sizeof(echo) && memcmp(frame+CHANNEL_HEADER, echo, sizeof(echo))==0)
+            bench_samples[0][count++]=end-start;
+        else
+            faults++;
+    }
+    mbedtls_gcm_free(&tx);
+    mbedtls_gcm_free(&rx);
+    int64_t sealed=bench_report("sealed echo", bench_samples[0], count);
+    load_close(0);
+
+    ESP_LOGI(BNC_TAG, "channel benchmark: %"PRIu32" frames, sealing adds %d bytes and %"PRId64" us to median echo of %d bytes, %"PRId32" failed",
+             frames, CHANNEL_HEADER+CHANNEL_MAC_LEN, sealed-plain, CHANNEL_BENCH_PAYLOAD, faults);
+    return faults;
+}
+
+/*
+  One echo through backend: load client when fd is negative, otherwise LOGPC on
+  slave side of pty. Pty is polled, blocked read would stall simulated scheduler,
+  yield lets worker and reader run while their time is measured to the microsecond.
+ */
+static bool bench_echo(int fd, const uint8_t *echo, size_t len, uint8_t *reply, int64_t *end)
+{
+    /* telegram ends with newline over serial line, reply does not */
+    size_t reply_len=len-1;
+    if (fd<0)
+        return transport_received(&transport_load, LOAD_HANDLE, echo, reply_len) && load_take(0, reply, reply_len, end);
+
+    if (write(fd, echo, len)!=(ssize_t)len)
+        return false;
+    TickType_t start=xTaskGetTickCount();
+    for (size_t got = 0; got < reply_len; )
+    {
+        ssize_t n=read(fd, reply+got, reply_len-got);
+        if (n>0)
+        {
+            got+=n;
+            *end=esp_timer_get_time();
+        }
+        else if (xTaskGetTickCount()-start>pdMS_TO_TICKS(LOAD_TIMEOUT_MS))
+            return false;
+        else
+            taskYIELD();
+    }
+    return true;
+}
+
+/* echo series through one backend, logs latency and throughput, returns number of failed echoes */
+static int32_t bench_transport(const char *name, int fd, uint32_t frames)
+{
+    uint8_t echo[3+TRANSPORT_BENCH_PAYLOAD+1], reply[sizeof(echo)];
+    memcpy(echo, "18,", 3);
+    memset(echo+3, 't', TRANSPORT_BENCH_PAYLOAD);
+    echo[sizeof(echo)-1]='\n';
+
+    int32_t faults=0;
+    size_t count=0;
+    int64_t busy=0, start, end;
+    for (uint32_t i = 0; i < LOAD_WARMUP+frames; i++)
+    {
+        start=esp_timer_get_time();
+        if (!bench_echo(fd, echo, sizeof(echo), reply, &end) || memcmp(reply, echo, sizeof(echo)-1)!=0)
+            faults++;
+        else if (i>=LOAD_WARMUP)
+        {
+            bench_samples[0][count++]=end-start;
+            busy+=end-start;
+        }
+    }
+    bench_report(name, bench_samples[0], count);
+    /* telegram and reply of every echo cross the link */
+    ESP_LOGI(BNC_TAG, "%s: %zu echoes of %zu bytes, %"PRId64" bytes/s, %"PRId32" failed",
+             name, count, sizeof(echo)-1, busy ? (int64_t)(2*(sizeof(echo)-1)*count)*1000000/busy : 0, faults);
+    return faults;
+}
+
+/*
+  Host benchmark of transports: the same echo through loopback client, which costs
+  only engine and worker, and through every backend available on linux target.
+  Returns number of failed echoes, -1 when a backend can not be attached.
+ */
+static int32_t transport_bench(uint32_t frames)
+{
+    if (frames==0 || frames>BENCH_SAMPLES)
+        frames=BENCH_SAMPLES;
+    bench_quiet(true);
+    if (!load_open(0))
+        return -1;
+    int32_t faults=bench_transport("load echo", -1, frames);
+    load_close(0);
+#if TRANSPORTS & TRANSPORT_UART
+    int fd=open(uart_pty, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd<0)
+    {
+        ESP_LOGE(BNC_TAG, "pty %s failed to open", uart_pty);
+        return -1;
+    }
+    faults+=bench_transport("uart echo", fd, frames);
+    close(fd);
+#endif
+    return faults;
+}
+
+/* records of downloaded trace */
+static trace_record trace_replay_records[TRACE_REPLAY_RECORDS];
+
+/* traced handle replayed by loopback client */
+typedef struct
+{
+    uint32_t            handle;
+    bool                pending;        /*!< Recorded packet was answered, replayed one not yet */
+    int64_t             sent_us;        /*!< Replayed packet passed to engine */
+    int64_t             recorded_us;    /*!< Recorded time from packet to reply */
+}trace_replay_client;
+
+/*
+  Read file of UI_TRACE replies (or only their records), one per line.
+  Returns number of records or -1 when file can not be read or record is damaged.
+ */
+static int32_t trace_replay_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        ESP_LOGE(TRC_TAG, "trace %s can not be opened", path);
+        return -1;
+    }
+
+    int32_t count = 0;
+    bool damaged = false;
+    char line[MAX_TELEGRAM+2];
+    while (!damaged && count < TRACE_REPLAY_RECORDS && fgets(line, sizeof(line), f))
+    {
+        /* records are hex, they follow the last separator of reply */
+        const char *hex = strrchr(line, EXT);
+        hex = hex ? hex+1 : line;
+        size_t len = strcspn(hex, "\r\n");
+        while (len > 0 && count < TRACE_REPLAY_RECORDS)
+        {
+            uint8_t raw[18+TRACE_PAYLOAD];
+            if (len < 36 || !hex_decode((const uint8_t*)hex, 36, raw, 18) || raw[17] > TRACE_PAYLOAD
+                || len < 36+2*(size_t)raw[17] || !hex_decode((const uint8_t*)hex+36, 2*raw[17], raw+18, raw[17]))
+            {
+                damaged = true;
+                break;
+            }
+            trace_record *rec = &trace_replay_records[count];
+            rec->seq = count++;
+            rec->us = 0;
+            for (int i = 0; i < 8; i++)
+                rec->us |= (int64_t)raw[i] << (8*i);
+            rec->handle = 0;
+            for (int i = 0; i < 4; i++)
+                rec->handle |= (uint32_t)raw[8+i] << (8*i);
+            rec->kind = raw[12];
+            rec->depth = raw[13] | raw[14] << 8;
+            rec->len = raw[15] | raw[16] << 8;
+            rec->payload_len = raw[17];
+            memcpy(rec->payload, raw+18, raw[17]);
+            hex += 36+2*raw[17];
+            len -= 36+2*raw[17];
+        }
+    }
+    fclose(f);
+
+    if (damaged)
+        ESP_LOGE(TRC_TAG, "trace %s damaged after %"PRId32" records", path, count);
+    return damaged ? -1 : count;
+}
+
+/* pair reply of client with recorded one once it came, when asked to wait for it until timeout */
+static void trace_replay_collect(size_t client, trace_replay_client *rc, bool wait, size_t *samples, uint32_t *missing)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (rc->pending)
+    {
+        int64_t first_us;
+        if (load_drain(client, &first_us))
+        {
+            bench_samples[0][*samples] = rc->recorded_us;
+            bench_samples[1][*samples] = first_us-rc->sent_us;
+            bench_samples[2][*samples] = first_us-rc->sent_us-rc->recorded_us;
+            (*samples)++;
+            rc->pending = false;
+        }
+        else if (!wait)
+            return;
+        else if (!load_wait(start))
+        {
+            if ((*missing)++ < TRACE_REPLAY_REPORT)
+                ESP_LOGE(BNC_TAG, "reply to handle:%"PRIu32" not replayed within %d ms", rc->handle, LOAD_TIMEOUT_MS);
+            rc->pending = false;
+        }
+    }
+}
 
-    /* Create a queue capable of containing 10 char* */
-    ReceivedQueue = xQueueCreate( 10, sizeof( rcv_tele* ) ); 
+/*
+  Host replay of traffic trace: received packets of up to LOAD_CLIENTS handles are
+  sent again through loopback clients, spaced as recorded divided by speed (0 sends
+  every packet right after previous reply). Masked bytes and bytes which were cut
+  off stay '*'. Keys of a recorded channel are unknown, so handshakes and sealed
+  frames are skipped. Delay of first reply is compared with the recorded one.
+  Returns number of replies which did not come, -1 when trace can not be read.
+ */
+static int32_t trace_replay(const char *path, uint32_t speed)
+{
+    int32_t count = trace_replay_load(path);
+    if (count <= 0)
+        return -1;
+    bench_quiet(true);
+
+    trace_replay_client clients[LOAD_CLIENTS] = {0};
+    size_t used = 0, samples = 0;
+    uint32_t replayed = 0, skipped = 0, missing = 0;
+    int64_t first = trace_replay_records[0].us, start = esp_timer_get_time();
+    uint8_t packet[CONN_FRAME_BUF];
+    for (int32_t i = 0; i < count; i++)
+    {
+        const trace_record *rec = &trace_replay_records[i];
+        if (rec->kind != TRACE_RX)
+            continue;
+
+        size_t c = 0;
+        while (c < used && clients[c].handle != rec->handle)
+            c++;
+        if (c == used && used < LOAD_CLIENTS)
+        {
+            if (!load_open(used))
+                return -1;
+            clients[used++].handle = rec->handle;
+        }
+        size_t sep;
+        UI_ENUM mode = telegram_mode(rec->payload, rec->payload_len, &sep);
+        if (c == LOAD_CLIENTS || (rec->payload_len > 0 && rec->payload[0] == CHANNEL_FRAME) || mode == UI_HELLO || mode == UI_RESUME)
+        {
+            skipped++;
+            continue;
+        }
+
+        /* connection is processed in order, reply to previous packet comes first */
+        trace_replay_collect(c, &clients[c], true, &samples, &missing);
+        if (speed)
+        {
+            int64_t due = start+(rec->us-first)/speed, left;
+            while ((left = due-esp_timer_get_time()) > 0)
+            {
+                for (size_t k = 0; k < used; k++)
+                    trace_replay_collect(k, &clients[k], false, &samples, &missing);
+                if (left > portTICK_PERIOD_MS*1000)
+                    vTaskDelay(1);
+                else
+                    taskYIELD();
+            }
+        }
+
+        /* recorded reply is the first telegram sent to handle before its next packet */
+        clients[c].pending = false;
+        for (int32_t k = i+1; k < count; k++)
+        {
+            const trace_record *next = &trace_replay_records[k];
+            if (next->handle != rec->handle || (next->kind != TRACE_RX && next->kind != TRACE_TX))
+                continue;
+            clients[c].pending = (next->kind == TRACE_TX);
+            clients[c].recorded_us = next->us-rec->us;
+            break;
+        }
 
-    // /* Task for process received telegrams */
-    // TaskHandle_t ProcessMsgTaskHandle;
+        size_t len = (rec->len < sizeof(packet)) ? rec->len : sizeof(packet);
+        size_t kept = (rec->payload_len < len) ? rec->payload_len : len;
+        memcpy(packet, rec->payload, kept);
+        memset(packet+kept, '*', len-kept);
+        int64_t stale;
+        load_drain(c, &stale);
+        clients[c].sent_us = esp_timer_get_time();
+        if (!transport_received(&transport_load, LOAD_HANDLE+c, packet, len))
+            clients[c].pending = false;
+        replayed++;
+    }
+    for (size_t c = 0; c < used; c++)
+    {
+        trace_replay_collect(c, &clients[c], true, &samples, &missing);
+        load_close(c);
+    }
 
-    /*Create task processing received telegram*/
-    xTaskCreate(&process_telegram, "process_telegram", 2048,NULL,1,NULL );
+    bench_report("recorded reply", bench_samples[0], samples);
+    bench_report("replayed reply", bench_samples[1], samples);
+    bench_report("replayed minus recorded", bench_samples[2], samples);
+    ESP_LOGI(BNC_TAG, "trace replay: %"PRId32" records, %"PRIu32" packets replayed, %"PRIu32" skipped, %"PRIu32" replies missing, speed %"PRIu32,
+             count, replayed, skipped, missing, speed);
+    return missing;
+}
+#endif
 
-    /* Touch pad init */
+void app_main(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK( ret );
+    boot_mark(BOOT_NVS);
+#if !CONFIG_NVS_ENCRYPTION
+    /* device secret lies in the same flash as records it seals */
+    ESP_LOGW(VLT_KEY, "NVS is not encrypted, flash dump reveals device secret and every credential");
+#endif
+#if CONFIG_IDF_TARGET_LINUX
+    /* host check of touch detector against trace logged by device with TOUCH_TRACE */
+    const char *replay = getenv("TOUCH_REPLAY");
+    if (replay)
+        exit(touch_replay(replay) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host check of index snapshot against concurrent readers */
+    const char *stress = getenv("SNAPSHOT_STRESS");
+    if (stress)
+        exit(store_snapshot_stress(strtoul(stress, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host check of power policy against scripted timeline */
+    if (getenv("POWER_CHECK"))
+        exit(power_check() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+
+    /* guards session key shared by worker, BT callback and timer */
+    vault_mutex = xSemaphoreCreateMutexStatic(&vault_mutex_buffer);
+    /* guards connection table shared by worker, touch task and BT callback */
+    conn_mutex = xSemaphoreCreateMutexStatic(&conn_mutex_buffer);
+    /* guards peer sessions shared by worker and BT callback */
+    session_mutex = xSemaphoreCreateMutexStatic(&session_mutex_buffer);
+    /* power manager is fed by BT callback, touch task and timer */
+    power_init();
+#if TRACE_RECORDER
+    /* trace ring is written by BT callback, worker and touch task */
+    trace_mutex = xSemaphoreCreateMutexStatic(&trace_mutex_buffer);
+#endif
+#if CONFIG_IDF_TARGET_LINUX
+    /* host benchmark of vault, it needs its mutex but no task */
+    const char *vault = getenv("VAULT_BENCH");
+    if (vault)
+        exit(vault_bench(strtoul(vault, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+
+    /* every connection gets own queue so busy client can not fill it for others */
+    for (size_t i = 0; i < CONN_SLOTS; i++)
+        connections[i].rx = xQueueCreateStatic( CONN_RX_DEPTH, sizeof( rcv_tele* ), conn_rx_storage[i], &conn_rx_queue[i] );
+
+    /* both tasks always exist, TASK_WRITER and TASK_LOGGER only choose whether they get work */
+    store_jobs = xQueueCreateStatic( CONN_SLOTS, sizeof( store_job ), store_jobs_storage, &store_jobs_queue );
+    logger_lines = xQueueCreateStatic( LOGGER_DEPTH, sizeof( logger_line ), logger_storage, &logger_queue );
+    task_start(&task_logger);
+    logger_enable(TASK_LOGGER);
+
+    /* Create task processing received telegram, it has to exist before BT callback posts to it */
+    task_start(&task_worker);
+    /* writer notifies worker, so it starts after it */
+    task_start(&task_writer);
+
+    /* Touch pad init, calibration runs in touch task while BT is brought up */
     tp_init();
 
+    /* every backend feeds the same connection table, worker does not know the link */
+    for (size_t i = 0; i < sizeof(transport_backends)/sizeof(transport_backends[0]); i++)
+        transport_start(transport_backends[i]);
+
+    /* from here on application buffers come only from static pools (STATIC_MEMORY 1) */
+    ram_report();
+#if CONFIG_IDF_TARGET_LINUX
+    /* host load generator, requests must not leave memory behind */
+    const char *load = getenv("LOAD_CHECK");
+    if (load)
+        exit(load_check(strtoul(load, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host benchmark of handshake cost and per-frame overhead of secure channel */
+    const char *channel = getenv("CHANNEL_BENCH");
+    if (channel)
+        exit(channel_bench(strtoul(channel, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host benchmark of storage writer and logger, latency of mutation and concurrent lookup */
+    const char *topology = getenv("TOPOLOGY_BENCH");
+    if (topology)
+        exit(topology_bench(strtoul(topology, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host benchmark of backends, echo latency percentiles and throughput of each one */
+    const char *transport = getenv("TRANSPORT_BENCH");
+    if (transport)
+        exit(transport_bench(strtoul(transport, NULL, 10)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    /* host replay of traffic trace downloaded with UI_TRACE, TRACE_SPEED divides its spacing */
+    const char *trace = getenv("TRACE_REPLAY");
+    if (trace)
+    {
+        const char *speed = getenv("TRACE_SPEED");
+        exit(trace_replay(trace, speed ? strtoul(speed, NULL, 10) : 1) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+#endif
+
 //TODO: RSA encryption https://docs.espressif.com/projects/esp-idf/en/latest/esp32s2/api-reference/peripherals/ds.html
 }
@@ -0,0 +1,56 @@
+# Static RAM of every subsystem as linked into ELF, run after build:
+#   cmake -DNM=<nm> -DELF=<elf> -DSOURCE=<main.c> -P ram_report.cmake
+# Groups follow RAM_* macros of main.c, limits are read from its RAM_LIMIT_* defines.
+
+set(groups TASKS CONNECTIONS SESSIONS POOLS STORE TRACE BACKUP)
+set(TASKS worker_stack worker_tcb touch_stack touch_tcb xTimer_inactivity_buffer uart_stack uart_tcb
+    writer_stack writer_tcb store_jobs_queue store_jobs_storage logger_stack logger_tcb logger_queue logger_storage)
+set(CONNECTIONS connections conn_rx_queue conn_rx_storage conn_mutex_buffer)
+set(SESSIONS sessions session_mutex_buffer channel_tickets vault_mutex_buffer)
+set(POOLS mem_small_area mem_large_area mem_pools)
+set(STORE store_snapshot_area store_snapshot_used)
+set(TRACE trace_ring trace_mutex_buffer)
+set(BACKUP backup_out backup_in)
+
+execute_process(COMMAND ${NM} -S ${ELF} OUTPUT_VARIABLE symbols RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${NM} can not read ${ELF}")
+endif()
+string(REPLACE "\n" ";" symbols "${symbols}")
+
+file(STRINGS ${SOURCE} limits REGEX "^#define RAM_LIMIT_[A-Z]+ ")
+
+set(total 0)
+set(over "")
+foreach(group ${groups} TOTAL)
+    set(used 0)
+    if(group STREQUAL "TOTAL")
+        set(used ${total})
+    else()
+        foreach(line ${symbols})
+            # "address size type name", local and global data symbols only
+            if(line MATCHES "^[0-9a-fA-F]+ ([0-9a-fA-F]+) [bBdD] ([A-Za-z_0-9]+)$")
+                list(FIND ${group} ${CMAKE_MATCH_2} found)
+                if(NOT found EQUAL -1)
+                    math(EXPR used "${used} + 0x${CMAKE_MATCH_1}")
+                endif()
+            endif()
+        endforeach()
+        math(EXPR total "${total} + ${used}")
+    endif()
+
+    set(limit "?")
+    foreach(define ${limits})
+        if(define MATCHES "^#define RAM_LIMIT_${group} \\(?([0-9*]+)\\)?")
+            math(EXPR limit "${CMAKE_MATCH_1}")
+        endif()
+    endforeach()
+    message(STATUS "static RAM ${group}: ${used}/${limit} bytes")
+    if(NOT limit STREQUAL "?" AND used GREATER limit)
+        list(APPEND over ${group})
+    endif()
+endforeach()
+
+if(over)
+    message(FATAL_ERROR "static RAM over RAM_LIMIT_* of ${over}")
+endif()